@@ -0,0 +1,91 @@
+/*
+Copyright 2022 Mohammad Riazati
+
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "code_emitter.h"
+#include "utils.h"
+#include <cstdio>
+
+CodeEmitter::CodeEmitter(size_t reserve_size) {
+	buffer.reserve(reserve_size);
+}
+
+CodeEmitter::~CodeEmitter() {
+	if (opened) close();
+}
+
+void CodeEmitter::open(const string &file_path, std::ios::openmode mode) {
+	if (opened) close();
+	this->file_path = file_path;
+	append = (mode & std::ios::app) != 0;
+	opened = true;
+	buffer.clear();
+}
+
+void CodeEmitter::close() {
+	if (!opened) return;
+	opened = false;
+
+	FILE *file = fopen(file_path.c_str(), append ? "a" : "w");
+	if (!file) {
+		ERRORLOGT("Cannot write " + file_path);
+		return;
+	}
+	setvbuf(file, nullptr, _IONBF, 0); //The buffer is written with a single write
+	if (fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) ERRORLOGT("Writing " + file_path + " failed");
+	fclose(file);
+}
+
+void CodeEmitter::Line(const string &text, int indent) {
+	AppendIndent(indent);
+	buffer += text;
+	buffer += '\n';
+}
+
+void CodeEmitter::Lines(const string &text, int indent) {
+	size_t begin = 0, end;
+	while ((end = text.find('\n', begin)) != string::npos) {
+		AppendIndent(indent);
+		buffer.append(text, begin, end + 1 - begin);
+		begin = end + 1;
+	}
+	AppendIndent(indent);
+	buffer.append(text, begin, string::npos);
+	buffer += '\n';
+}
+
+void CodeEmitter::EmptyLine(int count) {
+	for (int i = 0; i < count; i++) Line("");
+}
+
+//The values are appended as they are (placeholders in a value are not replaced)
+static void AppendTemplate(string &target, const string &text, std::initializer_list<std::pair<char, string>> values) {
+	size_t copied = 0;
+	for (size_t i = 0; i < text.size(); i++) {
+		for (auto &value : values) {
+			if (text[i] != value.first) continue;
+			target.append(text, copied, i - copied);
+			target += value.second;
+			copied = i + 1;
+			break;
+		}
+	}
+	target.append(text, copied, string::npos);
+}
+
+void CodeEmitter::LineTemplate(const string &text, std::initializer_list<std::pair<char, string>> values, int indent) {
+	AppendIndent(indent);
+	AppendTemplate(buffer, text, values);
+	buffer += '\n';
+}
+
+string FillTemplate(const string &text, std::initializer_list<std::pair<char, string>> values) {
+	string result;
+	result.reserve(text.size() + 64);
+	AppendTemplate(result, text, values);
+	return result;
+}
@@ -0,0 +1,60 @@
+/*
+Copyright 2022 Mohammad Riazati
+
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CODE_EMITTER_H_
+#define CODE_EMITTER_H_
+
+#include <string>
+#include <ostream>
+#include <initializer_list>
+#include <utility>
+#include <type_traits>
+
+using std::string;
+
+//Generated files are built in memory and written once by close()
+//The interface follows ofstream (open, close, <<) so the generators can use it in place of a file stream
+class CodeEmitter {
+public:
+	CodeEmitter(size_t reserve_size = 1 << 20);
+	~CodeEmitter();
+
+	void open(const string &file_path, std::ios::openmode mode = std::ios::out);
+	void close();
+	bool is_open() const { return opened; }
+
+	//indent: number of tabs before the text
+	void Line(const string &text, int indent = 0);
+	//Text of several lines (separated by \n), each line at the indentation
+	void Lines(const string &text, int indent = 0);
+	void EmptyLine(int count = 1);
+	//Appends text while replacing each placeholder character (e.g., #, @) with its value
+	void LineTemplate(const string &text, std::initializer_list<std::pair<char, string>> values, int indent = 0);
+
+	const string& Buffer() const { return buffer; }
+
+	CodeEmitter& operator<<(const string &text) { buffer += text; return *this; }
+	CodeEmitter& operator<<(const char *text) { buffer += text; return *this; }
+	CodeEmitter& operator<<(char c) { buffer += c; return *this; }
+	template <class T, class = typename std::enable_if<std::is_arithmetic<T>::value>::type>
+	CodeEmitter& operator<<(T value) { buffer += std::to_string(value); return *this; }
+	CodeEmitter& operator<<(std::ostream& (*)(std::ostream&)) { buffer += '\n'; return *this; } //endl
+
+private:
+	string file_path;
+	bool append = false;
+	bool opened = false;
+	string buffer;
+
+	void AppendIndent(int indent) { buffer.append(indent, '\t'); }
+};
+
+//Replaces each placeholder character (e.g., #, @) of text with its value in one pass, for templates that are not a whole line
+string FillTemplate(const string &text, std::initializer_list<std::pair<char, string>> values);
+
+#endif //CODE_EMITTER_H_
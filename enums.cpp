@@ -24,6 +24,18 @@ string LayerTypesToString(LayerTypes param) {
 	case DENSE:
 		return "Dense";
 		break;
+	case DEPTHWISE_CONV2D:
+		return "DepthwiseConv2D";
+		break;
+	case POINTWISE_CONV2D:
+		return "PointwiseConv2D";
+		break;
+	case ADD:
+		return "Add";
+		break;
+	case CONCATENATE:
+		return "Concatenate";
+		break;
 	default:
 		ERRORLOG;
 		return "";
@@ -40,6 +52,9 @@ string PoolingTypesToString(PoolingTypes param) {
 	case MAX_POOLING:
 		return "MAX";
 		break;
+	case GLOBAL_AVERAGE_POOLING:
+		return "GLOBAL AVG";
+		break;
 	default:
 		ERRORLOG;
 		return "";
@@ -12,8 +12,8 @@ You should have received a copy of the GNU General Public License along with thi
 #include <string>
 using std::string;
 
-enum LayerTypes { CONV2D, POOLING2D, FLATTEN, DENSE };
-enum PoolingTypes { NO_POOLING, AVERAGE_POOLING, MAX_POOLING };
+enum LayerTypes { CONV2D, POOLING2D, FLATTEN, DENSE, DEPTHWISE_CONV2D, POINTWISE_CONV2D, ADD, CONCATENATE };
+enum PoolingTypes { NO_POOLING, AVERAGE_POOLING, MAX_POOLING, GLOBAL_AVERAGE_POOLING };
 enum ActivationFunctions { NO_ACTIVATION, RELU, SOFTMAX, LINEAR };
 enum PaddingTypes { NO_PADDING, PADDING_VALID, PADDING_SAME };
 
@@ -0,0 +1,452 @@
+/*
+Copyright 2022 Mohammad Riazati
+
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "graph.h"
+#include "utils.h"
+#include <iostream>
+#include <algorithm>
+#include <map>
+
+using std::cout;
+using std::endl;
+using std::to_string;
+
+int Tensor::ElementCount() const {
+	return layout == LAYOUT_X ? size_x : size_x * size_y * size_z;
+}
+
+string Tensor::Dimensions() const {
+	if (layout == LAYOUT_X) return "[" + to_string(size_x) + "]";
+	return "[" + to_string(size_x) + "][" + to_string(size_y) + "][" + to_string(size_z) + "]";
+}
+
+bool Layer::HasWeights() const {
+	return layer_type == CONV2D || layer_type == DEPTHWISE_CONV2D || layer_type == POINTWISE_CONV2D || layer_type == DENSE;
+}
+
+int Layer::OutputChannels() const {
+	return layer_type == DENSE ? output_size_x : output_size_z;
+}
+
+int Layer::ReductionLength() const {
+	switch (layer_type) {
+		case CONV2D: return kernel_size_rows * kernel_size_cols * input_size_z;
+		case DEPTHWISE_CONV2D: return kernel_size_rows * kernel_size_cols;
+		case POINTWISE_CONV2D: return input_size_z;
+		case DENSE: return input_size_x;
+		default: return 0;
+	}
+}
+
+vector<int> Layer::WeightShape() const {
+	switch (layer_type) {
+		case CONV2D: return {kernel_size_rows, kernel_size_cols, input_size_z, output_size_z};
+		case DEPTHWISE_CONV2D: return {kernel_size_rows, kernel_size_cols, input_size_z, depth_multiplier};
+		case POINTWISE_CONV2D: return {input_size_z, output_size_z};
+		case DENSE: return {input_size_x, output_size_x};
+		default: return {};
+	}
+}
+
+bool Layer::AveragePooling() const {
+	return layer_type == POOLING2D && (pooling_type == AVERAGE_POOLING || pooling_type == GLOBAL_AVERAGE_POOLING);
+}
+
+bool Layer::GlobalPooling() const {
+	return layer_type == POOLING2D && pooling_type == GLOBAL_AVERAGE_POOLING;
+}
+
+bool Layer::MergeLayer() const {
+	return layer_type == ADD || layer_type == CONCATENATE;
+}
+
+bool Layer::VectorOutput() const {
+	return layer_type == FLATTEN || layer_type == DENSE || GlobalPooling() || (MergeLayer() && node_count != 0);
+}
+
+int Layer::PaddingX() const {
+	if (padding_type != PADDING_SAME) return 0;
+	return std::max((output_size_x - 1) * stride_size_rows + kernel_size_rows - input_size_x, 0) / 2;
+}
+
+int Layer::PaddingY() const {
+	if (padding_type != PADDING_SAME) return 0;
+	return std::max((output_size_y - 1) * stride_size_cols + kernel_size_cols - input_size_y, 0) / 2;
+}
+
+Tensor& LayerGraph::InputTensor(int layer_index) {
+	ASSERT(!layers[layer_index]->input_tensors.empty());
+	return tensors[layers[layer_index]->input_tensors[0]];
+}
+
+Tensor& LayerGraph::OutputTensor(int layer_index) {
+	ASSERT(layers[layer_index]->output_tensor >= 0);
+	return tensors[layers[layer_index]->output_tensor];
+}
+
+Layer* LayerGraph::Producer(int layer_index) {
+	int producer = InputTensor(layer_index).producer;
+	return producer < 0 ? nullptr : layers[producer];
+}
+
+Layer* LayerGraph::Consumer(int layer_index) {
+	Tensor& output = OutputTensor(layer_index);
+	return output.consumers.empty() ? nullptr : layers[output.consumers[0]];
+}
+
+void PassManager::Add(GraphPass *pass) {
+	passes.push_back(std::unique_ptr<GraphPass>(pass));
+}
+
+void PassManager::Run(LayerGraph &graph, bool verbose) {
+	for (auto &pass : passes) {
+		pass->Run(graph);
+		if (verbose) cout << "Graph pass: " << pass->Name() << endl;
+	}
+}
+
+//Kahn's algorithm. Among the ready layers, the one that is the last consumer of the most tensors runs first (ties: the source order), so a skip
+//tensor is not kept alive while a branch that does not need it runs.
+void TopologicalSchedulePass::Run(LayerGraph &graph) {
+	if (graph.layers.empty() || graph.layers[0]->input_layers.empty()) return; //Sequential: the source order
+
+	int layers_size = graph.layers.size();
+	std::map<Layer*, int> source_index;
+	for (int i = 0; i < layers_size; i++) source_index[graph.layers[i]] = i;
+
+	vector<vector<int>> inputs(layers_size), consumers(layers_size); //Distinct producers and consumers (source indices)
+	for (int i = 0; i < layers_size; i++)
+		for (Layer *input : graph.layers[i]->input_layers) {
+			if (!input) continue;
+			int producer = source_index[input];
+			if (std::find(inputs[i].begin(), inputs[i].end(), producer) != inputs[i].end()) continue;
+			inputs[i].push_back(producer);
+			consumers[producer].push_back(i);
+		}
+
+	vector<int> waiting_inputs(layers_size), waiting_consumers(layers_size);
+	for (int i = 0; i < layers_size; i++) {
+		waiting_inputs[i] = inputs[i].size();
+		waiting_consumers[i] = consumers[i].size();
+	}
+
+	vector<Layer*> order;
+	vector<bool> scheduled(layers_size, false);
+	while ((int)order.size() < layers_size) {
+		int best = -1, best_freed = -1;
+		for (int i = 0; i < layers_size; i++) {
+			if (scheduled[i] || waiting_inputs[i] != 0) continue;
+			int freed = 0;
+			for (int producer : inputs[i]) if (waiting_consumers[producer] == 1) freed++;
+			if (freed > best_freed) {
+				best = i;
+				best_freed = freed;
+			}
+		}
+		ASSERT(best >= 0);
+		if (best < 0) return; //A cycle: the parser only creates edges to earlier layers
+
+		scheduled[best] = true;
+		order.push_back(graph.layers[best]);
+		for (int producer : inputs[best]) waiting_consumers[producer]--;
+		for (int consumer : consumers[best]) waiting_inputs[consumer]--;
+	}
+
+	if (order != graph.layers) {
+		string schedule;
+		for (int i = 0; i < layers_size; i++) schedule += (i ? ", " : "") + to_string(i + 1) + ": " + order[i]->name;
+		INFOLOG("Layer schedule (the per layer options follow this order): " + schedule);
+	}
+	graph.layers = order;
+}
+
+void ConnectTensorsPass::Run(LayerGraph &graph) {
+	graph.tensors.clear();
+
+	Tensor input;
+	input.name = "inputs";
+	input.data_type_suffix = "input";
+	graph.tensors.push_back(input);
+	graph.input_tensor = 0;
+
+	int layers_size = graph.layers.size();
+	for (int i = 0; i < layers_size; i++) graph.layers[i]->index = i;
+
+	for (int i = 0; i < layers_size; i++) {
+		Layer *layer = graph.layers[i];
+		bool last_layer = i == layers_size - 1;
+
+		layer->input_tensors.clear();
+		if (layer->input_layers.empty()) layer->input_tensors.push_back(i == 0 ? graph.input_tensor : graph.layers[i - 1]->output_tensor);
+		for (Layer *input : layer->input_layers) {
+			ASSERT(!input || input->index < i); //Topological order
+			layer->input_tensors.push_back(input ? input->output_tensor : graph.input_tensor);
+		}
+		for (int input_tensor : layer->input_tensors) {
+			vector<int> &consumers = graph.tensors[input_tensor].consumers;
+			if (consumers.empty() || consumers.back() != i) consumers.push_back(i); //Add()([x, x]) reads x twice
+		}
+
+		Tensor output;
+		output.name = last_layer ? "outputs" : "l" + to_string(i + 1);
+		output.data_type_suffix = last_layer ? "output" : "Layer" + to_string(i + 1);
+		output.producer = i;
+		graph.tensors.push_back(output);
+		layer->output_tensor = graph.tensors.size() - 1;
+	}
+}
+
+void ShapeInferencePass::Run(LayerGraph &graph) {
+	for(size_t i = 0; i < graph.layers.size(); i++)
+	{
+		Layer *layer = graph.layers[i];
+		Layer *producer = graph.Producer(i);
+
+		if (layer->layer_type == POOLING2D && layer->kernel_size_rows == 0 && layer->stride_size_rows == 0) layer->kernel_size_rows = layer->kernel_size_cols = 2; //Keras: pool_size=(2, 2)
+		if (layer->layer_type == POOLING2D && layer->stride_size_rows == 0) { //Keras: strides default to pool_size
+			layer->stride_size_rows = layer->kernel_size_rows;
+			layer->stride_size_cols = layer->kernel_size_cols;
+		}
+		if (layer->stride_size_rows == 0) layer->stride_size_rows = layer->stride_size_cols = 1;
+		if ((layer->layer_type == CONV2D || layer->layer_type == DEPTHWISE_CONV2D) && layer->padding_type == NO_PADDING) layer->padding_type = PADDING_VALID;
+		if (layer->kernel_size_rows == 0 && layer->kernel_size_cols == 0 && layer->stride_size_rows != 0) {
+			layer->kernel_size_rows = layer->stride_size_rows;
+			layer->kernel_size_cols = layer->stride_size_cols;
+		}
+
+		if (layer->input_size_x == 0) {
+			ASSERT(producer != nullptr);
+			ASSERT(layer->input_size_y == 0);
+			ASSERT(layer->input_size_z == 0);
+
+			layer->input_size_x = producer->output_size_x;
+			layer->input_size_y = producer->output_size_y;
+			layer->input_size_z = producer->output_size_z;
+		}
+
+		if (layer->filters_count == 0 && layer->layer_type == POOLING2D) {
+			layer->filters_count = producer->output_size_z;
+		}
+		if (layer->GlobalPooling()) {
+			//The window is the whole input and the output is a vector of the channel averages (as Keras, it can feed a Dense layer directly)
+			layer->kernel_size_rows = layer->stride_size_rows = layer->input_size_x;
+			layer->kernel_size_cols = layer->stride_size_cols = layer->input_size_y;
+			layer->node_count = layer->input_size_z;
+		}
+		if (layer->layer_type == DEPTHWISE_CONV2D) {
+			if (layer->depth_multiplier == 0) layer->depth_multiplier = 1;
+			layer->filters_count = layer->input_size_z * layer->depth_multiplier;
+		}
+
+		if (layer->layer_type == FLATTEN) {
+			ASSERT(graph.Consumer(i) && graph.Consumer(i)->layer_type == DENSE);
+
+			ASSERT(layer->node_count == 0);
+
+			if (producer == nullptr) {
+				//The first layer is a FLATTEN layer (The case for an MLP where the real first layer is a multidimentional DENSE)
+				//In this case the input size should be specified in the flatten layer
+				ASSERT(layer->input_size_x != 0);
+				ASSERT(layer->input_size_y != 0);
+				ASSERT(layer->input_size_z != 0);
+
+				layer->node_count = layer->input_size_x * layer->input_size_y * layer->input_size_z;;
+			}
+			else {
+				ASSERT(producer->output_size_x != 0 && producer->output_size_y != 0 && producer->output_size_z != 0);
+				layer->input_size_x = producer->output_size_x;
+				layer->input_size_y = producer->output_size_y;
+				layer->input_size_z = producer->output_size_z;
+
+				layer->node_count = producer->output_size_x * producer->output_size_y * producer->output_size_z;;
+			}
+		}
+
+		if (layer->MergeLayer()) {
+			//Add: equally shaped inputs. Concatenate: the channels of the inputs (vectors: the elements) one after the other.
+			//The output tensors of the earlier layers already have their sizes.
+			Tensor &first = graph.tensors[layer->input_tensors[0]];
+			bool vector_inputs = first.producer >= 0 && graph.layers[first.producer]->VectorOutput();
+			int channels = 0;
+			for (int input_tensor : layer->input_tensors) {
+				Tensor &input = graph.tensors[input_tensor];
+				bool same_shape = input.size_x == first.size_x && input.size_y == first.size_y && input.size_z == first.size_z;
+				bool same_map = vector_inputs ? input.size_y == 1 && input.size_z == 1 : input.size_x == first.size_x && input.size_y == first.size_y;
+				if (layer->layer_type == ADD) ASSERTT(same_shape, "Add: the inputs of layer " + to_string(i + 1) + " (" + layer->name + ") have different shapes");
+				if (layer->layer_type == CONCATENATE) ASSERTT(same_map, "Concatenate: the inputs of layer " + to_string(i + 1) + " (" + layer->name + ") differ in other axes than the channels");
+				channels += vector_inputs ? input.size_x : input.size_z;
+			}
+			if (layer->layer_type == ADD) channels = vector_inputs ? first.size_x : first.size_z;
+
+			if (vector_inputs) layer->node_count = channels;
+			else layer->filters_count = channels;
+		}
+
+		if (layer->node_count != 0) {
+			ASSERT(layer->layer_type == DENSE || layer->layer_type == FLATTEN || layer->GlobalPooling() || layer->MergeLayer());
+			layer->output_size_z = 1;
+			layer->output_size_x = layer->node_count;
+			layer->output_size_y = 1;
+		}
+		else if (layer->MergeLayer()) {
+			layer->output_size_x = layer->input_size_x;
+			layer->output_size_y = layer->input_size_y;
+			layer->output_size_z = layer->filters_count;
+		}
+		else if (layer->kernel_size_rows != 0) {
+			ASSERT(layer->kernel_size_cols != 0);
+
+			ASSERT(layer->filters_count != 0);
+			layer->output_size_z = layer->filters_count;
+
+			if (layer->padding_type == PADDING_VALID || layer->layer_type == POOLING2D) {
+				//The windows that fit in the input (integer division implements the floor)
+				layer->output_size_x = (layer->input_size_x - layer->kernel_size_rows) / layer->stride_size_rows + 1;
+				layer->output_size_y = (layer->input_size_y - layer->kernel_size_cols) / layer->stride_size_cols + 1;
+			}
+			else {
+				ASSERT(layer->padding_type == PADDING_SAME && (layer->layer_type == CONV2D || layer->layer_type == DEPTHWISE_CONV2D));
+
+				//Keras: ceil(input / stride) for any kernel size, the padding (PaddingX/PaddingY) follows from the output size
+				layer->output_size_x = (layer->input_size_x + layer->stride_size_rows - 1) / layer->stride_size_rows;
+				layer->output_size_y = (layer->input_size_y + layer->stride_size_cols - 1) / layer->stride_size_cols;
+			}
+		}
+		else ERRORLOG;
+
+		Tensor &input = graph.InputTensor(i);
+		if (input.producer < 0) {
+			input.size_x = layer->input_size_x;
+			input.size_y = layer->input_size_y;
+			input.size_z = layer->input_size_z;
+		}
+		Tensor &output = graph.OutputTensor(i);
+		output.size_x = layer->output_size_x;
+		output.size_y = layer->output_size_y;
+		output.size_z = layer->output_size_z;
+	}
+}
+
+void QuantizationIndexPass::Run(LayerGraph &graph) {
+	graph.quantized_layer_count = 0;
+	for (Layer *layer : graph.layers) {
+		if (layer->HasWeights()) layer->q_index = graph.quantized_layer_count++;
+		else layer->q_index = -1;
+	}
+}
+
+void FusionPass::Run(LayerGraph &graph) {
+	for (size_t i = 0; i < graph.layers.size(); i++) {
+		Layer *layer = graph.layers[i];
+		layer->fused_pooling = layer->fused_into = layer->fused_add = -1;
+		graph.OutputTensor(i).alias_of = -1;
+	}
+
+	for (size_t i = 0; i < graph.layers.size(); i++) {
+		Layer *layer = graph.layers[i];
+		Layer *consumer = graph.Consumer(i);
+		bool single_consumer = graph.OutputTensor(i).consumers.size() == 1;
+
+		bool conv_like = layer->HasWeights() && layer->layer_type != DENSE;
+		if (consumer && single_consumer && consumer->layer_type == POOLING2D && (layer->layer_type == CONV2D || (conv_like && consumer->GlobalPooling()))) {
+			layer->fused_pooling = consumer->index;
+			consumer->fused_into = layer->index;
+		}
+		if (layer->layer_type == FLATTEN && graph.Producer(i)) {
+			graph.OutputTensor(i).alias_of = layer->input_tensors[0];
+		}
+
+		//Add: the producer of the operand computed last writes the sum, the other operands already exist when it runs
+		if (layer->layer_type == ADD) {
+			int last = -1, last_count = 0;
+			for (int input_tensor : layer->input_tensors) {
+				int producer = graph.tensors[input_tensor].producer;
+				if (producer > last) last_count = 0;
+				if (producer >= last) {
+					last = producer;
+					last_count++;
+				}
+			}
+			Layer *producer = last < 0 ? nullptr : graph.layers[last];
+			bool producer_conv_like = producer && producer->HasWeights() && producer->layer_type != DENSE;
+			if (producer_conv_like && last_count == 1 && graph.OutputTensor(last).consumers.size() == 1) {
+				producer->fused_add = layer->index;
+				layer->fused_into = last;
+			}
+		}
+	}
+}
+
+void LayoutSelectionPass::Run(LayerGraph &graph) {
+	for (size_t i = 0; i < graph.layers.size(); i++) {
+		Layer *layer = graph.layers[i];
+		graph.OutputTensor(i).layout = layer->VectorOutput() ? LAYOUT_X : LAYOUT_XYZ;
+		if (i == 0) graph.InputTensor(i).layout = layer->layer_type == DENSE ? LAYOUT_X : LAYOUT_XYZ;
+	}
+}
+
+vector<int> PlanTensorBuffers(LayerGraph &graph, const vector<TensorStorage> &storage, int &buffer_count) {
+	int tensors_size = graph.tensors.size();
+	vector<int> buffers(tensors_size, -1);
+	vector<int> first_write(tensors_size);
+	vector<int> order;
+	for (int t = 0; t < tensors_size; t++) {
+		first_write[t] = storage[t].first_write >= 0 ? storage[t].first_write : graph.tensors[t].producer;
+		if (!storage[t].storage_class.empty()) order.push_back(t);
+	}
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return first_write[a] < first_write[b]; });
+
+	vector<int> buffer_free_after; //Buffer index -> last use of the tensor currently assigned to it
+	vector<int> buffer_size;
+	vector<string> buffer_class;
+	for (int t : order) {
+		const Tensor &tensor = graph.tensors[t];
+
+		//Best fit among the buffers of the class whose tensors are dead before this tensor is written
+		int best = -1;
+		for (size_t b = 0; b < buffer_free_after.size(); b++) {
+			if (buffer_class[b] != storage[t].storage_class || buffer_free_after[b] >= first_write[t]) continue;
+			if (best < 0 || abs(buffer_size[b] - tensor.ElementCount()) < abs(buffer_size[best] - tensor.ElementCount())) best = b;
+		}
+		if (best < 0) {
+			best = buffer_free_after.size();
+			buffer_free_after.push_back(-1);
+			buffer_size.push_back(0);
+			buffer_class.push_back(storage[t].storage_class);
+		}
+		buffers[t] = best;
+		buffer_free_after[best] = tensor.last_use;
+		buffer_size[best] = std::max(buffer_size[best], tensor.ElementCount());
+	}
+	buffer_count = buffer_free_after.size();
+	return buffers;
+}
+
+void MemoryPlanningPass::Run(LayerGraph &graph) {
+	for (Tensor &tensor : graph.tensors)
+		tensor.last_use = tensor.consumers.empty() ? tensor.producer : *std::max_element(tensor.consumers.begin(), tensor.consumers.end());
+	for (int t = graph.tensors.size() - 1; t >= 0; t--) { //A view is read through its source (the source of a view is an earlier tensor)
+		Tensor &tensor = graph.tensors[t];
+		if (tensor.alias_of >= 0) graph.tensors[tensor.alias_of].last_use = std::max(graph.tensors[tensor.alias_of].last_use, tensor.last_use);
+	}
+
+	//Intermediate tensors only: the network input and output are arguments of forward
+	vector<TensorStorage> storage(graph.tensors.size());
+	for (size_t i = 0; i < graph.layers.size(); i++)
+		if (!graph.OutputTensor(i).consumers.empty()) storage[graph.layers[i]->output_tensor].storage_class = "intermediate";
+	vector<int> buffers = PlanTensorBuffers(graph, storage, graph.buffer_count);
+	for (size_t t = 0; t < graph.tensors.size(); t++) graph.tensors[t].buffer = buffers[t];
+
+	graph.peak_live_elements = 0;
+	for (size_t i = 0; i < graph.layers.size(); i++) {
+		int live_elements = 0;
+		for (const Tensor &other : graph.tensors)
+			if (other.producer >= 0 && other.producer <= (int)i && other.last_use >= (int)i && !other.consumers.empty()) live_elements += other.ElementCount();
+		graph.peak_live_elements = std::max(graph.peak_live_elements, live_elements);
+	}
+}
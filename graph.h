@@ -0,0 +1,169 @@
+/*
+Copyright 2022 Mohammad Riazati
+
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef GRAPH_H_
+#define GRAPH_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include "enums.h"
+
+using std::string;
+using std::vector;
+
+enum TensorLayouts { LAYOUT_XYZ, LAYOUT_X }; //[x][y][z] feature maps, [x] vectors (flatten/dense)
+
+class Tensor {
+public:
+	string name; //inputs, l1, l2, ..., outputs
+	string data_type_suffix; //DataType_<suffix>: input, Layer1, ..., output
+	int size_x = 0, size_y = 0, size_z = 0;
+	TensorLayouts layout = LAYOUT_XYZ;
+	int producer = -1; //Layer index, -1: network input
+	vector<int> consumers; //Layer indices
+	int alias_of = -1; //Tensor index when the producer can be a view of its input (flatten)
+	int buffer = -1; //Memory planning: buffer index shared by tensors with disjoint lifetimes
+	int last_use = -1; //Memory planning: index of the last consumer (or of the last consumer of a view of the tensor)
+
+	int ElementCount() const;
+	string Dimensions() const; //[x][y][z] or [x]
+};
+
+class Layer {
+public:
+	LayerTypes layer_type;
+	PoolingTypes pooling_type = NO_POOLING;
+	PaddingTypes padding_type = NO_PADDING;
+	ActivationFunctions activation_function = NO_ACTIVATION;
+	int filters_count = 0;
+	int kernel_size_rows = 0;
+	int kernel_size_cols = 0;
+	int input_size_x = 0, input_size_y = 0, input_size_z = 0;
+	int output_size_x = 0, output_size_y = 0, output_size_z = 0;
+	int node_count = 0;
+	int stride_size_rows = 0, stride_size_cols = 0; //Strides along x (kernel rows) and y (kernel columns)
+	int depth_multiplier = 0; //DepthwiseConv2D: output channels per input channel
+	bool batch_norm = false; //A BatchNormalization follows the layer, folded into its weights and biases
+	double batch_norm_epsilon = 0.001;
+	string name; //Keras name argument, or the variable of a functional model
+	vector<Layer*> input_layers; //Functional API: the layers whose outputs are the inputs (nullptr: the network input), empty: the previous layer
+
+	//Set by the graph passes
+	int index = -1;
+	vector<int> input_tensors;
+	int output_tensor = -1;
+	int q_index = -1; //Index in the per layer quantization factors (layers with weights), -1 for other layers
+	int fused_pooling = -1; //Pooling layer that can be merged into the output of this Conv2D (or DepthwiseConv2D/PointwiseConv2D for global pooling)
+	int fused_into = -1; //For a pooling layer: the Conv2D it can be merged into. For an Add layer: the Conv2D-like layer that writes its output
+	int fused_add = -1; //Add layer whose output is written by this Conv2D-like layer (the output of the layer itself is not stored)
+
+	bool HasWeights() const; //Conv2D, DepthwiseConv2D, PointwiseConv2D and Dense: weights, biases and quantization factors
+	int OutputChannels() const; //Size of the biases and the weight scales
+	int ReductionLength() const; //Weights (MACs) per output element
+	vector<int> WeightShape() const; //[kx][ky][iz][oz], depthwise: [kx][ky][iz][multiplier], pointwise: [iz][oz], dense: [ix][ox]
+	bool AveragePooling() const; //AveragePooling2D and GlobalAveragePooling2D: a sum accumulator (temp_element) per output element
+	bool GlobalPooling() const; //GlobalAveragePooling2D: one window over the whole input, [z] vector output
+	bool MergeLayer() const; //Add and Concatenate: more than one input tensor
+	bool VectorOutput() const; //[x] output: Flatten, Dense, GlobalAveragePooling2D and the merge layers of vectors
+	int PaddingX() const; //SAME padding before the first row (Keras: the smaller half of the total padding, the rest is after the last row), 0 for VALID
+	int PaddingY() const; //SAME padding before the first column
+};
+
+class LayerGraph {
+public:
+	vector<Layer*> layers; //In topological order
+	vector<Tensor> tensors;
+	int input_tensor = -1;
+	int quantized_layer_count = 0; //Layers with weights
+	int buffer_count = 0;
+	int peak_live_elements = 0;
+
+	Tensor& InputTensor(int layer_index);
+	Tensor& OutputTensor(int layer_index);
+	Layer* Producer(int layer_index); //nullptr for the first layer
+	Layer* Consumer(int layer_index); //nullptr for the last layer
+};
+
+//Storage of a tensor for PlanTensorBuffers
+class TensorStorage {
+public:
+	string storage_class; //Only tensors of the same class share a buffer (e.g., the element type and the dimensions), empty: not stored (a view or a fused output)
+	int first_write = -1; //Layer that declares and writes the tensor, -1: its producer (a fused producer writes the output of a later layer)
+};
+
+//Best fit buffer assignment in the order of the first writes: a tensor reuses a buffer of its class whose tensors are dead before the tensor is written.
+//The lifetimes end at the last uses set by MemoryPlanningPass (a view keeps its source alive). Returns the buffer of each tensor, -1 for the tensors that are not stored.
+vector<int> PlanTensorBuffers(LayerGraph &graph, const vector<TensorStorage> &storage, int &buffer_count);
+
+class GraphPass {
+public:
+	virtual ~GraphPass() {}
+	virtual string Name() const = 0;
+	virtual void Run(LayerGraph &graph) = 0;
+};
+
+class PassManager {
+public:
+	void Add(GraphPass *pass);
+	void Run(LayerGraph &graph, bool verbose = false);
+
+private:
+	vector<std::unique_ptr<GraphPass>> passes;
+};
+
+//Functional models: a topological order of the layers. Runs right after parsing, as the per layer options (e.g., loop-orders) follow the order of the layers.
+class TopologicalSchedulePass : public GraphPass {
+public:
+	string Name() const override { return "topological-schedule"; }
+	void Run(LayerGraph &graph) override;
+};
+
+//Tensor edges, names and data type names (sequential networks: each layer consumes the output of the previous one, functional models: input_layers)
+class ConnectTensorsPass : public GraphPass {
+public:
+	string Name() const override { return "connect-tensors"; }
+	void Run(LayerGraph &graph) override;
+};
+
+//Input/output sizes, default stride and padding (the former CompleteLayersInfo)
+class ShapeInferencePass : public GraphPass {
+public:
+	string Name() const override { return "shape-inference"; }
+	void Run(LayerGraph &graph) override;
+};
+
+//Quantization factor indices of the layers with weights (Conv2D, DepthwiseConv2D, PointwiseConv2D, Dense)
+class QuantizationIndexPass : public GraphPass {
+public:
+	string Name() const override { return "quantization-index"; }
+	void Run(LayerGraph &graph) override;
+};
+
+//Conv2D + pooling, Conv2D-like + global pooling and Conv2D-like + Add pairs, flatten as a view of its input
+class FusionPass : public GraphPass {
+public:
+	string Name() const override { return "fusion"; }
+	void Run(LayerGraph &graph) override;
+};
+
+class LayoutSelectionPass : public GraphPass {
+public:
+	string Name() const override { return "layout-selection"; }
+	void Run(LayerGraph &graph) override;
+};
+
+//Lifetimes of the intermediate tensors and a buffer assignment where tensors with disjoint lifetimes share a buffer (host-library lays out the
+//port outputs by it). The local arrays of forward are planned per variant by PlanLocalBuffers, which also knows the data types and the fusions.
+class MemoryPlanningPass : public GraphPass {
+public:
+	string Name() const override { return "memory-planning"; }
+	void Run(LayerGraph &graph) override;
+};
+
+#endif //GRAPH_H_
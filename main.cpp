@@ -44,29 +44,37 @@ deephls -loop-orders *#*#*#*#*#*#oz-oy-iz-ox-kx-ky#*#*#*#*#*#*#*#* -single-layer
 #endif
 #include <iomanip>
 #include <algorithm>
+#include <cmath>
 #include <map>
 #include <string>
 #include <vector>
+#include <filesystem>
+#include <sstream>
+#include <regex>
+#include <thread>
+#include <mutex>
 
 #include "simple_file_parser.h"
 #include "utils.h"
 #include "enums.h"
+#include "graph.h"
+#include "code_emitter.h"
 #include "json.hpp"
 
 #if defined(VS_ON_VM)
 string workspace_dir = "C:\\DeepHLSWorkspace\\";
-string output_dir = workspace_dir; //"C:\\Projects\\Temp\\Cfiles\\"; //Later overwritten in ReadOptions
+thread_local string output_dir = workspace_dir; //"C:\\Projects\\Temp\\Cfiles\\"; //Later overwritten in ReadOptions
 string input_file_name = workspace_dir + "output_arch.py"; //"C:\\Projects\\Temp\\KerasInputs\\output_arch.py";
 string log_location;
 /* set PATH=%PATH%;C:\Projects\DeepHLS\Debug\ */
 
 #elif defined(VSC_ON_VM)
 string workspace_dir;
-string output_dir;
+thread_local string output_dir;
 string input_file_name; // = "...\\Temp\\KerasInputs\\output_arch.py"; //The result of KerasPreprocessings (Python) must be copied here //From: ...\Python\KerasPreprocessings\KerasPreprocessings\outputs
 string log_location;
 #else
-string output_dir = "...\\Temp\\Cfiles\\";
+thread_local string output_dir = "...\\Temp\\Cfiles\\";
 string input_file_name = "...\\Temp\\KerasInputs\\output_arch.py"; //The result of KerasPreprocessings (Python) must be copied here //From: ...\Python\KerasPreprocessings\KerasPreprocessings\outputs
 #endif // VS_ON_VM
 
@@ -76,65 +84,178 @@ using json = nlohmann::json;
 //#pragma warning(disable : 26812) //Warning C26812 : Prefer 'enum class' over 'enum' (Enum.3)
 
 void ReadOptions(int argc = 0, char* argv[] = {});
+void ApplyOptionFlags();
 void SetArbitraryParameters();
 void CheckAndCorrectLoopOrders();
+bool IsOutputLoopsPermutation(string order);
+void CheckBatchSize();
+void CheckBatchNormFolding();
+bool CheckMergeLayers(string &error);
+bool BatchNormFolding();
+bool BiasClamping();
+void AddToCFile_FoldBatchNormFunction(CodeEmitter &f_stream, string function_name = "FoldBatchNorm");
+void AddToCFile_ClampBiasesFunction(CodeEmitter &f_stream, string function_name = "ClampBiases");
+void CheckParallelUnits();
+int ParallelUnits(int layer_index);
+void CheckSystolicDense();
+int SystolicRows(int layer_index);
+int SystolicColumns(int layer_index);
+bool SystolicOutputStationary(int layer_index);
+void CheckDenseInputReuse();
+int DenseOxBlock(int layer_index);
+void CheckOutputMode();
+int OutputPortSize();
+string TopKAssignment(int layer_index, string value, string index, string loop_label = "K");
+void CheckSparseWeights();
+double SparseDensity(int layer_index);
+int SparseBlock(int layer_index);
+int SparseCapacity(int layer_index);
+int SparseRowBlocks(int layer_index);
+int SparseIndexBits(int count);
+string SparseIndexType(long long max_value);
+vector<string> SparseWeightsArrays(int layer_index, string suffix);
+string BatchDimension();
+string BatchIndex();
+string BatchLoop(string label);
 void DumpLayers(bool ExportFile = false);
 bool ParseKerasFile(string SourceFile);
-void CompleteLayersInfo();
+void RunGraphPasses();
 void GenerateCFiles();
-void GenerateHFileDataTypes();
+void GenerateHFileDataTypes(string directory, const vector<int> &per_layer_fractional_bits);
+void GenerateHFileDataTypesFromAnalysis(CodeEmitter &f_stream, bool data_type_mode_all, const vector<int> &per_layer_fractional_bits);
+bool AnalysisDataExists(int layer_number, string element);
+int AnalysisIntegerBits(int layer_number, string element, bool is_signed);
+bool AnalysisIsSigned(int layer_number, string element);
+string FixedPointType(int integer_bits, bool is_signed, string fractional_bits_macro = "FX_SIZE_F");
+void RunBitWidthSearch();
+void RunSweep();
+int AccumulatorBits(int layer_index);
+int AccumulatorBiasBits(int layer_index);
+string AccumulatorCType(int bits);
 void GenerateHFileParamList();
 void GenerateDeepClConfigH();
+json GenerateCostModel();
+int CostDataBits();
+long long CostInputReads(int layer_index);
+void PlanLayerDataLocations();
+void GenerateHostLibrary();
+bool AxiStagedInput(int layer_index);
+bool AxiStagedOutput(int layer_index);
+bool AxiTileReused(int layer_index);
+bool TensorInPort(const Tensor &tensor);
+string AxiTensorType(const Tensor &tensor);
+void AddToCFile_AxiInterfaces(CodeEmitter &f_stream);
+void AddToCFile_AxiBurst(CodeEmitter &f_stream, int layer_index, bool before_layer);
 
 string Tabs(int count);
-void AddToCFile_Text(ofstream &f_stream, string text, int indent = 0);
-void AddToCFile_EmptyLine(ofstream &f_stream, int count = 1);
-
-void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number);
-void AddToCFile_Pooling2dLayer(ofstream &f_stream, int layer_number);
-void AddToCFile_FlattenLayer(ofstream &f_stream, int layer_number);
-void AddToCFile_DenseLayer(ofstream &f_stream, int layer_number);
-void AddToCFile_ActivationFunction(ofstream& f_stream, ActivationFunctions function);
-void AddToCFile_QMinMax(ofstream& f_stream);
-
-void AddToCFile_MainAndPredict(ofstream &f_stream);
+void AddToCFile_Text(CodeEmitter &f_stream, const string &text, int indent = 0);
+void AddToCFile_EmptyLine(CodeEmitter &f_stream, int count = 1);
+
+void AddToCFile_Conv2dLayer(CodeEmitter &f_stream, int layer_number);
+int WeightPrefetchBlock(int layer_index);
+string StridesToString(Layer *layer);
+string StrideText(int stride);
+void AddToCFile_Pooling2dLayer(CodeEmitter &f_stream, int layer_number);
+bool GlobalPoolingFused(int layer_index);
+string GlobalPoolingSumName(int layer_index);
+void AddToCFile_GlobalPoolingSum(CodeEmitter &f_stream, int layer_number, int current_indent);
+string AveragePoolingScale(int layer_index, string sum);
+bool ReluOutput(Layer *layer);
+string MaxPoolingInitialValue(Layer *producer);
+bool MaxPoolingFused(int layer_index);
+void AddToCFile_MaxPoolingOutput(CodeEmitter &f_stream, int layer_number, int current_indent);
+string MaxPoolingFusedAssignment(int layer_index, string value);
+void AddToCFile_FlattenLayer(CodeEmitter &f_stream, int layer_number);
+bool FlattenView(int layer_index);
+Tensor& DenseInputTensor(int layer_index);
+string DenseInputIndex(int layer_index, string index);
+string LayerOutputType(int layer_index);
+void PlanLocalBuffers();
+int LocalBuffer(int layer_index);
+void AddToCFile_LocalBuffers(CodeEmitter &f_stream, int current_indent);
+void AddToCFile_LayerOutputDeclaration(CodeEmitter &f_stream, int layer_number, int current_indent);
+void AddToCFile_MergeLayer(CodeEmitter &f_stream, int layer_number);
+void AddToCFile_MergeOutputDeclaration(CodeEmitter &f_stream, int layer_number, int current_indent);
+bool AddFused(int layer_index);
+string AddFusedAssignment(int layer_index, string value);
+void AddToCFile_DenseLayer(CodeEmitter &f_stream, int layer_number);
+void AddToCFile_DepthwiseConv2dLayer(CodeEmitter &f_stream, int layer_number);
+void AddToCFile_PointwiseConv2dLayer(CodeEmitter &f_stream, int layer_number);
+void AddToCFile_ConvOutputDeclaration(CodeEmitter &f_stream, int layer_number, int current_indent);
+void AddToCFile_ConvOutputAssignment(CodeEmitter &f_stream, int layer_number, string temp_element, int current_indent);
+void AddToCFile_ConvOutputLoops(CodeEmitter &f_stream, int layer_number, string loop_order, int &current_indent);
+void AddToCFile_DenseSystolicArray(CodeEmitter &f_stream, int layer_number, int &current_indent);
+void AddToCFile_SystolicPeLoops(CodeEmitter &f_stream, int layer_number, string label, bool reverse, int current_indent);
+void AddToCFile_SystolicRegisters(CodeEmitter &f_stream, int layer_number, string input_type, int current_indent);
+void AddToCFile_DenseInputReuse(CodeEmitter &f_stream, int layer_number, int &current_indent);
+void AddToCFile_ActivationFunction(CodeEmitter &f_stream, ActivationFunctions function);
+void AddToCFile_QMinMax(CodeEmitter &f_stream);
+string OutputEpilogue(int layer_index, string activation, string accumulator, string channel);
+void AddToCFile_DspPacking(CodeEmitter &f_stream);
+void AddToCFile_PackedWeights(CodeEmitter &f_stream);
+void AddToCFile_PackWeightsFunction(CodeEmitter &f_stream, string function_name = "PackWeights");
+void AddToCFile_SparsifyWeightsFunction(CodeEmitter &f_stream, string function_name = "SparsifyWeights");
+void AddToCFile_AnalysisRangeFunctions(CodeEmitter &f_stream);
+
+void AddToCFile_MainAndPredict(CodeEmitter &f_stream);
 
 string LayerDataLocation(int pLayerNumber);
 void SetNetworkGuess();
-
-class Layer {
-public:
-	LayerTypes layer_type;
-	PoolingTypes pooling_type = NO_POOLING;
-	PaddingTypes padding_type = NO_PADDING;
-	ActivationFunctions activation_function = NO_ACTIVATION;
-	int filters_count = 0;
-	int kernel_size_rows = 0;
-	int kernel_size_cols = 0;
-	int input_size_x = 0, input_size_y = 0, input_size_z = 0;
-	int output_size_x = 0, output_size_y = 0, output_size_z = 0;
-	int node_count = 0;
-	int stride_size = 0;
-};
-
-vector<Layer*> Layers;
-map<string, string> map_options;
-string network_name, network_guess;
-vector<string> loop_orders;
-bool biases_enabled;
-bool store_alanysis_data;
-bool add_main_function;
-bool data_type_mode_floating_point, data_type_mode_fixed_point_single, data_type_mode_fixed_point_multi;
-string data_type_mode_detail;
-bool numbered_loop_labels;
+bool QuantizedDetail();
+bool QuantizedMode();
+int PackedWeightBits();
+int PackedWeightsSize(int count);
+string WeightDimensions(int layer_index);
+
+LayerGraph graph; //Layers and tensors, see graph.h
+vector<Layer*>& Layers = graph.layers;
+//Option settings are thread_local: sweep variants are generated in parallel threads, each with its own options (ApplyOptionFlags)
+thread_local map<string, string> map_options;
+thread_local string network_name, network_guess;
+thread_local vector<string> loop_orders;
+thread_local bool biases_enabled;
+thread_local bool store_alanysis_data;
+thread_local bool add_main_function;
+thread_local bool data_type_mode_floating_point, data_type_mode_fixed_point_single, data_type_mode_fixed_point_multi;
+thread_local string data_type_mode_detail;
+thread_local bool numbered_loop_labels;
 bool running_in_vs_environment;
-int single_layer; //1 based, 0: disabled
-bool dump_layers;
-bool fault_simulation;
-bool approximate_multipliers;
-string approximate_multipliers_configuration;
-string approximate_multipliers_type;
-bool create_deepcl_config_h;
+thread_local int single_layer; //1 based, 0: disabled
+thread_local bool dump_layers;
+thread_local bool fault_simulation;
+thread_local bool approximate_multipliers;
+thread_local string approximate_multipliers_configuration;
+thread_local string approximate_multipliers_type;
+thread_local bool create_deepcl_config_h;
+thread_local bool dsp_packing;
+thread_local string accumulator_width; //"", "minimal" or "observed"
+thread_local int accumulator_bias_bits; //0: the product width of the layer (see AccumulatorBiasBits)
+thread_local json analysis_data; //analysis-data-file: ranges/histograms of the elements stored by store-analysis-data
+const string ANALYSIS_DATA_FILE_NAME = "analysis-data.json"; //Written by the testbench of store-analysis-data in the analysis-data-file format
+thread_local double overflow_probability;
+thread_local int fractional_bits;
+thread_local vector<int> layer_fractional_bits; //Per layer fractional bits (layer-fractional-bits or bit-width-search), empty: fractional_bits for all layers
+thread_local bool bit_width_search;
+thread_local bool cost_model;
+thread_local double clock_mhz;
+thread_local bool host_library;
+thread_local int batch_size; //Images per forward call, 1: no batch dimension
+thread_local bool axi_interfaces;
+thread_local int axi_port_width; //Bits
+thread_local bool weight_prefetch;
+thread_local vector<int> parallel_units; //Per layer Conv2D compute units (parallel-units), 1: one MAC nest
+thread_local int weight_prefetch_block;
+thread_local vector<string> systolic_dense; //Per layer Dense systolic array size (systolic-dense), "PxQ", other values: plain loops
+thread_local vector<string> systolic_dataflow; //Per layer weight-stationary or output-stationary
+thread_local vector<int> systolic_rows, systolic_columns; //Set by CheckSystolicDense, 0: plain loops
+thread_local int dense_ox_block; //Output nodes per block of accumulators of the Dense layers with the ix-ox loop order
+thread_local vector<int> dense_ox_blocks; //Set by CheckDenseInputReuse, 0: ox-ix loops
+thread_local int output_top_k; //output-mode: forward writes the indices of the K largest outputs (argmax: 1), 0: the outputs (logits)
+thread_local vector<double> sparse_density; //Per layer fraction of the weight blocks stored by sparse-weights (sizes the compressed arrays), 0: dense weights
+thread_local vector<double> sparse_threshold; //Per layer: weights with |w| <= threshold are pruned
+thread_local vector<int> sparse_blocks; //Per layer weights per block (consecutive input channels/nodes), 1: CSR
+thread_local vector<string> layer_data_locations; //Per layer output location (layer-data-location: auto), empty: one location for all layers
+thread_local vector<int> local_buffers; //Per tensor array of forward shared by local layer outputs (PlanLocalBuffers), -1: an array of its own
 
 int main(int argc, char* argv[]) {
 	ReadOptions(argc, argv);
@@ -146,18 +267,41 @@ int main(int argc, char* argv[]) {
 	SetNetworkGuess();
 	SetArbitraryParameters();
 	CheckAndCorrectLoopOrders();
+	CheckBatchSize();
+	CheckBatchNormFolding();
+	string merge_error;
+	if (!map_options.count("sweep") && !CheckMergeLayers(merge_error)) { //Sweep: checked per variant
+		ERRORLOGT("CheckMergeLayers failed. Exiting the program.");
+		exit(-1);
+	}
 
 	DumpLayers();
-	CompleteLayersInfo();
-	if (dump_layers) cout << endl << endl << "After CompleteLayersInfo: " << endl;
+	RunGraphPasses();
+	if (dump_layers) cout << endl << endl << "After graph passes: " << endl;
 	DumpLayers(true);
 
 	if (!biases_enabled) cout << endl << endl << endl << "****** ATTENTION: Network biases are disabled. ******* " << endl;
 
-	GenerateHFileDataTypes();
+	if (map_options.count("sweep")) {
+		RunSweep();
+		return 0;
+	}
+
+	CheckParallelUnits(); //Needs the layer shapes
+	CheckSystolicDense();
+	CheckSparseWeights();
+	CheckDenseInputReuse();
+	CheckOutputMode();
+	PlanLayerDataLocations();
+	PlanLocalBuffers();
+
+	GenerateHFileDataTypes(output_dir, layer_fractional_bits);
 	GenerateHFileParamList();
 	GenerateCFiles();
 	if (create_deepcl_config_h) GenerateDeepClConfigH();
+	if (host_library) GenerateHostLibrary();
+	if (cost_model) GenerateCostModel();
+	if (bit_width_search) RunBitWidthSearch();
 
 	if (running_in_vs_environment) {
     #ifndef __linux__
@@ -193,7 +337,7 @@ void DumpLayers(bool ExportFile) {
 			if (current_layer->kernel_size_rows != 0 && current_layer->kernel_size_cols != 0) {cout << current_layer->kernel_size_rows << d << current_layer->kernel_size_cols;} cout << d;
 			if (current_layer->activation_function != NO_ACTIVATION) {cout << ActivationFunctionsToString(current_layer->activation_function);} cout << d;
 			if (current_layer->node_count != 0) {cout << current_layer->node_count;} cout << d;
-			if (current_layer->stride_size != 0) {cout << current_layer->stride_size;} cout << d;
+			if (current_layer->stride_size_rows != 0) {cout << current_layer->stride_size_rows << d << current_layer->stride_size_cols;} cout << d;
 			if (current_layer->input_size_x != 0 && current_layer->input_size_y != 0 && current_layer->input_size_z != 0) {cout << current_layer->input_size_x << d << current_layer->input_size_y << d << current_layer->input_size_z;} cout << d;
 			if (current_layer->output_size_x != 0 && current_layer->output_size_y != 0 && current_layer->output_size_z != 0) {cout << current_layer->output_size_x << d << current_layer->output_size_y << d << current_layer->output_size_z;} cout << d;
 			cout << endl;
@@ -206,7 +350,7 @@ void DumpLayers(bool ExportFile) {
 			if (current_layer->kernel_size_rows != 0 && current_layer->kernel_size_cols != 0) {fstr << current_layer->kernel_size_rows << d << current_layer->kernel_size_cols;} fstr << d;
 			if (current_layer->activation_function != NO_ACTIVATION) {fstr << ActivationFunctionsToString(current_layer->activation_function);} fstr << d;
 			if (current_layer->node_count != 0) {fstr << current_layer->node_count;} fstr << d;
-			if (current_layer->stride_size != 0) {fstr << current_layer->stride_size;} fstr << d;
+			if (current_layer->stride_size_rows != 0) {fstr << current_layer->stride_size_rows << d << current_layer->stride_size_cols;} fstr << d;
 			if (current_layer->input_size_x != 0 && current_layer->input_size_y != 0 && current_layer->input_size_z != 0) {fstr << current_layer->input_size_x << d << current_layer->input_size_y << d << current_layer->input_size_z;} fstr << d;
 			if (current_layer->output_size_x != 0 && current_layer->output_size_y != 0 && current_layer->output_size_z != 0) {fstr << current_layer->output_size_x << d << current_layer->output_size_y << d << current_layer->output_size_z;} fstr << d;
 			fstr << endl;
@@ -233,7 +377,16 @@ bool ParseKerasFile(string SourceFile) {
 	size_t current_token_index;
 
 	Layer *current_layer = NULL;
+	Layer *separable_layer = NULL; //Pointwise layer of the SeparableConv2D being parsed
 	int current_num_tokens;
+
+	//Functional API: the layer of each variable (NULL: the network input)
+	const vector<string> functional_layer_types = {"Conv2D", "DepthwiseConv2D", "SeparableConv2D", "BatchNormalization", "Activation", "ReLU", "MaxPool2D", "AveragePooling2D", "GlobalAveragePooling2D", "Flatten", "Dense", "Add", "Concatenate"};
+	map<string, Layer*> functional_variables;
+	vector<int> functional_input_shape;
+	string functional_output; //outputs of Model()
+	bool functional_model = false;
+
 	//int current_line_number;
   while (sfp.get_next_line()) {
 		current_num_tokens = sfp.get_num_tokens();
@@ -245,7 +398,89 @@ bool ParseKerasFile(string SourceFile) {
 		
 		current_valuable_token_index = 0;
 		current_token_index = 0;
-    while(current_token_index < sfp.get_num_tokens()) {
+
+		//Functional API: x = layers.Conv2D(filters=16, kernel_size=(3,3))(x), y = layers.Add()([x, shortcut]), inputs = keras.Input(shape=(32, 32, 3)),
+		//model = keras.Model(inputs=inputs, outputs=y). The layer arguments are parsed as model.add lines, the tokens after call_end are the inputs.
+		size_t call_end = sfp.get_num_tokens();
+		bool functional_line = current_num_tokens > 2 && sfp.get_token(1) == "=";
+		string assigned_variable;
+		Layer *merge_target = NULL; //BatchNormalization and Activation: the layer of the input
+		if (functional_line) {
+			assigned_variable = sfp.get_token(0);
+			size_t type_index = 2;
+			while (type_index < call_end && (sfp.get_token(type_index) == "keras" || sfp.get_token(type_index) == "layers" || sfp.get_token(type_index) == "tf" || sfp.get_token(type_index) == ".")) type_index++;
+			string layer_type = type_index < call_end ? sfp.get_token(type_index) : "";
+
+			if (layer_type == "Input") { //Input(shape=(28, 28, 1)) or Input(shape=(784,))
+				functional_input_shape.clear();
+				for (size_t k = type_index; k < call_end; k++) {
+					if (sfp.get_token(k) != "shape") continue;
+					for (k += 3; k < call_end && sfp.get_token(k) != ")"; k++) //Skips "=", "("
+						if (IsNumber(sfp.get_token(k))) functional_input_shape.push_back(atoi(sfp.get_token(k).c_str()));
+					break;
+				}
+				if (functional_input_shape.size() != 3 && functional_input_shape.size() != 1) {
+					ERRORLOGT("Input: only shape=(x, y, z) and shape=(x,) are supported");
+					return false;
+				}
+				functional_variables[assigned_variable] = NULL;
+				functional_model = true;
+				continue;
+			}
+			if (layer_type == "Model") { //Model(inputs, outputs) or Model(inputs=inputs, outputs=y)
+				vector<string> positional;
+				string keyword;
+				for (size_t k = type_index + 2; k < call_end && sfp.get_token(k) != ")"; k++) {
+					current_token = StringSubstituteAll(StringSubstituteAll(sfp.get_token(k), "[", ""), "]", "");
+					if (current_token.empty() || (current_token.length() == 1 && IsSkipChar(Delimiters, current_token[0]))) continue;
+					if (k + 1 < call_end && sfp.get_token(k + 1) == "=") keyword = current_token;
+					else if (keyword == "outputs") functional_output = current_token;
+					else if (keyword.empty()) positional.push_back(current_token);
+				}
+				if (functional_output.empty() && positional.size() > 1) functional_output = positional[1];
+				continue;
+			}
+			if (find(functional_layer_types.begin(), functional_layer_types.end(), layer_type) == functional_layer_types.end()) continue; //e.g., model = keras.Sequential()
+
+			int depth = 0;
+			for (call_end = type_index + 1; call_end < sfp.get_num_tokens(); call_end++) {
+				if (sfp.get_token(call_end) == "(") depth++;
+				else if (sfp.get_token(call_end) == ")" && --depth == 0) break;
+			}
+
+			vector<Layer*> input_layers; //(x) or ([x, y])
+			for (size_t k = call_end + 1; k < sfp.get_num_tokens(); k++) {
+				current_token = StringSubstituteAll(StringSubstituteAll(sfp.get_token(k), "[", ""), "]", "");
+				if (current_token == "#") break;
+				if (current_token.empty() || (current_token.length() == 1 && IsSkipChar(Delimiters, current_token[0]))) continue;
+				if (!functional_variables.count(current_token)) {
+					ERRORLOGT("Unknown input " + current_token + " of " + assigned_variable + " (after a BatchNormalization or Activation, only its output can be used)");
+					return false;
+				}
+				input_layers.push_back(functional_variables[current_token]);
+			}
+			if (input_layers.empty()) {
+				ERRORLOGT(layer_type + " of " + assigned_variable + " has no inputs");
+				return false;
+			}
+
+			current_layer = new Layer;
+			Layers.push_back(current_layer);
+			current_layer->name = assigned_variable;
+			current_layer->input_layers = input_layers;
+			if (input_layers[0] == NULL) {
+				current_layer->input_size_x = functional_input_shape.empty() ? 0 : functional_input_shape[0];
+				if (functional_input_shape.size() == 3) {
+					current_layer->input_size_y = functional_input_shape[1];
+					current_layer->input_size_z = functional_input_shape[2];
+				}
+			}
+			merge_target = input_layers[0];
+			current_valuable_token_index = 2; //As after model.add
+			current_token_index = type_index;
+		}
+
+    while(current_token_index < call_end) {
 			current_token = sfp.get_token(current_token_index);
 			current_token_index++;
 
@@ -273,6 +508,74 @@ bool ParseKerasFile(string SourceFile) {
 				current_valuable_token_index++;
 				current_layer->layer_type = CONV2D;
 			}
+			else if (current_token == "DepthwiseConv2D" || current_token == "SeparableConv2D") {
+				ASSERT(current_valuable_token_index == 2);
+				current_valuable_token_index++;
+				current_layer->layer_type = DEPTHWISE_CONV2D;
+				//SeparableConv2D: the depthwise layer and a pointwise (1x1) layer, which takes the filters, the activation and the biases
+				if (current_token == "SeparableConv2D") {
+					separable_layer = new Layer;
+					separable_layer->layer_type = POINTWISE_CONV2D;
+				}
+			}
+			else if (current_token == "BatchNormalization" || current_token == "Activation" || current_token == "ReLU") {
+				//Not layers of the generated code: they are merged into the preceding layer
+				ASSERT(current_valuable_token_index == 2);
+				Layers.pop_back();
+				delete current_layer;
+				current_layer = functional_line ? merge_target : (Layers.empty() ? NULL : Layers.back());
+				bool add_activation = current_layer && current_layer->layer_type == ADD && current_token != "BatchNormalization";
+				if (!current_layer || !(current_layer->HasWeights() || add_activation)) {
+					ERRORLOGT(current_token + " is only supported after Conv2D, DepthwiseConv2D, SeparableConv2D and Dense layers (Activation and ReLU also after Add)");
+					return false;
+				}
+				if (functional_line) {
+					//The merged layer now computes the output of this line: its former output must not be used anywhere else
+					for (Layer *layer : Layers)
+						if (find(layer->input_layers.begin(), layer->input_layers.end(), current_layer) != layer->input_layers.end()) {
+							ERRORLOGT(current_token + " of " + assigned_variable + ": its input is also used by " + layer->name);
+							return false;
+						}
+					for (auto it = functional_variables.begin(); it != functional_variables.end();) {
+						if (it->second == current_layer) it = functional_variables.erase(it);
+						else it++;
+					}
+				}
+				if (current_layer->activation_function != NO_ACTIVATION && current_layer->activation_function != LINEAR) {
+					ERRORLOGT(current_token + " after a layer with the " + ActivationFunctionsToString(current_layer->activation_function) + " activation is not supported");
+					return false;
+				}
+
+				if (current_token == "BatchNormalization") {
+					ASSERT(!current_layer->batch_norm);
+					current_layer->batch_norm = true;
+					//Only epsilon is needed, the parameters are loaded with the weights: BatchNormalization(epsilon=1e-05, momentum=0.9)
+					for (; current_token_index < sfp.get_num_tokens(); current_token_index++) {
+						if (sfp.get_token(current_token_index) != "epsilon") continue;
+						string value;
+						for (current_token_index += 2; current_token_index < sfp.get_num_tokens(); current_token_index++) { //Skips "="
+							current_token = sfp.get_token(current_token_index);
+							if (current_token == "," || current_token == ")") break;
+							value += current_token; //0.001 is split into 0, ".", 001
+						}
+						current_layer->batch_norm_epsilon = atof(value.c_str());
+						break;
+					}
+				}
+				else if (current_token == "ReLU") current_layer->activation_function = RELU;
+				else { //Activation('relu')
+					for (; current_token_index < sfp.get_num_tokens(); current_token_index++) {
+						current_token = sfp.get_token(current_token_index);
+						if (current_token == "relu") current_layer->activation_function = RELU;
+						else if (current_token == "softmax") current_layer->activation_function = SOFTMAX;
+						else if (current_token == "linear") current_layer->activation_function = LINEAR;
+						else continue;
+						break;
+					}
+					if (current_token_index == sfp.get_num_tokens()) ERRORLOG;
+				}
+				break; //The other arguments are not used
+			}
 			else if (current_token == "MaxPool2D") {
 				ASSERT(current_valuable_token_index == 2);
 				current_valuable_token_index++;
@@ -285,6 +588,12 @@ bool ParseKerasFile(string SourceFile) {
 				current_layer->layer_type = POOLING2D;
 				current_layer->pooling_type = AVERAGE_POOLING;
 			}
+			else if (current_token == "GlobalAveragePooling2D") {
+				ASSERT(current_valuable_token_index == 2);
+				current_valuable_token_index++;
+				current_layer->layer_type = POOLING2D;
+				current_layer->pooling_type = GLOBAL_AVERAGE_POOLING;
+			}
 			else if (current_token == "Flatten") {
 				ASSERT(current_valuable_token_index == 2);
 				current_valuable_token_index++;
@@ -295,9 +604,44 @@ bool ParseKerasFile(string SourceFile) {
 				current_valuable_token_index++;
 				current_layer->layer_type = DENSE;
 			}
+			else if (current_token == "Add" || current_token == "Concatenate") { //Functional API only: Add()([x, y])
+				ASSERT(current_valuable_token_index == 2);
+				current_valuable_token_index++;
+				current_layer->layer_type = current_token == "Add" ? ADD : CONCATENATE;
+				if (current_layer->input_layers.size() < 2) {
+					ERRORLOGT(current_token + " needs a list of at least two inputs, e.g., " + current_token + "()([x, y])");
+					return false;
+				}
+			}
+			else if (current_token == "axis") { //Concatenate(axis=-1): only the channels
+				current_valuable_token_index++;
+				ASSERT(current_layer->layer_type == CONCATENATE);
+
+				current_token = sfp.get_token(current_token_index); //"="
+				current_token_index++;
+				current_token = sfp.get_token(current_token_index);
+				current_token_index++;
+				current_valuable_token_index++;
+				if (current_token != "-1" && current_token != "3") {
+					ERRORLOGT("Concatenate: only axis=-1 (the channels) is supported");
+					return false;
+				}
+			}
+			else if (current_token == "name") { //name='conv1'
+				current_valuable_token_index++;
+
+				current_token = sfp.get_token(current_token_index); //"="
+				current_token_index++;
+				current_token = sfp.get_token(current_token_index); //"'"
+				current_token_index++;
+				current_token = sfp.get_token(current_token_index);
+				current_token_index++;
+				current_valuable_token_index++;
+				current_layer->name = current_token;
+			}
 			else if (current_token == "filters") {
 				current_valuable_token_index++;
-				ASSERT(current_layer->layer_type == CONV2D);
+				ASSERT(current_layer->layer_type == CONV2D || separable_layer);
 
 				current_token = sfp.get_token(current_token_index); //"="
 				current_token_index++;
@@ -307,9 +651,21 @@ bool ParseKerasFile(string SourceFile) {
 				ASSERT(IsNumber(current_token));
 				current_layer->filters_count = atoi(current_token.c_str());
 			}
+			else if (current_token == "depth_multiplier") {
+				current_valuable_token_index++;
+				ASSERT(current_layer->layer_type == DEPTHWISE_CONV2D);
+
+				current_token = sfp.get_token(current_token_index); //"="
+				current_token_index++;
+				current_token = sfp.get_token(current_token_index);
+				current_token_index++;
+				current_valuable_token_index++;
+				ASSERT(IsNumber(current_token));
+				current_layer->depth_multiplier = atoi(current_token.c_str());
+			}
 			else if (current_token == "kernel_size") {
 				current_valuable_token_index++;
-				ASSERT(current_layer->layer_type == CONV2D);
+				ASSERT(current_layer->layer_type == CONV2D || current_layer->layer_type == DEPTHWISE_CONV2D);
 
 				current_token = sfp.get_token(current_token_index); //"="
 				current_token_index++;
@@ -331,9 +687,34 @@ bool ParseKerasFile(string SourceFile) {
 				ASSERT(IsNumber(current_token));
 				current_layer->kernel_size_cols = atoi(current_token.c_str());
 			}
+			else if (current_token == "pool_size") { //pool_size=(2, 2) or pool_size=2
+				current_valuable_token_index++;
+				ASSERT(current_layer->layer_type == POOLING2D && !current_layer->GlobalPooling());
+
+				current_token = sfp.get_token(current_token_index); //"="
+				current_token_index++;
+				current_token = sfp.get_token(current_token_index);
+				current_token_index++;
+				bool tuple = current_token == "(";
+				if (tuple) {
+					current_token = sfp.get_token(current_token_index);
+					current_token_index++;
+				}
+				current_valuable_token_index++;
+				ASSERT(IsNumber(current_token));
+				current_layer->kernel_size_rows = current_layer->kernel_size_cols = atoi(current_token.c_str());
+				if (tuple) {
+					current_token_index++; //","
+					current_token = sfp.get_token(current_token_index);
+					current_token_index++;
+					current_valuable_token_index++;
+					ASSERT(IsNumber(current_token));
+					current_layer->kernel_size_cols = atoi(current_token.c_str());
+				}
+			}
 			else if (current_token == "activation") {
 				current_valuable_token_index++;
-				ASSERT(current_layer->layer_type == CONV2D || current_layer->layer_type == DENSE);
+				ASSERT(current_layer->layer_type == CONV2D || current_layer->layer_type == DEPTHWISE_CONV2D || current_layer->layer_type == DENSE);
 
 				current_token = sfp.get_token(current_token_index); //"="
 				current_token_index++;
@@ -361,7 +742,7 @@ bool ParseKerasFile(string SourceFile) {
 			}
 			else if (current_token == "strides") {
 				current_valuable_token_index++;
-				ASSERT(current_layer->layer_type == POOLING2D || current_layer->layer_type == CONV2D);
+				ASSERT(current_layer->layer_type == POOLING2D || current_layer->layer_type == CONV2D || current_layer->layer_type == DEPTHWISE_CONV2D);
 
 				current_token = sfp.get_token(current_token_index); //"="
 				current_token_index++;
@@ -369,27 +750,29 @@ bool ParseKerasFile(string SourceFile) {
 				current_token_index++;
 				current_valuable_token_index++;
 				if(IsNumber(current_token)) { //strides = 2
-					current_layer->stride_size = atoi(current_token.c_str());
-					ASSERT(current_layer->kernel_size_rows == 0);
-					ASSERT(current_layer->kernel_size_cols == 0);
+					current_layer->stride_size_rows = current_layer->stride_size_cols = atoi(current_token.c_str());
+					if (current_layer->layer_type != POOLING2D) { //A pooling layer may have a pool_size
+						ASSERT(current_layer->kernel_size_rows == 0);
+						ASSERT(current_layer->kernel_size_cols == 0);
+					}
 				}
-				else { //strides = (2, 2)
+				else { //strides = (2, 1)
 					ASSERT(current_token == "(");
 					current_token = sfp.get_token(current_token_index);
 					current_token_index++;
 					ASSERT(IsNumber(current_token));
-					current_layer->stride_size = atoi(current_token.c_str());
+					current_layer->stride_size_rows = atoi(current_token.c_str());
 					current_token = sfp.get_token(current_token_index); //","
 					current_token_index++;
 					current_token = sfp.get_token(current_token_index);
 					current_token_index++;
 					ASSERT(IsNumber(current_token));
-					ASSERT(current_layer->stride_size == atoi(current_token.c_str()));
+					current_layer->stride_size_cols = atoi(current_token.c_str());
 				}
 			}
 			else if (current_token == "padding") {
 				current_valuable_token_index++;
-				ASSERT(current_layer->layer_type == CONV2D);
+				ASSERT(current_layer->layer_type == CONV2D || current_layer->layer_type == DEPTHWISE_CONV2D);
 
 				current_token = sfp.get_token(current_token_index); //"="
 				current_token_index++;
@@ -439,110 +822,72 @@ bool ParseKerasFile(string SourceFile) {
 				current_layer->node_count = atoi(current_token.c_str());
 			}
     }
-  }
-
-	return true;
-}
 
-void CompleteLayersInfo() {
-	for(size_t i = 0; i < Layers.size(); i++)
-	{
-		if (Layers[i]->stride_size == 0) Layers[i]->stride_size = 1;
-		if (Layers[i]->layer_type == CONV2D && Layers[i]->padding_type == NO_PADDING) Layers[i]->padding_type = PADDING_VALID;
-		if (Layers[i]->kernel_size_rows == 0 && Layers[i]->kernel_size_cols == 0 && Layers[i]->stride_size != 0) Layers[i]->kernel_size_rows = Layers[i]->kernel_size_cols = Layers[i]->stride_size;
-
-		if (Layers[i]->input_size_x == 0) {
-			ASSERT(i > 0);
-			ASSERT(Layers[i]->input_size_y == 0);
-			ASSERT(Layers[i]->input_size_z == 0);
-			
-			Layers[i]->input_size_x = Layers[i-1]->output_size_x;
-			Layers[i]->input_size_y = Layers[i-1]->output_size_y;
-			Layers[i]->input_size_z = Layers[i-1]->output_size_z;
-		}
-
-		if (Layers[i]->filters_count == 0 && Layers[i]->layer_type == POOLING2D) {
-			Layers[i]->filters_count = Layers[i-1]->output_size_z;
+		if (separable_layer) {
+			separable_layer->filters_count = current_layer->filters_count;
+			separable_layer->activation_function = current_layer->activation_function;
+			separable_layer->kernel_size_rows = separable_layer->kernel_size_cols = 1;
+			separable_layer->stride_size_rows = separable_layer->stride_size_cols = 1;
+			separable_layer->padding_type = PADDING_VALID;
+			current_layer->filters_count = 0;
+			current_layer->activation_function = LINEAR;
+			if (functional_line) separable_layer->input_layers.assign(1, current_layer);
+			Layers.push_back(separable_layer);
+			current_layer = separable_layer;
+			separable_layer = NULL;
 		}
+		if (functional_line) functional_variables[assigned_variable] = current_layer;
+  }
 
-		if (Layers[i]->layer_type == FLATTEN) {
-			ASSERT(Layers[i+1]->layer_type == DENSE);
-
-			ASSERT(Layers[i]->node_count == 0);
-
-			if (i == 0) { 
-				//The first layer is a FLATTEN layer (The case for an MLP where the real first layer is a multidimentional DENSE)
-				//In this case the input size should be specified in the flatten layer
-				ASSERT(Layers[i]->input_size_x != 0);
-				ASSERT(Layers[i]->input_size_y != 0);
-				ASSERT(Layers[i]->input_size_z != 0);
-				
-				Layers[i]->node_count = Layers[i]->input_size_x * Layers[i]->input_size_y * Layers[i]->input_size_z;;
+	if (functional_model) {
+		//One output: every layer is used by the output layer
+		Layer *output_layer = NULL;
+		int output_count = 0;
+		for (Layer *layer : Layers) {
+			if (layer->input_layers.empty()) {
+				ERRORLOGT("model.add layers are not supported in a functional model");
+				return false;
 			}
-			else {
-				ASSERT(Layers[i-1]->output_size_x != 0 && Layers[i-1]->output_size_y != 0 && Layers[i-1]->output_size_z != 0);
-				Layers[i]->input_size_x = Layers[i-1]->output_size_x;
-				Layers[i]->input_size_y = Layers[i-1]->output_size_y;
-				Layers[i]->input_size_z = Layers[i-1]->output_size_z;
-
-				Layers[i]->node_count = Layers[i-1]->output_size_x * Layers[i-1]->output_size_y * Layers[i-1]->output_size_z;;
+			bool used = false;
+			for (Layer *consumer : Layers) used = used || find(consumer->input_layers.begin(), consumer->input_layers.end(), layer) != consumer->input_layers.end();
+			if (!used) {
+				output_layer = layer;
+				output_count++;
 			}
 		}
-
-		if (Layers[i]->node_count != 0) {
-			ASSERT(Layers[i]->layer_type == DENSE || Layers[i]->layer_type == FLATTEN);
-			Layers[i]->output_size_z = 1;
-			Layers[i]->output_size_x = Layers[i]->node_count;
-			Layers[i]->output_size_y = 1;
+		if (output_count != 1) {
+			ERRORLOGT("The functional model has " + to_string(output_count) + " layers whose output is not used by another layer. Only one output is supported.");
+			return false;
 		}
-		else if (Layers[i]->kernel_size_rows != 0) {
-			ASSERT(Layers[i]->kernel_size_rows == Layers[i]->kernel_size_cols); //Currently, just square kernel is supported
-
-			ASSERT(Layers[i]->filters_count != 0);
-			Layers[i]->output_size_z = Layers[i]->filters_count;
-
-			int LastFilteredBoxLen, StrideCount;
-			if (Layers[i]->padding_type == PADDING_VALID || Layers[i]->layer_type == POOLING2D) {
-				LastFilteredBoxLen = Layers[i]->input_size_x - Layers[i]->kernel_size_rows; 
-
-				//ASSERT(LastFilteredBoxLen % Layers[i]->stride_size == 0); //otherwise floor(LastFilteredBoxLen / Layers[i]->stride_size) + 1;
-				StrideCount = (LastFilteredBoxLen / Layers[i]->stride_size) + 1; //NOTE: Integer division to implemet the floor
-				Layers[i]->output_size_x = StrideCount;
-			
-				LastFilteredBoxLen = Layers[i]->input_size_y - Layers[i]->kernel_size_cols; 
-				StrideCount = (LastFilteredBoxLen / Layers[i]->stride_size) + 1;
-				Layers[i]->output_size_y = StrideCount;
-			}
-			else {
-				ASSERT(Layers[i]->padding_type == PADDING_SAME && Layers[i]->layer_type == CONV2D);
-				ASSERT(Layers[i]->kernel_size_rows % 2 == 1);
-				ASSERT(Layers[i]->kernel_size_cols % 2 == 1);
+		if (functional_output != "" && (!functional_variables.count(functional_output) || functional_variables[functional_output] != output_layer)) {
+			ERRORLOGT("Model outputs " + functional_output + " is not the output of the last layer (" + output_layer->name + ")");
+			return false;
+		}
+		TopologicalSchedulePass().Run(graph);
+	}
 
-				int padding_size_x, padding_size_y;
-				Layer* layer = Layers[i];
+	for (Layer *layer : Layers) //Keras default: activation=None
+		if ((layer->HasWeights() || layer->layer_type == ADD) && layer->activation_function == NO_ACTIVATION) layer->activation_function = LINEAR;
 
-				padding_size_x = (layer->kernel_size_rows - 1) / 2;
-				padding_size_y = (layer->kernel_size_cols - 1) / 2;
+	return true;
+}
 
-				if (Layers[i]->stride_size == 1)
-				{
-					Layers[i]->output_size_x = Layers[i]->input_size_x;
-					Layers[i]->output_size_y = Layers[i]->input_size_y;
-				}
-				else
-				{
-					// Division returns int. So, even if stride is unaligned, it still works.
-					Layers[i]->output_size_x = ((Layers[i]->input_size_x + 2 * padding_size_x - Layers[i]->kernel_size_rows) / Layers[i]->stride_size) + 1;
-					Layers[i]->output_size_y = ((Layers[i]->input_size_y + 2 * padding_size_y - Layers[i]->kernel_size_cols) / Layers[i]->stride_size) + 1;
-				}
-			}
-		}
-		else ERRORLOG;
-	}
+//Shape inference (former CompleteLayersInfo), quantization indices, fusion, layouts and memory planning before the code generation
+void RunGraphPasses() {
+	PassManager pass_manager;
+	pass_manager.Add(new ConnectTensorsPass());
+	pass_manager.Add(new ShapeInferencePass());
+	pass_manager.Add(new QuantizationIndexPass());
+	pass_manager.Add(new FusionPass());
+	pass_manager.Add(new LayoutSelectionPass());
+	pass_manager.Add(new MemoryPlanningPass());
+	pass_manager.Run(graph, dump_layers);
+
+	if (dump_layers) cout << "Memory plan: " << graph.buffer_count << " buffers for the intermediate tensors, peak live elements: " << graph.peak_live_elements << endl;
 }
 
 void GenerateCFiles() {
-	ofstream f_stream;
+	CodeEmitter f_stream;
 	string f_location = output_dir + "main.cpp";
 	f_stream.open(f_location, (ios::out));
 	int temp_int;
@@ -550,7 +895,8 @@ void GenerateCFiles() {
 	int current_indent = 0;
 
 	int LayersCount = Layers.size();
-	bool quantized = data_type_mode_fixed_point_single && (data_type_mode_detail == "eight-bit-int" || data_type_mode_detail == "default_int8_t");
+	bool quantized = QuantizedMode();
+	bool packed_weights = quantized && PackedWeightBits() != 0;
 
 	if (add_main_function) {
 		AddToCFile_Text(f_stream, "//#define _HLS_RUN");
@@ -562,6 +908,7 @@ void GenerateCFiles() {
 		AddToCFile_Text(f_stream, "#include \"time.h\"");
 		AddToCFile_Text(f_stream, "#include <typeinfo>");
 		AddToCFile_Text(f_stream, "#include <thread>");
+		if (BatchNormFolding()) AddToCFile_Text(f_stream, "#include \"math.h\"");
 		AddToCFile_Text(f_stream, "#endif //_HLS_RUN");
 		AddToCFile_EmptyLine(f_stream);
 	}
@@ -579,9 +926,10 @@ void GenerateCFiles() {
 		if (data_type_mode_fixed_point_single && data_type_mode_detail == "eight-bit-int") AddToCFile_Text(f_stream, "#include \"quantization.h\"");
 		if (store_alanysis_data) {
 			AddToCFile_Text(f_stream, "int RunCounter = 0;");
-			AddToCFile_Text(f_stream, "#define STORE_DATA(p1, p2, p3, p4, p5, p6) {StoreData(p1, p2, p3, RunCounter < 1, p4, p5, p6);}");
+			AddToCFile_Text(f_stream, "#define STORE_DATA(p1, p2, p3, p4, p5, p6) {StoreData(p1, p2, p3, RunCounter < 1, p4, p5, p6); StoreRange(p1, p2, p3);}");
 			AddToCFile_Text(f_stream, "//#define STORE_DATA(p1, p2, p3, p4, p5, p6) {StoreData(p1, p2, p3, false, p4, p5, p6);}");
 			AddToCFile_Text(f_stream, "//#define STORE_DATA(p1, p2, p3, p4, p5, p6)");
+			AddToCFile_AnalysisRangeFunctions(f_stream);
 		}
 		AddToCFile_Text(f_stream, "extern map<string, string> arguments;");
 		AddToCFile_Text(f_stream, "#else");
@@ -614,6 +962,8 @@ void GenerateCFiles() {
 	AddToCFile_EmptyLine(f_stream);
 
 	if (quantized) { AddToCFile_QMinMax(f_stream); AddToCFile_EmptyLine(f_stream);}
+	if (dsp_packing) { AddToCFile_DspPacking(f_stream); AddToCFile_EmptyLine(f_stream);}
+	if (packed_weights) { AddToCFile_PackedWeights(f_stream); AddToCFile_EmptyLine(f_stream);}
 
 	if (approximate_multipliers) {
 		AddToCFile_Text(f_stream, "#include \"multipliers.h\"");
@@ -635,13 +985,13 @@ void GenerateCFiles() {
 		AddToCFile_Text(f_stream, R"(#define MUL_LAYER(a, b, layer_id) (mul_general<int16_t>(a, b, layer_id, arguments["mul-name"], arguments["mul-layers-config"])))");
 
 		for(size_t i = 0; i < Layers.size(); i++) {
-			if (Layers[i]->layer_type == CONV2D || Layers[i]->layer_type == DENSE) AddToCFile_Text(f_stream, "#define MUL_LAYER_" + to_string(i + 1) + "(a, b) MUL_LAYER(a, b, " + to_string(i + 1) + ")");
+			if (Layers[i]->HasWeights()) AddToCFile_Text(f_stream, "#define MUL_LAYER_" + to_string(i + 1) + "(a, b) MUL_LAYER(a, b, " + to_string(i + 1) + ")");
 		}
 
 		AddToCFile_Text(f_stream, "#else //_HLS_RUN");
 
 		for(size_t i = 0; i < Layers.size(); i++) {
-			if (Layers[i]->layer_type == CONV2D || Layers[i]->layer_type == DENSE) {
+			if (Layers[i]->HasWeights()) {
 				temp_string = "";  if (approximate_multipliers_configuration[i] == '0') temp_string = "//";
 				AddToCFile_Text(f_stream, temp_string + "#define MUL_LAYER_" + to_string(i + 1) + " MULTIPLIER_NAME");
 			}
@@ -649,7 +999,7 @@ void GenerateCFiles() {
 		AddToCFile_EmptyLine(f_stream);
 
 		for(size_t i = 0; i < Layers.size(); i++) {
-			if (Layers[i]->layer_type == CONV2D || Layers[i]->layer_type == DENSE) {
+			if (Layers[i]->HasWeights()) {
 				temp_string = "";  if (approximate_multipliers_configuration[i] == '1') temp_string = "//";
 				AddToCFile_Text(f_stream, temp_string + "#define MUL_LAYER_" + to_string(i + 1) + " MULTIPLIER_EXACT");
 			}
@@ -662,7 +1012,7 @@ void GenerateCFiles() {
 	int temp_input_size_x, temp_input_size_y, temp_input_size_z;
 	if (single_layer == 0 || single_layer == 1 ||
 			(single_layer >= 2 
-						&& (Layers[single_layer]->layer_type == CONV2D || Layers[single_layer]->layer_type == POOLING2D || Layers[single_layer]->layer_type == FLATTEN)
+						&& (Layers[single_layer]->layer_type != DENSE)
 			)
 		 ){
 		temp_int = 0;
@@ -672,7 +1022,7 @@ void GenerateCFiles() {
 		temp_input_size_z = Layers[temp_int]->input_size_z;
 		ASSERT(temp_input_size_x > 0 && temp_input_size_y > 0 && temp_input_size_z > 0);
 
-		AddToCFile_Text(f_stream, "typedef DataType_input InputType[" + to_string(temp_input_size_x) + "]"
+		AddToCFile_Text(f_stream, "typedef DataType_input InputType" + BatchDimension() + "[" + to_string(temp_input_size_x) + "]"
 																														+ "[" + to_string(temp_input_size_y) + "]"
 																														+ "[" + to_string(temp_input_size_z) + "];");
 	}
@@ -681,7 +1031,7 @@ void GenerateCFiles() {
 			temp_input_size_x = Layers[temp_int]->input_size_x;
 			ASSERT(temp_input_size_x > 0);
 
-			AddToCFile_Text(f_stream, "typedef DataType_input InputType[" + to_string(temp_input_size_x) + "];");
+			AddToCFile_Text(f_stream, "typedef DataType_input InputType" + BatchDimension() + "[" + to_string(temp_input_size_x) + "];");
 	}
 
 	int temp_output_size_x, temp_output_size_y, temp_output_size_z;
@@ -694,8 +1044,8 @@ void GenerateCFiles() {
 		if (single_layer >= 2) temp_int = single_layer - 1;
 		temp_output_size_x = Layers[temp_int]->output_size_x;
 		ASSERT(temp_output_size_x > 0);
-		temp_string = "typedef DataType_output@ OutputType[" + to_string(temp_output_size_x) + "];";
-		temp_string = StringSubstituteAll(temp_string, "@", quantized?"_short":"");
+		temp_string = "typedef DataType_output" + string(quantized ? "_short" : "") + " OutputType" + BatchDimension() + "[" + to_string(temp_output_size_x) + "];";
+		if (output_top_k) temp_string = "typedef int OutputType" + BatchDimension() + "[" + to_string(output_top_k) + "]; //output-mode: class indices";
 		AddToCFile_Text(f_stream, temp_string);
 	}
 	else { //Single_layer >= 2 and CONV2D or POOLING2D
@@ -705,7 +1055,7 @@ void GenerateCFiles() {
 			temp_output_size_z = Layers[temp_int]->output_size_z;
 			ASSERT(temp_output_size_x > 0 && temp_output_size_y > 0 && temp_output_size_z > 0);
 
-			AddToCFile_Text(f_stream, "typedef DataType_output OutputType[" + to_string(temp_output_size_x) + "]"
+			AddToCFile_Text(f_stream, "typedef DataType_output OutputType" + BatchDimension() + "[" + to_string(temp_output_size_x) + "]"
 																																+ "[" + to_string(temp_output_size_y) + "]"
 																																+ "[" + to_string(temp_output_size_z) + "];");
 	}
@@ -720,11 +1070,7 @@ void GenerateCFiles() {
 	if (quantized) {
 		temp_string = "";
 		bool conv_or_dense ;
-		int conv_or_dense_count = 0;
-		for(int i = 0; i < layers_size; i++) {
-			conv_or_dense = Layers[i]->layer_type == CONV2D || Layers[i]->layer_type == DENSE;
-			if (conv_or_dense) ++conv_or_dense_count;
-		}
+		int conv_or_dense_count = graph.quantized_layer_count;
 		temp_string += "DataType_IZP input_zero_points[" + to_string(conv_or_dense_count) + "], ";
 		temp_string += "DataType_OZP output_zero_points[" + to_string(conv_or_dense_count) + "], ";
 		temp_string += "DataType_ISF input_scale_factors[" + to_string(conv_or_dense_count) + "], ";
@@ -734,17 +1080,9 @@ void GenerateCFiles() {
 
 		temp_string = "";
 		for(int i = 0; i < layers_size; i++) {
-			bool conv = Layers[i]->layer_type == CONV2D;
-			bool dense = Layers[i]->layer_type == DENSE;
-			conv_or_dense = conv || dense;
+			conv_or_dense = Layers[i]->HasWeights();
 			if (!conv_or_dense) continue;
-			string temp_string2 = "";
-
-			temp_string2 += "DataType_WSF weight_scales_#[@], ";
-			temp_string2 = StringSubstituteAll(temp_string2, "#", to_string(i + 1));
-			temp_string2 = StringSubstituteAll(temp_string2, "@", to_string(conv?Layers[i]->output_size_z:Layers[i]->output_size_x));
-
-			temp_string += temp_string2;			
+			temp_string += FillTemplate("DataType_WSF weight_scales_#[@], ", {{'#', to_string(i + 1)}, {'@', to_string(Layers[i]->OutputChannels())}});
 		}
 
 		AddToCFile_Text(f_stream, temp_string, 3);
@@ -758,11 +1096,13 @@ void GenerateCFiles() {
 			if (temp_int > 0) f_stream  << ", ";
 			if (temp_int > 0 && temp_int % 3 == 0) f_stream  << endl;
 			if (temp_int % 3 == 0) f_stream << indent;
-			f_stream  << "DataType_weights weights_" << i + 1 
+			if (SparseDensity(i)) f_stream << JoinStrings(SparseWeightsArrays(i, ""), ", ");
+			else
+			f_stream  << (packed_weights?"DataType_weights_packed":"DataType_weights") << " weights_" << i + 1 
 								<< "[" + to_string(Layers[i]->kernel_size_rows) + "]"
 								<< "[" + to_string(Layers[i]->kernel_size_cols) + "]"
 								<< "[" + to_string(Layers[i]->input_size_z) + "]"
-								<< "[" + to_string(Layers[i]->output_size_z) + "]"
+								<< "[" + to_string(packed_weights?PackedWeightsSize(Layers[i]->output_size_z):Layers[i]->output_size_z) + "]"
 				;
 			if (biases_enabled) f_stream  << ", DataType_biases biases_" << i + 1 << "[" + to_string(Layers[i]->output_size_z) + "]";
 			if (single_layer && i != single_layer -1) f_stream  << "*/ ";
@@ -774,33 +1114,34 @@ void GenerateCFiles() {
 			if (temp_int > 0 && temp_int % 3== 0) f_stream  << endl;
 			if (temp_int % 3== 0) f_stream << indent;
 
-			f_stream  << "DataType_weights weights_" << i + 1 
+			if (SparseDensity(i)) f_stream << JoinStrings(SparseWeightsArrays(i, ""), ", ");
+			else
+			f_stream  << (packed_weights?"DataType_weights_packed":"DataType_weights") << " weights_" << i + 1 
 								<< "[" + to_string(Layers[i]->input_size_x) + "]"
-								<< "[" + to_string(Layers[i]->output_size_x) + "]";
+								<< "[" + to_string(packed_weights?PackedWeightsSize(Layers[i]->output_size_x):Layers[i]->output_size_x) + "]";
 			if (biases_enabled) f_stream  << ", DataType_biases biases_" << i + 1 << "[" + to_string(Layers[i]->output_size_x) + "]";
 			if (single_layer && i != single_layer -1) f_stream  << "*/ ";
 			temp_int++;
 		}
+		else if (Layers[i]->HasWeights()) { //Depthwise and pointwise Conv2D (unpacked weights)
+			if (single_layer && i != single_layer -1) f_stream  << " /*";
+			if (temp_int > 0) f_stream  << ", ";
+			if (temp_int > 0 && temp_int % 3== 0) f_stream  << endl;
+			if (temp_int % 3== 0) f_stream << indent;
+
+			f_stream  << "DataType_weights weights_" << i + 1 << WeightDimensions(i);
+			if (biases_enabled) f_stream  << ", DataType_biases biases_" << i + 1 << "[" + to_string(Layers[i]->OutputChannels()) + "]";
+			if (single_layer && i != single_layer -1) f_stream  << "*/ ";
+			temp_int++;
+		}
 	}
 
 	temp_int = 0;
 	for(size_t i = 0; i < Layers.size(); i++)	{
 		if (i == Layers.size() - 1) continue; //output
 
-		int layer_number = i;
-		Layer* layer = Layers[i];
-		string layer_datatype_suffix = "Layer" + to_string(layer_number + 1);
-
-		if (layer->layer_type == CONV2D || layer->layer_type == POOLING2D)
-			temp_string = ", DataType_" + layer_datatype_suffix + " l#"
-										+ "[" + to_string(layer->output_size_x) + "]"
-										+ "[" + to_string(layer->output_size_y) + "]"
-										+ "[" + to_string(layer->output_size_z) + "]"
-			;
-		else //FLATTEN, DENSE
-			temp_string = ", DataType_" + layer_datatype_suffix + " l#[" + to_string(layer->output_size_x) + "]";
-
-		temp_string = StringSubstituteAll(temp_string, "#", to_string(layer_number+1));
+		Tensor& output = graph.OutputTensor(i);
+		temp_string = ", DataType_" + output.data_type_suffix + " " + output.name + BatchDimension() + output.Dimensions();
 		if (LayerDataLocation(i + 1) == "local") {
 			//either comment or totally remove
 			temp_string = " /*" + temp_string + "*/";
@@ -818,6 +1159,9 @@ void GenerateCFiles() {
 	AddToCFile_Text(f_stream, ")");
 	AddToCFile_Text(f_stream, "{", current_indent++);
 
+	if (axi_interfaces) AddToCFile_AxiInterfaces(f_stream);
+	AddToCFile_LocalBuffers(f_stream, current_indent);
+
 	if (store_alanysis_data) {
 		AddToCFile_Text(f_stream, "#ifndef _HLS_RUN", current_indent);
 		AddToCFile_Text(f_stream, "for (int input_x = 0; input_x < " + to_string(Layers[0]->input_size_x) + "; input_x++)", current_indent++);
@@ -831,6 +1175,7 @@ void GenerateCFiles() {
 
 	for(int i = 0; i < layers_size; i++)	{
 		if (single_layer && single_layer - 1 != i) continue;
+		AddToCFile_AxiBurst(f_stream, i, true);
 		switch(Layers[i]->layer_type)
 		{
 			case CONV2D:
@@ -845,10 +1190,21 @@ void GenerateCFiles() {
 			case DENSE:
 				AddToCFile_DenseLayer(f_stream, i);
 				break;
+			case DEPTHWISE_CONV2D:
+				AddToCFile_DepthwiseConv2dLayer(f_stream, i);
+				break;
+			case POINTWISE_CONV2D:
+				AddToCFile_PointwiseConv2dLayer(f_stream, i);
+				break;
+			case ADD:
+			case CONCATENATE:
+				AddToCFile_MergeLayer(f_stream, i);
+				break;
 			default:
 				ASSERTA;
 				break;
 		}
+		AddToCFile_AxiBurst(f_stream, i, false);
 
 		if (false && quantized /* old quantization method*/) {
 			AddToCFile_EmptyLine(f_stream, 1);
@@ -879,17 +1235,15 @@ void GenerateCFiles() {
 	f_stream.close();
 }
 
-void AddToCFile_Text(ofstream &f_stream, string text, int indent) {
-	f_stream << Tabs(indent) << text << endl;
+void AddToCFile_Text(CodeEmitter &f_stream, const string &text, int indent) {
+	f_stream.Line(text, indent);
 }
 
-void AddToCFile_EmptyLine(ofstream &f_stream, int count) {
-	for(int i = 0; i < count; i++) {
-		AddToCFile_Text(f_stream, "");
-	}
+void AddToCFile_EmptyLine(CodeEmitter &f_stream, int count) {
+	f_stream.EmptyLine(count);
 }
 
-void AddToCFile_ActivationFunction(ofstream &f_stream, ActivationFunctions function) {
+void AddToCFile_ActivationFunction(CodeEmitter &f_stream, ActivationFunctions function) {
 	switch(function) {
 		case RELU:
 			AddToCFile_Text(f_stream, "DataType_relu relu(DataType_relu x)");
@@ -915,75 +1269,122 @@ void AddToCFile_ActivationFunction(ofstream &f_stream, ActivationFunctions funct
 	}
 }
 
-void AddToCFile_QMinMax(ofstream& f_stream) {
+void AddToCFile_QMinMax(CodeEmitter &f_stream) {
 	AddToCFile_Text(f_stream, "#define Q_MAX(x, y) (x>y?x:y)");
 	AddToCFile_Text(f_stream, "#define Q_MIN(x, y) (x>y?y:x)");
 	AddToCFile_Text(f_stream, "#define Q_MIN_MAX(x) ( Q_MIN(Q_MAX(x, -128), 127) )");
 }
 
-void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
+//Value written to an output element of a layer with weights: the activation of the accumulator and, in the quantized modes, the requantization to the short type.
+//The whole chain is one expression, so the intermediate values stay in registers and only the final result is stored (no <name>_base arrays).
+string OutputEpilogue(int layer_index, string activation, string accumulator, string channel) {
+	string value = activation + "(" + accumulator + ")";
+	if (!QuantizedMode()) return value;
+
+	string q = to_string(Layers[layer_index]->q_index);
+	return "DataType_" + graph.OutputTensor(layer_index).data_type_suffix + "_short(Q_MIN_MAX(" + value + "*input_scale_factors[" + q + "]*weight_scales_" + to_string(layer_index + 1) + "[" + channel + "]/output_scale_factors[" + q + "] + output_zero_points[" + q + "]))";
+}
+
+void AddToCFile_DspPacking(CodeEmitter &f_stream) {
+	//a * (w_high * 2^18 + w_low) = (a * w_high) * 2^18 + a * w_low
+	//With 8-bit operands, a * w_low fits in the lower 18 bits (signed), so both products are recovered exactly.
+	AddToCFile_Text(f_stream, "//DSP packing: two int8 MACs sharing the same input with a single 27x18 multiplication");
+	AddToCFile_Text(f_stream, "#define DSP_PACK_SHIFT 18");
+	AddToCFile_Text(f_stream, "#define DSP_PACK(w_high, w_low) ((DataType_dsp_packed)(w_high) * (1 << DSP_PACK_SHIFT) + (DataType_dsp_packed)(w_low))");
+	AddToCFile_Text(f_stream, "#define DSP_UNPACK_LOW(p) ((DataType)((((p) & ((1 << DSP_PACK_SHIFT) - 1)) ^ (1 << (DSP_PACK_SHIFT - 1))) - (1 << (DSP_PACK_SHIFT - 1))))");
+	AddToCFile_Text(f_stream, "#define DSP_UNPACK_HIGH(p) ((DataType)(((p) - DSP_UNPACK_LOW(p)) >> DSP_PACK_SHIFT))");
+}
+
+void AddToCFile_PackedWeights(CodeEmitter &f_stream) {
+	int bits = PackedWeightBits();
+	AddToCFile_Text(f_stream, "//Packed weights: " + data_type_mode_detail + ", " + to_string(8 / bits) + " weights per byte along the output channels/nodes");
+	AddToCFile_Text(f_stream, "//Weight c of a row is stored in byte c / WEIGHTS_PER_BYTE, field c % WEIGHTS_PER_BYTE");
+	AddToCFile_Text(f_stream, "#define WEIGHT_BITS " + to_string(bits));
+	AddToCFile_Text(f_stream, "#define WEIGHTS_PER_BYTE (8 / WEIGHT_BITS)");
+	AddToCFile_Text(f_stream, "#define WEIGHT_FIELD(p, c) (((p) >> (((c) % WEIGHTS_PER_BYTE) * WEIGHT_BITS)) & ((1 << WEIGHT_BITS) - 1))");
+	if (bits == 4) {
+		AddToCFile_Text(f_stream, "#define WEIGHT_UNPACK(p, c) ((DataType_weights)((WEIGHT_FIELD(p, c) ^ 8) - 8))");
+		AddToCFile_Text(f_stream, "#define WEIGHT_ENCODE(w) ((DataType_weights_packed)(Q_MIN(Q_MAX(w, -8), 7) & 0xF))");
+		AddToCFile_Text(f_stream, "#define WEIGHT_MUL(a, w) ((a) * (w))");
+	}
+	else if (bits == 2) { //ternary: 01: 1, 11: -1, 00: 0
+		AddToCFile_Text(f_stream, "#define WEIGHT_UNPACK(p, c) ((DataType_weights)((WEIGHT_FIELD(p, c) ^ 2) - 2))");
+		AddToCFile_Text(f_stream, "#define WEIGHT_ENCODE(w) ((DataType_weights_packed)((w) > 0 ? 1 : ((w) < 0 ? 3 : 0)))");
+		AddToCFile_Text(f_stream, "#define WEIGHT_MUL(a, w) ((w) == 0 ? 0 : ((w) > 0 ? (a) : -(a)))");
+	}
+	else { //binary: 1: 1, 0: -1
+		ASSERT(bits == 1);
+		AddToCFile_Text(f_stream, "#define WEIGHT_UNPACK(p, c) ((DataType_weights)(WEIGHT_FIELD(p, c) ? 1 : -1))");
+		AddToCFile_Text(f_stream, "#define WEIGHT_ENCODE(w) ((DataType_weights_packed)((w) >= 0 ? 1 : 0))");
+		AddToCFile_Text(f_stream, "#define WEIGHT_MUL(a, w) ((w) > 0 ? (a) : -(a))");
+	}
+}
+
+//weight-prefetch: output channels per weight tile of a Conv2D layer, 0: the MAC loop reads the weights from the argument of forward
+//parallel-units also uses the tiles (one slice per unit), so the block is a multiple of the units
+int WeightPrefetchBlock(int layer_index) {
+	Layer *layer = Layers[layer_index];
+	int units = ParallelUnits(layer_index);
+	if ((!weight_prefetch && units == 1) || layer->layer_type != CONV2D || SparseDensity(layer_index) != 0) return 0;
+	int channels_per_unit = layer->output_size_z / units;
+	int block = max(1, min(weight_prefetch ? weight_prefetch_block / units : 1, channels_per_unit));
+	while (channels_per_unit % block != 0) block--;
+	return block * units;
+}
+
+//The strides in the layer comments: 2 (equal strides) or 2x1
+string StridesToString(Layer *layer) {
+	if (layer->stride_size_rows == layer->stride_size_cols) return to_string(layer->stride_size_rows);
+	return to_string(layer->stride_size_rows) + "x" + to_string(layer->stride_size_cols);
+}
+
+//The multiplication of output_x/output_y in an input index, empty for stride 1
+string StrideText(int stride) {
+	return stride != 1 ? " * " + to_string(stride) : "";
+}
+
+void AddToCFile_Conv2dLayer(CodeEmitter &f_stream, int layer_number) {
 	int current_indent = 1;
 	string temp_string, temp_string2;
 	int temp_int;
 
 	Layer* layer = Layers[layer_number];
-  int layers_size = Layers.size();
 	string layer_loop_order = loop_orders[layer_number];
-	bool quantized = data_type_mode_fixed_point_single && (data_type_mode_detail == "eight-bit-int" || data_type_mode_detail == "default_int8_t");
-	int q_index = -1;
-	for (int i = 0; i <= layer_number; ++i) 
-		if (Layers[i]->layer_type == CONV2D || Layers[i]->layer_type == DENSE) q_index++;
+	bool quantized = QuantizedMode();
+	bool packed_weights = quantized && PackedWeightBits() != 0;
+	int q_index = layer->q_index;
 
 	if (quantized) ASSERT(!single_layer); //Not tested yet
 
-	AddToCFile_Text(f_stream, "//Layer " + to_string(layer_number+1) + ": Conv2D(Padding: " + PaddingTypesToString(layer->padding_type) + ", Stride: " + to_string(layer->stride_size) + ")" , current_indent);
+	AddToCFile_Text(f_stream, "//Layer " + to_string(layer_number+1) + ": Conv2D(Padding: " + PaddingTypesToString(layer->padding_type) + ", Stride: " + StridesToString(layer) + ")" , current_indent);
 	AddToCFile_Text(f_stream, "//Input: X:" + to_string(layer->input_size_x) + ", Y: " + to_string(layer->input_size_y) + ", Z: " + to_string(layer->input_size_z), current_indent);
 	AddToCFile_Text(f_stream, "//Output: X:" + to_string(layer->output_size_x) + ", Y: " + to_string(layer->output_size_y) + ", Z: " + to_string(layer->output_size_z), current_indent);
 
-	string layer_datatype_suffix = "Layer" + to_string(layer_number + 1);
-	if (layer_number == layers_size - 1) layer_datatype_suffix = "output";
+	bool global_pooling_fused = GlobalPoolingFused(layer_number);
 
-	if (!single_layer) {
-		temp_string = "";
-		if (LayerDataLocation(layer_number + 1) != "local") temp_string = "//"; else temp_string = "";
-		string static_text = ""; //add_main_function?"STATIC ":"";
-		temp_string += static_text + "DataType_" + layer_datatype_suffix + "@ l#[" + to_string(layer->output_size_x) + "]"
-																										 										+ "[" + to_string(layer->output_size_y) + "]"
-																																				+ "[" + to_string(layer->output_size_z) + "];";
-		if (quantized) {
-			temp_string2 = temp_string;
-			temp_string = StringSubstituteAll(temp_string, "#", to_string(layer_number+1) + "_base");
-			temp_string = StringSubstituteAll(temp_string, "@", "");
-			AddToCFile_Text(f_stream, temp_string, current_indent);
-
-			temp_string = temp_string2;
-			temp_string = StringSubstituteAll(temp_string, "#", to_string(layer_number+1));
-			temp_string = StringSubstituteAll(temp_string, "@", "_short");
-			AddToCFile_Text(f_stream, temp_string, current_indent);
-		}
-		else {
-			temp_string = StringSubstituteAll(temp_string, "#", to_string(layer_number+1));
-			temp_string = StringSubstituteAll(temp_string, "@", "");
-			AddToCFile_Text(f_stream, temp_string, current_indent);
-		}
+	if (global_pooling_fused) AddToCFile_GlobalPoolingSum(f_stream, layer_number, current_indent);
+	else if (MaxPoolingFused(layer_number)) AddToCFile_MaxPoolingOutput(f_stream, layer_number, current_indent);
+	else if (AddFused(layer_number)) {
+		AddToCFile_Text(f_stream, "//Fused with layer " + to_string(layer->fused_add + 1) + " (Add): the output is added to the other operands and written to " + graph.OutputTensor(layer->fused_add).name, current_indent);
+		AddToCFile_MergeOutputDeclaration(f_stream, layer->fused_add, current_indent);
 	}
+	else if (!single_layer) AddToCFile_LayerOutputDeclaration(f_stream, layer_number, current_indent); //Quantized: only the requantized output is stored
 
 	//Note copied from DSE: //Note: Labels in the code MUST not contain "_", as for1_1 is cosidered for1 ...
 
-	string input_name = (layer_number == 0 || single_layer) ? "inputs" : ("l" + to_string(layer_number-1+1));
+	string input_name = (single_layer ? "inputs" : graph.InputTensor(layer_number).name) + (AxiStagedInput(layer_number) ? "_tile" : "") + BatchIndex();
 	string weights_tensor_name = "weights_" +  to_string(layer_number + 1);
 	string biases_tensor_name = "biases_" +  to_string(layer_number + 1);
-	string output_name = (layer_number == layers_size - 1 || single_layer) ? "outputs" : ("l" + to_string(layer_number+1));
+	string output_name = single_layer ? "outputs" : graph.OutputTensor(layer_number).name;
+	string output_store_name = output_name + (AxiStagedOutput(layer_number) ? "_tile" : "");
+	int prefetch_block = WeightPrefetchBlock(layer_number);
+	int units = ParallelUnits(layer_number);
+	int unit_channels = prefetch_block / max(units, 1);
+	string weights_source_name = prefetch_block ? weights_tensor_name + "_tile" : weights_tensor_name;
+	string weights_index_z = prefetch_block ? "[output_z - block * " + to_string(prefetch_block) + "]" : "[output_z]";
 	
-	string output_name_full = output_name + "@[output_x][output_y][output_z]";
-	string output_name_full_q = output_name + "[output_x][output_y][output_z]";
-
-	if (quantized) {
-		output_name_full = StringSubstituteAll(output_name_full, "@", "_base");
-	}
-	else {
-		output_name_full = StringSubstituteAll(output_name_full, "@", "");
-	}
+	string output_name_full = output_store_name + BatchIndex() + "[output_x][output_y][output_z]";
+	string activation_function = ActivationFunctionsToString(layer->activation_function);
 
 	string base_for_label = "for" + to_string(layer_number+1);
 	if (layer_number+1 >= 10) base_for_label += "t";
@@ -1005,15 +1406,9 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 	string row_index, col_index, row_index_def, col_index_def, cond; //Used for valid same
 
 	if(layer->padding_type == PADDING_VALID) {
-		string stride_text = "";
-		if(layer->stride_size != 1) {
-			stride_text = " * " + to_string(layer->stride_size);
-		}
-
-		input_name_full = input_name + "[output_x# + kernel_x][output_y# + kernel_y][input_z]";
-		input_name_full = StringSubstituteAll(input_name_full, "#", stride_text);
+		input_name_full = input_name + "[output_x" + StrideText(layer->stride_size_rows) + " + kernel_x][output_y" + StrideText(layer->stride_size_cols) + " + kernel_y][input_z]";
 
-		weights_tensor_name_full = weights_tensor_name + "[kernel_x][kernel_y][input_z][output_z]";
+		weights_tensor_name_full = weights_source_name + "[kernel_x][kernel_y][input_z]" + weights_index_z;
 		if (!approximate_multipliers)
 			right_side = input_name_full + " * " + weights_tensor_name_full;
 		else
@@ -1022,32 +1417,14 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 	else {
 		ASSERT(layer->padding_type == PADDING_SAME);
 
-		int padding_size_x, padding_size_y;
-		
-		ASSERT((layer->kernel_size_rows - 1) % 2 == 0);
-		ASSERT((layer->kernel_size_cols - 1) % 2 == 0);
-
-		padding_size_x = (layer->kernel_size_rows - 1) / 2;
-		padding_size_y = (layer->kernel_size_cols - 1) / 2;
-
-		string stride_text = "";
-		if (layer->stride_size != 1) {
-			 if ((layer->input_size_x + 2 * padding_size_x - layer->kernel_size_rows) % layer->stride_size != 0)	cout << endl << "****** ATTENTION: unaligned stride X. ******* " << endl;
-			 if ((layer->input_size_y + 2 * padding_size_y - layer->kernel_size_cols) % layer->stride_size != 0)	cout << endl << "****** ATTENTION: unaligned stride Y. ******* " << endl;
-
-			 stride_text = " * " + to_string(layer->stride_size);
-		}
-
-		row_index = "output_x# + kernel_x - " + to_string((layer->kernel_size_rows - 1) / 2);
-		col_index = "output_y# + kernel_y - " + to_string((layer->kernel_size_cols - 1) / 2);
-
-		row_index = StringSubstituteAll(row_index, "#", stride_text);
-		col_index = StringSubstituteAll(col_index, "#", stride_text);
+		//Keras: the padding before the input is the smaller half for even kernels and strides that do not divide the input
+		row_index = "output_x" + StrideText(layer->stride_size_rows) + " + kernel_x - " + to_string(layer->PaddingX());
+		col_index = "output_y" + StrideText(layer->stride_size_cols) + " + kernel_y - " + to_string(layer->PaddingY());
 
 		row_index_def = "int row_index = " + row_index + ";";
 		col_index_def = "int col_index = " + col_index + ";";
 
-		weights_tensor_name_full = weights_tensor_name + "[kernel_x][kernel_y][input_z][output_z]";
+		weights_tensor_name_full = weights_source_name + "[kernel_x][kernel_y][input_z]" + weights_index_z;
 
 		input_name_full = input_name + "[row_index][col_index][input_z]";
 		cond = "if (row_index >= 0 && row_index < " + to_string(layer->input_size_x) + " && col_index >= 0 && col_index < " + to_string(layer->input_size_y) + ")";
@@ -1060,11 +1437,48 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 		right_side_q = "input_zero_points[" + to_string(q_index) + "]" + " * " + weights_tensor_name_full;;
 	}
 
+	//Packed (sub-byte) weights: the weight is extracted from its byte and the multiplication becomes WEIGHT_MUL (sign select for ternary/binary)
+	if (packed_weights) {
+		weights_tensor_name_full = "WEIGHT_UNPACK(" + weights_tensor_name + "[kernel_x][kernel_y][input_z][output_z / WEIGHTS_PER_BYTE], output_z)";
+		right_side = "WEIGHT_MUL(" + input_name_full + ", " + weights_tensor_name_full + ")";
+		right_side_q = "WEIGHT_MUL(input_zero_points[" + to_string(q_index) + "], " + weights_tensor_name_full + ")";
+	}
+
+	//sparse-weights: the iz, kx and ky loops become one loop over the stored blocks of output channel output_z (CSR row, see AddToCFile_SparsifyWeightsFunction).
+	//kernel_x, kernel_y and the first input_z of the block are fields of the block index.
+	bool sparse_layer = SparseDensity(layer_number) != 0;
+	int sparse_block = SparseBlock(layer_number);
+	string sparse_for;
+	if (sparse_layer) {
+		string index = weights_tensor_name + "_index[nz]";
+		int iz_bits = SparseIndexBits(layer->input_size_z), ky_bits = SparseIndexBits(layer->kernel_size_cols);
+		vector<pair<string, string>> fields = {
+			{"kernel_x", "(" + index + " >> " + to_string(ky_bits + iz_bits) + ")"},
+			{"kernel_y", "(" + index + " >> " + to_string(iz_bits) + " & " + to_string((1 << ky_bits) - 1) + ")"},
+			{"input_z", "((" + index + " & " + to_string((1 << iz_bits) - 1) + ")" + (sparse_block > 1 ? " + input_block" : "") + ")"}};
+		for (auto &field : fields) {
+			input_name_full = StringSubstituteAll(input_name_full, field.first, field.second);
+			row_index_def = StringSubstituteAll(row_index_def, field.first, field.second);
+			col_index_def = StringSubstituteAll(col_index_def, field.first, field.second);
+		}
+		weights_tensor_name_full = weights_tensor_name + "_values[nz]" + (sparse_block > 1 ? "[input_block]" : "");
+		if (!approximate_multipliers)
+			right_side = input_name_full + " * " + weights_tensor_name_full;
+		else
+			right_side = "MUL_LAYER_" + to_string(layer_number + 1) + "(" + input_name_full + ", " + weights_tensor_name_full + ")";
+		right_side_q = "input_zero_points[" + to_string(q_index) + "]" + " * " + weights_tensor_name_full;
+		sparse_for = base_for_label + "Nz: for (int nz = " + weights_tensor_name + "_row_ptr[output_z]; nz < " + weights_tensor_name + "_row_ptr[output_z + 1]; nz++)";
+	}
+
 	string loop1, loop2, loop3, loop4, loop5, loop6;
 
 	temp_int = ((string)"oz").size();
 	ASSERT(layer_loop_order.substr(0, temp_int) == "oz"); //Currently, only loop orders starting with oz are supported.
 	loop1 = oz_for;
+	if (prefetch_block) {
+		string first_channel = "block * " + to_string(prefetch_block) + (units > 1 ? " + unit * " + to_string(unit_channels) : "");
+		loop1 = base_for_label + label_oz + ": for (int output_z = " + first_channel + "; output_z < " + first_channel + " + " + to_string(unit_channels) + "; output_z++)";
+	}
 	
 	loop5 = kx_for;
 	loop6 = ky_for;
@@ -1073,8 +1487,6 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 	string temp_element_initializer, temp_element_assignment_to_output;
 	string mac_operation, mac_operation_q;
 
-	string temp_element_assignment_to_output_quantized;
-
 	int output_format = 0;
 
 	//if (layer->padding_type == PADDING_SAME) zero_definition = "const DataType_Zero" + to_string(layer_number + 1) + " Zero = 0;";
@@ -1088,8 +1500,7 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 		loop4 = iz_for; 
 		temp_element_definition = "DataType_temp_element" + to_string(layer_number + 1) + " " + temp_element_name + ";";
 		temp_element_initializer = temp_element_name + " = " +  (biases_enabled?(biases_tensor_name + "[output_z]"):"0") + ";";
-		temp_element_assignment_to_output = output_name_full + " = " + ActivationFunctionsToString(layer->activation_function) + "(" + temp_element_name + ");";
-		if (quantized) temp_element_assignment_to_output_quantized = output_name_full_q + " = DataType_Layer" + to_string(layer_number+1) + "_short(Q_MIN_MAX(" + output_name_full + "*input_scale_factors[" + to_string(q_index) + "]*weight_scales_"+to_string(layer_number+1)+"[output_z]/output_scale_factors["+to_string(q_index)+"] + output_zero_points["+to_string(q_index)+"]));";
+		temp_element_assignment_to_output = output_name_full + " = " + OutputEpilogue(layer_number, activation_function, temp_element_name, "output_z") + ";";
 		mac_operation = temp_element_name + " += " + right_side + ";";
 		mac_operation_q = temp_element_name + " += " + right_side_q + ";";
 		output_format = 1;
@@ -1100,9 +1511,9 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 		loop4 = iz_for; 
 		temp_element_definition = "DataType_temp_element" + to_string(layer_number + 1) + " " + temp_element_name + ";";
 		temp_element_initializer = temp_element_name + " = " +  (biases_enabled?(biases_tensor_name + "[output_z]"):"0") + ";";
-		temp_element_assignment_to_output = output_name_full + " = " + ActivationFunctionsToString(layer->activation_function) + "(" + temp_element_name + ");";
-		if (quantized) temp_element_assignment_to_output_quantized = output_name_full_q + " = DataType_Layer" + to_string(layer_number+1) + "_short(Q_MIN_MAX(" + output_name_full + "*input_scale_factors[" + to_string(q_index) + "]*weight_scales_"+to_string(layer_number+1)+"[output_z]/output_scale_factors["+to_string(q_index)+"] + output_zero_points["+to_string(q_index)+"]));";
+		temp_element_assignment_to_output = output_name_full + " = " + OutputEpilogue(layer_number, activation_function, temp_element_name, "output_z") + ";";
 		mac_operation = temp_element_name + " += " + right_side + ";";
+		mac_operation_q = temp_element_name + " += " + right_side_q + ";";
 		output_format = 1;
 	}
 	else if (layer_loop_order_2_to_4	== "ox-iz-oy" || layer_loop_order_2_to_4	== "oy-iz-ox") { //oz-ox-iz-oy, oz-oy-iz-ox
@@ -1112,7 +1523,7 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 			loop4 = oy_for;
 			temp_element_definition = "DataType_temp_element" + to_string(layer_number + 1) + " " + temp_element_name + "[" + to_string(layer->output_size_y) + "];";
 			temp_element_initializer = base_for_label + "OyI: for(int output_y = 0; output_y < " + to_string(layer->output_size_y) + "; output_y++) " + temp_element_name + "[output_y] = " +  (biases_enabled?(biases_tensor_name + "[output_z]"):"0") + ";";
-			temp_element_assignment_to_output = base_for_label + "OyO: for(int output_y = 0; output_y < " + to_string(layer->output_size_y) + "; output_y++) " + output_name_full + " = " + ActivationFunctionsToString(layer->activation_function) + "(" + temp_element_name + "[output_y]);";
+			temp_element_assignment_to_output = base_for_label + "OyO: for(int output_y = 0; output_y < " + to_string(layer->output_size_y) + "; output_y++) " + output_name_full + " = " + OutputEpilogue(layer_number, activation_function, temp_element_name + "[output_y]", "output_z") + ";";
 			mac_operation = temp_element_name + "[output_y] += " + right_side + ";";
 			output_format = 2;
 		}
@@ -1122,7 +1533,7 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 			loop4 = ox_for;
 			temp_element_definition = "DataType_temp_element" + to_string(layer_number + 1) + " " + temp_element_name + "[" + to_string(layer->output_size_x) + "];";
 			temp_element_initializer = base_for_label + "OxI: for(int output_x = 0; output_x < " + to_string(layer->output_size_x) + "; output_x++) " + temp_element_name + "[output_x] = " +  (biases_enabled?(biases_tensor_name + "[output_z]"):"0") + ";";
-			temp_element_assignment_to_output = base_for_label + "OxO: for(int output_x = 0; output_x < " + to_string(layer->output_size_x) + "; output_x++) " + output_name_full + " = " + ActivationFunctionsToString(layer->activation_function) + "(" + temp_element_name + "[output_x]);";
+			temp_element_assignment_to_output = base_for_label + "OxO: for(int output_x = 0; output_x < " + to_string(layer->output_size_x) + "; output_x++) " + output_name_full + " = " + OutputEpilogue(layer_number, activation_function, temp_element_name + "[output_x]", "output_z") + ";";
 			mac_operation = temp_element_name + "[output_x] += " + right_side + ";";
 			output_format = 2;
 		}
@@ -1131,7 +1542,7 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 		loop2 = iz_for;
 		temp_element_definition = "DataType_temp_element" + to_string(layer_number + 1) + " " + temp_element_name + "[" + to_string(layer->output_size_x) + "][" + to_string(layer->output_size_y) + "];";
 		temp_element_initializer = base_for_label + "OxI: for(int output_x = 0; output_x < " + to_string(layer->output_size_x) + "; output_x++)\n\t" + base_for_label + "OyI: for(int output_y = 0; output_y < " + to_string(layer->output_size_y) + "; output_y++)\n\t\t" + temp_element_name + "[output_x][output_y] = " +  (biases_enabled?(biases_tensor_name + "[output_z]"):"0") + ";";
-		temp_element_assignment_to_output = base_for_label + "OxO: for(int output_x = 0; output_x < " + to_string(layer->output_size_x) + "; output_x++)\n\t" + base_for_label + "OyO: for(int output_y = 0; output_y < " + to_string(layer->output_size_y) + "; output_y++)\n\t\t" + output_name_full + " = " + ActivationFunctionsToString(layer->activation_function) + "(" + temp_element_name + "[output_x][output_y]);";
+		temp_element_assignment_to_output = base_for_label + "OxO: for(int output_x = 0; output_x < " + to_string(layer->output_size_x) + "; output_x++)\n\t" + base_for_label + "OyO: for(int output_y = 0; output_y < " + to_string(layer->output_size_y) + "; output_y++)\n\t\t" + output_name_full + " = " + OutputEpilogue(layer_number, activation_function, temp_element_name + "[output_x][output_y]", "output_z") + ";";
 		mac_operation = temp_element_name + "[output_x][output_y] += " + right_side + ";";
 		output_format = 3;
 
@@ -1148,6 +1559,72 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 		ASSERTA;
 
 	if (quantized) ASSERT(output_format == 1); //only tested in this format
+	if (global_pooling_fused) temp_element_assignment_to_output = StringSubstituteAll(temp_element_assignment_to_output, output_name_full + " = ", GlobalPoolingSumName(layer_number) + " += ");
+	if (AddFused(layer_number) || MaxPoolingFused(layer_number)) {
+		size_t assignment = temp_element_assignment_to_output.find(output_name_full + " = ");
+		size_t value = assignment + output_name_full.size() + 3;
+		size_t end = temp_element_assignment_to_output.rfind(';');
+		string value_text = temp_element_assignment_to_output.substr(value, end - value);
+		temp_element_assignment_to_output = temp_element_assignment_to_output.substr(0, assignment) + (AddFused(layer_number) ? AddFusedAssignment(layer_number, value_text) + ";" : MaxPoolingFusedAssignment(layer_number, value_text));
+	}
+
+	//DSP packing: output channels output_z and output_z + 1 share the input element, so their weights are packed into one multiplication
+	bool dsp_pack_layer = dsp_packing && output_format == 1;
+	if (dsp_pack_layer && layer->output_size_z % 2 != 0) {
+		INFOLOG("DSP packing is skipped for layer " + to_string(layer_number + 1) + " (odd number of filters)");
+		dsp_pack_layer = false;
+	}
+	string temp_element_pair_name = temp_element_name + "_pair";
+	if (dsp_pack_layer) {
+		loop1 = StringSubstituteAll(loop1, "output_z++", "output_z += 2");
+		temp_element_definition = "DataType_temp_element" + to_string(layer_number + 1) + " " + temp_element_name + ", " + temp_element_pair_name + ";";
+		temp_element_initializer += " " + temp_element_pair_name + " = " + (biases_enabled?(biases_tensor_name + "[output_z + 1]"):"0") + ";";
+
+		string weights_tensor_name_full_pair = StringSubstituteAll(weights_tensor_name_full, "[output_z]", "[output_z + 1]");
+		temp_string = "{\n\tDataType_dsp_product packed_product = (DataType_dsp_input)@ * DSP_PACK(" + weights_tensor_name_full_pair + ", " + weights_tensor_name_full + ");\n";
+		temp_string += "\t" + temp_element_name + " += DSP_UNPACK_LOW(packed_product);\n";
+		temp_string += "\t" + temp_element_pair_name + " += DSP_UNPACK_HIGH(packed_product);\n}";
+		mac_operation = FillTemplate(temp_string, {{'@', input_name_full}});
+		mac_operation_q = FillTemplate(temp_string, {{'@', "input_zero_points[" + to_string(q_index) + "]"}});
+	}
+
+	//batch-size: each weight is read once and applied to all images of the batch (innermost batch loop), so temp_element has one entry per image
+	if (batch_size > 1) {
+		string temp_element_batch = temp_element_name + BatchIndex();
+		string batch_loop = BatchLoop(base_for_label + "B");
+		temp_element_definition = "DataType_temp_element" + to_string(layer_number + 1) + " " + temp_element_name + BatchDimension() + ";";
+		temp_element_initializer = BatchLoop(base_for_label + "BI") + " " + StringSubstituteAll(temp_element_initializer, temp_element_name, temp_element_batch);
+		temp_element_assignment_to_output = BatchLoop(base_for_label + "BO") + " " + StringSubstituteAll(temp_element_assignment_to_output, temp_element_name, temp_element_batch);
+
+		temp_string = "{\n\tDataType_weights weight = " + weights_tensor_name_full + ";\n\t" + batch_loop + "\n\t\t@\n}";
+		mac_operation = FillTemplate(temp_string, {{'@', StringSubstituteAll(StringSubstituteAll(mac_operation, temp_element_name, temp_element_batch), weights_tensor_name_full, "weight")}});
+		if (mac_operation_q != "") mac_operation_q = FillTemplate(temp_string, {{'@', StringSubstituteAll(StringSubstituteAll(mac_operation_q, temp_element_name, temp_element_batch), weights_tensor_name_full, "weight")}});
+	}
+
+	//weight-prefetch: the block loop body is a dataflow region with a load and a compute stage. The tile between them is a ping-pong (PIPO) buffer,
+	//so the weights of the next block of output channels are loaded while the current block computes.
+	if (prefetch_block) {
+		string tile_dimensions = "[" + to_string(layer->kernel_size_rows) + "][" + to_string(layer->kernel_size_cols) + "][" + to_string(layer->input_size_z) + "][" + to_string(prefetch_block) + "]";
+		AddToCFile_Text(f_stream, base_for_label + "WB: for (int block = 0; block < " + to_string(layer->output_size_z / prefetch_block) + "; block++)", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, "#pragma HLS DATAFLOW", current_indent);
+		AddToCFile_Text(f_stream, "DataType_weights " + weights_source_name + tile_dimensions + ";", current_indent);
+		if (units > 1) AddToCFile_Text(f_stream, "#pragma HLS ARRAY_PARTITION variable=" + weights_source_name + " dim=4 block factor=" + to_string(units), current_indent);
+		AddToCFile_Text(f_stream, base_for_label + "WLx: for (int kernel_x = 0; kernel_x < " + to_string(layer->kernel_size_rows) + "; kernel_x++)", current_indent++);
+		AddToCFile_Text(f_stream, base_for_label + "WLy: for (int kernel_y = 0; kernel_y < " + to_string(layer->kernel_size_cols) + "; kernel_y++)", current_indent++);
+		AddToCFile_Text(f_stream, base_for_label + "WLz: for (int input_z = 0; input_z < " + to_string(layer->input_size_z) + "; input_z++)", current_indent++);
+		AddToCFile_Text(f_stream, base_for_label + "WLo: for (int output_z = 0; output_z < " + to_string(prefetch_block) + "; output_z++)", current_indent++);
+		AddToCFile_Text(f_stream, weights_source_name + "[kernel_x][kernel_y][input_z][output_z] = " + weights_tensor_name + "[kernel_x][kernel_y][input_z][block * " + to_string(prefetch_block) + " + output_z];", current_indent);
+		current_indent -= 4; //The compute stage is inside the block loop
+		AddToCFile_EmptyLine(f_stream);
+
+		//parallel-units: the unrolled unit loop replicates the compute nest. Each unit reads its own partition of the tile and writes its own output channels.
+		if (units > 1) {
+			AddToCFile_Text(f_stream, base_for_label + "U: for (int unit = 0; unit < " + to_string(units) + "; unit++)", current_indent);
+			AddToCFile_Text(f_stream, "{", current_indent++);
+			AddToCFile_Text(f_stream, "#pragma HLS UNROLL", current_indent);
+		}
+	}
 
 	if (output_format == 1) {
 		AddToCFile_Text(f_stream, loop1, current_indent++);
@@ -1159,9 +1636,24 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 		AddToCFile_Text(f_stream, temp_element_definition, current_indent);
 		if (zero_definition != "") AddToCFile_Text(f_stream, zero_definition, current_indent);
 		AddToCFile_Text(f_stream, temp_element_initializer, current_indent);
-		AddToCFile_Text(f_stream, loop4, current_indent++);
-		AddToCFile_Text(f_stream, loop5, current_indent++);
-		AddToCFile_Text(f_stream, loop6, current_indent);
+		int sparse_indent = current_indent;
+		if (sparse_layer) {
+			//The body is emitted at the indentation of the kx/ky loop bodies, and the indentation is restored after it
+			AddToCFile_Text(f_stream, sparse_for, current_indent);
+			AddToCFile_Text(f_stream, "{", current_indent);
+			AddToCFile_Text(f_stream, "#pragma HLS LOOP_TRIPCOUNT min=0 max=" + to_string(SparseRowBlocks(layer_number)), current_indent + 1);
+			if (sparse_block > 1) {
+				//Blocked CSR: the pipelined iterations all do sparse_block MACs
+				AddToCFile_Text(f_stream, "#pragma HLS PIPELINE", current_indent + 1);
+				AddToCFile_Text(f_stream, base_for_label + "Nb: for (int input_block = 0; input_block < " + to_string(sparse_block) + "; input_block++)", current_indent + 1);
+			}
+			current_indent += (sparse_block > 1 || layer->padding_type == PADDING_SAME) ? 1 : 0;
+		}
+		else {
+			AddToCFile_Text(f_stream, loop4, current_indent++);
+			AddToCFile_Text(f_stream, loop5, current_indent++);
+			AddToCFile_Text(f_stream, loop6, current_indent);
+		}
 		if (store_alanysis_data && layer->padding_type != PADDING_SAME) {
 			AddToCFile_Text(f_stream, "#ifndef _HLS_RUN", current_indent);
 			AddToCFile_Text(f_stream, "{", current_indent);
@@ -1181,12 +1673,11 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 		if (layer->padding_type == PADDING_SAME) { 
 			AddToCFile_Text(f_stream, cond, current_indent++);
 		}
-		mac_operation = StringSubstituteAll(mac_operation, "\n", "\n" + Tabs(current_indent));
-		AddToCFile_Text(f_stream, mac_operation, current_indent);
-		if (layer->padding_type == PADDING_SAME) { 
+		f_stream.Lines(mac_operation, current_indent);
+		if (layer->padding_type == PADDING_SAME && quantized) { //The padding is the input zero point, zero otherwise
 			current_indent--;
 			AddToCFile_Text(f_stream, "else", current_indent++);
-			AddToCFile_Text(f_stream, mac_operation_q, current_indent);
+			f_stream.Lines(mac_operation_q, current_indent);
 		}
 		
 		if (store_alanysis_data) {
@@ -1202,14 +1693,25 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 		if (layer->padding_type == PADDING_SAME && store_alanysis_data) current_indent++;
 		if (layer->padding_type == PADDING_SAME) AddToCFile_Text(f_stream, "}", -- -- current_indent);
 		else current_indent--;
+		if (sparse_layer) {
+			AddToCFile_Text(f_stream, "}", sparse_indent);
+			current_indent = sparse_indent + 2;
+		}
 
 		-- -- current_indent;
 		AddToCFile_Text(f_stream, temp_element_assignment_to_output, current_indent --);
-		if (quantized) {current_indent++; AddToCFile_Text(f_stream, temp_element_assignment_to_output_quantized, current_indent --);}
+		if (dsp_pack_layer) {
+			//Same assignments for the second output channel of the pair
+			current_indent++;
+			temp_string = StringSubstituteAll(temp_element_assignment_to_output, "[output_z]", "[output_z + 1]");
+			AddToCFile_Text(f_stream, StringSubstituteAll(temp_string, temp_element_name + ")", temp_element_pair_name + ")"), current_indent);
+			current_indent--;
+		}
 		if (store_alanysis_data && layer->padding_type == PADDING_SAME) current_indent++;
 		if (store_alanysis_data && layer->padding_type != PADDING_SAME) current_indent++;
-		if (store_alanysis_data && quantized) AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"LayerOutputBase\", (float)" + output_name_full + ", output_x, output_y, output_z);", current_indent);
-		if (store_alanysis_data) AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"LayerOutput\", (float)" + (quantized?output_name_full_q:output_name_full) + ", output_x, output_y, output_z);", current_indent);
+		if (store_alanysis_data && quantized) AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"LayerOutputBase\", (float)" + activation_function + "(" + temp_element_name + "), output_x, output_y, output_z);", current_indent);
+		if (store_alanysis_data) AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"LayerOutput\", (float)" + output_name_full + ", output_x, output_y, output_z);", current_indent);
+		if (store_alanysis_data && dsp_pack_layer) AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"LayerOutput\", (float)" + StringSubstituteAll(output_name_full, "[output_z]", "[output_z + 1]") + ", output_x, output_y, output_z + 1);", current_indent);
 		if (store_alanysis_data && layer->padding_type == PADDING_SAME) current_indent--;
 		if (store_alanysis_data && layer->padding_type != PADDING_SAME) current_indent--;
 		AddToCFile_Text(f_stream, "}", current_indent --);
@@ -1239,8 +1741,7 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 		}
 		else current_indent++;
 
-		mac_operation = StringSubstituteAll(mac_operation, "\n", "\n" + Tabs(current_indent));
-		AddToCFile_Text(f_stream, mac_operation, current_indent);
+		f_stream.Lines(mac_operation, current_indent);
 
 		if (layer->padding_type == PADDING_SAME) AddToCFile_Text(f_stream, "}", -- current_indent);
 		else current_indent--;
@@ -1258,8 +1759,7 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 		AddToCFile_Text(f_stream, temp_element_definition, current_indent);
 		AddToCFile_Text(f_stream, zero_definition, current_indent);
 		AddToCFile_EmptyLine(f_stream);
-		temp_element_initializer = StringSubstituteAll(temp_element_initializer, "\n", "\n" + Tabs(current_indent));
-		AddToCFile_Text(f_stream, temp_element_initializer, current_indent);
+		f_stream.Lines(temp_element_initializer, current_indent);
 		AddToCFile_EmptyLine(f_stream);
 		AddToCFile_Text(f_stream, loop2, current_indent++);
 		AddToCFile_Text(f_stream, loop3, current_indent++);
@@ -1276,8 +1776,7 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 		}
 		else current_indent++;
 
-		mac_operation = StringSubstituteAll(mac_operation, "\n", "\n" + Tabs(current_indent));
-		AddToCFile_Text(f_stream, mac_operation, current_indent);
+		f_stream.Lines(mac_operation, current_indent);
 
 		if (layer->padding_type == PADDING_SAME) AddToCFile_Text(f_stream, "}", -- -- current_indent);
 		else current_indent--;
@@ -1285,153 +1784,484 @@ void AddToCFile_Conv2dLayer(ofstream &f_stream, int layer_number) {
 		-- -- -- -- current_indent;
 
 		AddToCFile_EmptyLine(f_stream);
-		temp_element_assignment_to_output = StringSubstituteAll(temp_element_assignment_to_output, "\n", "\n" + Tabs(current_indent));
-		AddToCFile_Text(f_stream, temp_element_assignment_to_output, current_indent --);
+		f_stream.Lines(temp_element_assignment_to_output, current_indent --);
 		AddToCFile_Text(f_stream, "}", current_indent --);
 	}
+
+	if (units > 1) AddToCFile_Text(f_stream, "}", 2);
+	if (prefetch_block) AddToCFile_Text(f_stream, "}", 1);
 }
 
-void AddToCFile_Pooling2dLayer(ofstream &f_stream, int layer_number) {
-	int current_indent = 1;
-	string temp_string, temp_string2;
+//Layer output of the Conv2D-like layers (DepthwiseConv2D, PointwiseConv2D): the short type in the quantized modes, see AddToCFile_Conv2dLayer.
+//A fused global pooling replaces it with the channel sums, a fused Add with the output of the Add.
+void AddToCFile_ConvOutputDeclaration(CodeEmitter &f_stream, int layer_number, int current_indent) {
+	Layer* layer = Layers[layer_number];
+	if (GlobalPoolingFused(layer_number)) {
+		AddToCFile_GlobalPoolingSum(f_stream, layer_number, current_indent);
+		return;
+	}
+	if (AddFused(layer_number)) {
+		AddToCFile_Text(f_stream, "//Fused with layer " + to_string(layer->fused_add + 1) + " (Add): the output is added to the other operands and written to " + graph.OutputTensor(layer->fused_add).name, current_indent);
+		AddToCFile_MergeOutputDeclaration(f_stream, layer->fused_add, current_indent);
+		return;
+	}
+	if (single_layer) return;
+
+	AddToCFile_LayerOutputDeclaration(f_stream, layer_number, current_indent);
+}
 
+//Activation, requantization and analysis data of the output element [output_x][output_y][output_z]. temp_element: the accumulator of the element (with [batch])
+//A fused global pooling adds the element to the channel sum instead, a fused Add writes the sum with the other operands.
+void AddToCFile_ConvOutputAssignment(CodeEmitter &f_stream, int layer_number, string temp_element, int current_indent) {
 	Layer* layer = Layers[layer_number];
-  int layers_size = Layers.size();
-	bool quantized = data_type_mode_fixed_point_single && (data_type_mode_detail == "eight-bit-int" || data_type_mode_detail == "default_int8_t");
-	bool last_layer = layer_number == layers_size - 1;
+	bool quantized = QuantizedMode();
+	string n = to_string(layer_number + 1);
+	string base_for_label = "for" + n;
+	if (layer_number + 1 >= 10) base_for_label += "t";
+
+	string output_name = single_layer ? "outputs" : graph.OutputTensor(layer_number).name;
+	string output_store_name = output_name + (AxiStagedOutput(layer_number) ? "_tile" : "");
+	string output_name_full = output_store_name + BatchIndex() + "[output_x][output_y][output_z]";
+	string activation_function = ActivationFunctionsToString(layer->activation_function);
 
-	ASSERT(layer->pooling_type == MAX_POOLING);
+	string assignment = output_name_full + " = " + OutputEpilogue(layer_number, activation_function, temp_element, "output_z");
+	if (GlobalPoolingFused(layer_number)) assignment = GlobalPoolingSumName(layer_number) + " += " + activation_function + "(" + temp_element + ")";
+	if (AddFused(layer_number)) assignment = AddFusedAssignment(layer_number, activation_function + "(" + temp_element + ")");
+	AddToCFile_Text(f_stream, (batch_size > 1 ? BatchLoop(base_for_label + "BO") + " " : "") + assignment + ";", current_indent);
+	if (store_alanysis_data && quantized) AddToCFile_Text(f_stream, (string)"STORE_DATA(" + n + ", \"LayerOutputBase\", (float)" + activation_function + "(" + temp_element + "), output_x, output_y, output_z);", current_indent);
+	if (store_alanysis_data) AddToCFile_Text(f_stream, (string)"STORE_DATA(" + n + ", \"LayerOutput\", (float)" + output_name_full + ", output_x, output_y, output_z);", current_indent);
+}
 
+//Output loops of a Conv2D-like layer in the order of the first three loop-order tokens (e.g., oy-oz-ox), then the opening brace of the body
+void AddToCFile_ConvOutputLoops(CodeEmitter &f_stream, int layer_number, string loop_order, int &current_indent) {
+	Layer* layer = Layers[layer_number];
+	string base_for_label = "for" + to_string(layer_number + 1);
+	if (layer_number + 1 >= 10) base_for_label += "t";
+
+	map<string, string> loops;
+	loops["oz"] = base_for_label + (numbered_loop_labels ? "" : "Oz") + ": for (int output_z = 0; output_z < " + to_string(layer->output_size_z) + "; output_z++)";
+	loops["oy"] = base_for_label + (numbered_loop_labels ? "1" : "Oy") + ": for (int output_y = 0; output_y < " + to_string(layer->output_size_y) + "; output_y++)";
+	loops["ox"] = base_for_label + (numbered_loop_labels ? "2" : "Ox") + ": for (int output_x = 0; output_x < " + to_string(layer->output_size_x) + "; output_x++)";
+
+	vector<string> tokens = SplitString(loop_order, "-");
+	for (size_t i = 0; i < tokens.size() && i < 3; i++) { //The inner loops (kx-ky, iz, iz-oz) are emitted by the layer
+		if (loops.count(tokens[i]) == 0) continue;
+		AddToCFile_Text(f_stream, loops[tokens[i]], current_indent++);
+	}
+	current_indent--;
+	AddToCFile_Text(f_stream, "{", current_indent++);
+}
 
-	AddToCFile_Text(f_stream, "//Layer " + to_string(layer_number+1) + ": " +  PoolingTypesToString(layer->pooling_type) + " Pooling", current_indent);
-	AddToCFile_Text(f_stream, "//Input: X:" + to_string(layer->input_size_x) + ", Y: " + to_string(layer->input_size_y) + ", Z: " + to_string(layer->input_size_z), current_indent);
-	AddToCFile_Text(f_stream, "//Output: X:" + to_string(layer->output_size_x) + ", Y: " + to_string(layer->output_size_y) + ", Z: " + to_string(layer->output_size_z), current_indent);
+//DepthwiseConv2D: output channel output_z filters input channel output_z / depth_multiplier only, so there is no input channel (iz) loop.
+//Weights: [kx][ky][iz][multiplier] (Keras layout). The kernel loops are the reduction of a scalar accumulator.
+void AddToCFile_DepthwiseConv2dLayer(CodeEmitter &f_stream, int layer_number) {
+	int current_indent = 1;
 
-	string layer_datatype_suffix = "Layer" + to_string(layer_number + 1);
-	if (quantized && !last_layer) layer_datatype_suffix += "_short";
-	if (layer_number == layers_size - 1) layer_datatype_suffix = "output";
+	Layer* layer = Layers[layer_number];
+	bool quantized = QuantizedMode();
+	bool batched = batch_size > 1;
+	int q_index = layer->q_index;
+	int multiplier = layer->depth_multiplier;
+	string n = to_string(layer_number + 1);
 
-	temp_string = "";
-	if (LayerDataLocation(layer_number + 1) != "local") temp_string = "//"; else temp_string = "";
-	string static_text = ""; //add_main_function?"STATIC ":"";
-	temp_string += static_text + "DataType_" + layer_datatype_suffix + "@ l#[" + to_string(layer->output_size_x) + "]"
-																										 									+ "[" + to_string(layer->output_size_y) + "]"
-																																			+ "[" + to_string(layer->output_size_z) + "];";
-	if (data_type_mode_fixed_point_single && data_type_mode_detail == "eight-bit-int") {
-		temp_string2 = temp_string;
-		temp_string = StringSubstituteAll(temp_string, "#", to_string(layer_number+1) + "_base");
-		temp_string = StringSubstituteAll(temp_string, "@", "");
-		AddToCFile_Text(f_stream, temp_string, current_indent);
-
-		temp_string = temp_string2;
-		temp_string = StringSubstituteAll(temp_string, "#", to_string(layer_number+1));
-		temp_string = StringSubstituteAll(temp_string, "@", "_short");
-		AddToCFile_Text(f_stream, temp_string, current_indent);
+	AddToCFile_Text(f_stream, "//Layer " + n + ": DepthwiseConv2D(Padding: " + PaddingTypesToString(layer->padding_type) + ", Stride: " + StridesToString(layer) + ", Depth multiplier: " + to_string(multiplier) + ")", current_indent);
+	AddToCFile_Text(f_stream, "//Input: X:" + to_string(layer->input_size_x) + ", Y: " + to_string(layer->input_size_y) + ", Z: " + to_string(layer->input_size_z), current_indent);
+	AddToCFile_Text(f_stream, "//Output: X:" + to_string(layer->output_size_x) + ", Y: " + to_string(layer->output_size_y) + ", Z: " + to_string(layer->output_size_z), current_indent);
+	AddToCFile_ConvOutputDeclaration(f_stream, layer_number, current_indent);
+
+	string base_for_label = "for" + n;
+	if (layer_number + 1 >= 10) base_for_label += "t";
+	string input_name = (single_layer ? "inputs" : graph.InputTensor(layer_number).name) + (AxiStagedInput(layer_number) ? "_tile" : "") + BatchIndex();
+	string temp_element_name = "temp_element" + n;
+	string input_z = multiplier == 1 ? "output_z" : "output_z / " + to_string(multiplier);
+	string weight = "weights_" + n + "[kernel_x][kernel_y][" + input_z + "][" + (multiplier == 1 ? "0" : "output_z % " + to_string(multiplier)) + "]";
+	string row_index = "output_x" + StrideText(layer->stride_size_rows) + " + kernel_x";
+	string col_index = "output_y" + StrideText(layer->stride_size_cols) + " + kernel_y";
+	bool same_padding = layer->padding_type == PADDING_SAME;
+	if (layer->PaddingX()) row_index += " - " + to_string(layer->PaddingX());
+	if (layer->PaddingY()) col_index += " - " + to_string(layer->PaddingY());
+	string input_element = input_name + (same_padding ? "[row_index][col_index][" : "[" + row_index + "][" + col_index + "][") + input_z + "]";
+	string product = approximate_multipliers ? "MUL_LAYER_" + n + "(" + input_element + ", weight)" : input_element + " * weight";
+	string batch_loop = batched ? BatchLoop(base_for_label + "B") + " " : "";
+
+	AddToCFile_ConvOutputLoops(f_stream, layer_number, loop_orders[layer_number], current_indent);
+	if (biases_enabled && store_alanysis_data)
+		AddToCFile_Text(f_stream, (string)"STORE_DATA(" + n + ", \"biases\", (float)biases_" + n + "[output_z], -1, -1, output_z);", current_indent);
+	AddToCFile_Text(f_stream, "DataType_temp_element" + n + " " + temp_element_name + BatchDimension() + ";", current_indent);
+	AddToCFile_Text(f_stream, (batched ? BatchLoop(base_for_label + "BI") + " " : "") + temp_element_name + BatchIndex() + " = " + (biases_enabled ? "biases_" + n + "[output_z]" : "0") + ";", current_indent);
+	AddToCFile_Text(f_stream, base_for_label + (numbered_loop_labels ? "3" : "Kx") + ": for (int kernel_x = 0; kernel_x < " + to_string(layer->kernel_size_rows) + "; kernel_x++)", current_indent++);
+	AddToCFile_Text(f_stream, base_for_label + (numbered_loop_labels ? "4" : "Ky") + ": for (int kernel_y = 0; kernel_y < " + to_string(layer->kernel_size_cols) + "; kernel_y++)", current_indent);
+	AddToCFile_Text(f_stream, "{", current_indent++);
+	AddToCFile_Text(f_stream, "DataType_weights weight = " + weight + ";", current_indent); //Read once for all the images of a batch
+	if (same_padding) {
+		AddToCFile_Text(f_stream, "int row_index = " + row_index + ";", current_indent);
+		AddToCFile_Text(f_stream, "int col_index = " + col_index + ";", current_indent);
+		AddToCFile_Text(f_stream, "if (row_index >= 0 && row_index < " + to_string(layer->input_size_x) + " && col_index >= 0 && col_index < " + to_string(layer->input_size_y) + ")", current_indent);
+		AddToCFile_Text(f_stream, batch_loop + temp_element_name + BatchIndex() + " += " + product + ";", current_indent + 1);
+		if (quantized) {
+			AddToCFile_Text(f_stream, "else", current_indent);
+			AddToCFile_Text(f_stream, batch_loop + temp_element_name + BatchIndex() + " += input_zero_points[" + to_string(q_index) + "] * weight;", current_indent + 1);
+		}
 	}
-	else {
-		temp_string = StringSubstituteAll(temp_string, "#", to_string(layer_number+1));
-		temp_string = StringSubstituteAll(temp_string, "@", "");
-		AddToCFile_Text(f_stream, temp_string, current_indent);
+	else AddToCFile_Text(f_stream, batch_loop + temp_element_name + BatchIndex() + " += " + product + ";", current_indent);
+	if (store_alanysis_data) {
+		AddToCFile_Text(f_stream, "#ifndef _HLS_RUN", current_indent);
+		AddToCFile_Text(f_stream, (string)"STORE_DATA(" + n + ", \"weights\", (float)weight, -1, -1, -1);", current_indent);
+		AddToCFile_Text(f_stream, (string)"STORE_DATA(" + n + ", \"temp_element\", (float)" + temp_element_name + ", -1, -1, -1);", current_indent);
+		AddToCFile_Text(f_stream, "#endif", current_indent);
 	}
+	AddToCFile_Text(f_stream, "}", --current_indent);
+	current_indent--;
 
-	ASSERT(layer->input_size_z == layer->output_size_z);
+	AddToCFile_ConvOutputAssignment(f_stream, layer_number, temp_element_name + BatchIndex(), current_indent);
+	AddToCFile_Text(f_stream, "}", --current_indent);
+}
 
-	//Note copied from DSE: //Note: Labels in the code MUST not contain "_", as for1_1 is cosidered for1 ...
+//PointwiseConv2D (the 1x1 convolution of SeparableConv2D): a GEMM of the pixels [x*y][iz] and the weights [iz][oz].
+//oz-oy-ox-iz (and the other orders of the output loops): one scalar accumulator per output element, the iz loop is the reduction.
+//oy-ox-iz-oz, ox-oy-iz-oz: per pixel, one pipelined iteration of the iz loop reads one input element and updates the completely partitioned
+//accumulators of all the output channels (unrolled oz loop), so each input is read once instead of once per output channel.
+void AddToCFile_PointwiseConv2dLayer(CodeEmitter &f_stream, int layer_number) {
+	int current_indent = 1;
 
-	string base_for_label = "for" + to_string(layer_number+1);
-	if (layer_number+1 >= 10) base_for_label += "t";
-	AddToCFile_Text(f_stream, base_for_label + ": for (int output_x = 0; output_x < " + to_string(layer->output_size_x) + "; output_x++)", current_indent++);
-	AddToCFile_Text(f_stream, base_for_label + "1: for (int output_y = 0; output_y < " + to_string(layer->output_size_y) + "; output_y++)", current_indent++);
-	AddToCFile_Text(f_stream, base_for_label + "2: for (int output_z = 0; output_z < " + to_string(layer->input_size_z) + "; output_z++)", current_indent); //I put the output_z after output_x, output_y because z is usually small enough to enable us to use: (#pragma HLS array_partition variable=layer_output complete dim=3)
-																																																																												 //Note that for a pooling layer input_z is equal to output_z
-	AddToCFile_Text(f_stream, "{", current_indent++);
-	
-	string input_name = layer_number == 0 ? "inputs" : ("l" + to_string(layer_number-1+1));
+	Layer* layer = Layers[layer_number];
+	string layer_loop_order = loop_orders[layer_number];
+	bool batched = batch_size > 1;
+	bool gemm_order = layer_loop_order.substr(6) == "iz-oz";
+	string n = to_string(layer_number + 1);
 
-	AddToCFile_Text(f_stream, "DataType_" + layer_datatype_suffix + " current_cell, max_value;", current_indent);
-	AddToCFile_Text(f_stream, "");
-	if (Layers[layer_number - 1]->activation_function == RELU) {//Min value will be zero
-		AddToCFile_Text(f_stream, "max_value = 0;", current_indent);
+	AddToCFile_Text(f_stream, "//Layer " + n + ": PointwiseConv2D", current_indent);
+	AddToCFile_Text(f_stream, "//Input: X:" + to_string(layer->input_size_x) + ", Y: " + to_string(layer->input_size_y) + ", Z: " + to_string(layer->input_size_z), current_indent);
+	AddToCFile_Text(f_stream, "//Output: X:" + to_string(layer->output_size_x) + ", Y: " + to_string(layer->output_size_y) + ", Z: " + to_string(layer->output_size_z), current_indent);
+	AddToCFile_ConvOutputDeclaration(f_stream, layer_number, current_indent);
+
+	string base_for_label = "for" + n;
+	if (layer_number + 1 >= 10) base_for_label += "t";
+	string label_oz = numbered_loop_labels ? "" : "Oz", label_iz = numbered_loop_labels ? "3" : "Iz";
+	Tensor &input = graph.InputTensor(layer_number);
+	string input_name = (single_layer ? "inputs" : input.name) + (AxiStagedInput(layer_number) ? "_tile" : "") + BatchIndex();
+	string temp_element_name = "temp_element" + n;
+	string bias = biases_enabled ? "biases_" + n + "[output_z]" : "0";
+	string iz_for = base_for_label + label_iz + ": for (int input_z = 0; input_z < " + to_string(layer->input_size_z) + "; input_z++)";
+	string oz_for = ": for (int output_z = 0; output_z < " + to_string(layer->output_size_z) + "; output_z++)";
+
+	if (!gemm_order) {
+		string product = input_name + "[output_x][output_y][input_z] * weight";
+		if (approximate_multipliers) product = "MUL_LAYER_" + n + "(" + input_name + "[output_x][output_y][input_z], weight)";
+
+		AddToCFile_ConvOutputLoops(f_stream, layer_number, layer_loop_order, current_indent);
+		if (biases_enabled && store_alanysis_data)
+			AddToCFile_Text(f_stream, (string)"STORE_DATA(" + n + ", \"biases\", (float)biases_" + n + "[output_z], -1, -1, output_z);", current_indent);
+		AddToCFile_Text(f_stream, "DataType_temp_element" + n + " " + temp_element_name + BatchDimension() + ";", current_indent);
+		AddToCFile_Text(f_stream, (batched ? BatchLoop(base_for_label + "BI") + " " : "") + temp_element_name + BatchIndex() + " = " + bias + ";", current_indent);
+		AddToCFile_Text(f_stream, iz_for, current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, "DataType_weights weight = weights_" + n + "[input_z][output_z];", current_indent); //Read once for all the images of a batch
+		AddToCFile_Text(f_stream, (batched ? BatchLoop(base_for_label + "B") + " " : "") + temp_element_name + BatchIndex() + " += " + product + ";", current_indent);
+		if (store_alanysis_data) {
+			AddToCFile_Text(f_stream, "#ifndef _HLS_RUN", current_indent);
+			AddToCFile_Text(f_stream, (string)"STORE_DATA(" + n + ", \"weights\", (float)weight, -1, -1, -1);", current_indent);
+			AddToCFile_Text(f_stream, (string)"STORE_DATA(" + n + ", \"temp_element\", (float)" + temp_element_name + ", -1, -1, -1);", current_indent);
+			AddToCFile_Text(f_stream, "#endif", current_indent);
+		}
+		AddToCFile_Text(f_stream, "}", --current_indent);
+
+		AddToCFile_ConvOutputAssignment(f_stream, layer_number, temp_element_name + BatchIndex(), current_indent);
+		AddToCFile_Text(f_stream, "}", --current_indent);
+		return;
 	}
-	else if (Layers[layer_number - 1]->activation_function == LINEAR && (data_type_mode_detail == "eight-bit-int" || data_type_mode_detail == "default_int8_t")) {
-		AddToCFile_Text(f_stream, "max_value = -128;", current_indent);
+
+	string input_type = AxiStagedInput(layer_number) ? AxiTensorType(input) : "DataType_" + input.data_type_suffix + (QuantizedMode() && input.producer >= 0 ? "_short" : "");
+	string product = approximate_multipliers ? "MUL_LAYER_" + n + "(input, weights_" + n + "[input_z][output_z])" : "input * weights_" + n + "[input_z][output_z]";
+	string temp_element_full = temp_element_name + BatchIndex() + "[output_z]";
+
+	AddToCFile_ConvOutputLoops(f_stream, layer_number, layer_loop_order, current_indent);
+	AddToCFile_Text(f_stream, "DataType_temp_element" + n + " " + temp_element_name + BatchDimension() + "[" + to_string(layer->output_size_z) + "];", current_indent);
+	AddToCFile_Text(f_stream, "#pragma HLS ARRAY_PARTITION variable=" + temp_element_name + " complete dim=" + (batched ? "2" : "1"), current_indent);
+	AddToCFile_Text(f_stream, base_for_label + label_oz + "I" + oz_for, current_indent);
+	AddToCFile_Text(f_stream, (batched ? BatchLoop(base_for_label + "BI") + " " : "") + temp_element_full + " = " + bias + ";", current_indent + 1);
+
+	AddToCFile_Text(f_stream, iz_for, current_indent);
+	if (batched) {
+		//The images of a batch update different accumulators, see AddToCFile_Conv2dLayer
+		AddToCFile_Text(f_stream, BatchLoop(base_for_label + "B"), current_indent + 1);
+		current_indent++;
 	}
-	else
-	{
-		ASSERTA;
-		AddToCFile_Text(f_stream, "max_value = " + input_name + "[output_x * 2 + 0][output_y * 2 + 0][output_z];", current_indent);
+	AddToCFile_Text(f_stream, "{", current_indent++);
+	AddToCFile_Text(f_stream, "#pragma HLS PIPELINE", current_indent);
+	AddToCFile_Text(f_stream, input_type + " input = " + input_name + "[output_x][output_y][input_z];", current_indent);
+	AddToCFile_Text(f_stream, base_for_label + label_oz + oz_for, current_indent);
+	AddToCFile_Text(f_stream, "{", current_indent++);
+	AddToCFile_Text(f_stream, "#pragma HLS UNROLL", current_indent);
+	AddToCFile_Text(f_stream, temp_element_full + " += " + product + ";", current_indent);
+	if (store_alanysis_data) {
+		AddToCFile_Text(f_stream, "#ifndef _HLS_RUN", current_indent);
+		AddToCFile_Text(f_stream, (string)"STORE_DATA(" + n + ", \"weights\", (float)weights_" + n + "[input_z][output_z], -1, -1, -1);", current_indent);
+		AddToCFile_Text(f_stream, (string)"STORE_DATA(" + n + ", \"temp_element\", (float)" + temp_element_full + ", -1, -1, -1);", current_indent);
+		AddToCFile_Text(f_stream, "#endif", current_indent);
 	}
+	AddToCFile_Text(f_stream, "}", --current_indent);
+	AddToCFile_Text(f_stream, "}", --current_indent);
+	if (batched) current_indent--;
 
+	AddToCFile_Text(f_stream, base_for_label + label_oz + "O" + oz_for, current_indent);
+	AddToCFile_Text(f_stream, "{", current_indent++);
+	if (biases_enabled && store_alanysis_data)
+		AddToCFile_Text(f_stream, (string)"STORE_DATA(" + n + ", \"biases\", (float)biases_" + n + "[output_z], -1, -1, output_z);", current_indent);
+	AddToCFile_ConvOutputAssignment(f_stream, layer_number, temp_element_full, current_indent);
+	AddToCFile_Text(f_stream, "}", --current_indent);
+	AddToCFile_Text(f_stream, "}", --current_indent);
+}
 
-	ASSERT(layer->stride_size == layer->kernel_size_rows && layer->stride_size == layer->kernel_size_cols);
+//GlobalAveragePooling2D after a Conv2D-like layer (see FusionPass): the feature map of the layer is not stored, its output write adds each element
+//to the channel sum (l#_sum) and the pooling layer only scales the sums. Quantized outputs are requantized per element, so they are pooled separately.
+bool GlobalPoolingFused(int layer_index) {
+	Layer *layer = Layers[layer_index];
+	if (layer->fused_pooling < 0 || !Layers[layer->fused_pooling]->GlobalPooling()) return false;
+	if (QuantizedMode() || single_layer || store_alanysis_data || fault_simulation) return false;
+	return LayerDataLocation(layer_index + 1) == "local" && !AxiStagedOutput(layer_index);
+}
 
-	AddToCFile_Text(f_stream, base_for_label + "3: for (int kernel_x = 0; kernel_x < " + to_string(layer->kernel_size_rows) + "; kernel_x++)", current_indent++);
-	AddToCFile_Text(f_stream, base_for_label + "4: for (int kernel_y = 0; kernel_y < " + to_string(layer->kernel_size_cols) + "; kernel_y++)", current_indent);
-	AddToCFile_Text(f_stream, "{", current_indent++);
+string GlobalPoolingSumName(int layer_index) {
+	return graph.OutputTensor(Layers[layer_index]->fused_pooling).name + "_sum" + BatchIndex() + "[output_z]";
+}
 
+//Declaration and zeroing of the channel sums of a fused global pooling, emitted in place of the output declaration of the Conv2D-like layer
+void AddToCFile_GlobalPoolingSum(CodeEmitter &f_stream, int layer_number, int current_indent) {
+	Layer* layer = Layers[layer_number];
+	int pooling = layer->fused_pooling;
+	string base_for_label = "for" + to_string(layer_number + 1);
+	if (layer_number + 1 >= 10) base_for_label += "t";
 
-	AddToCFile_Text(f_stream, "current_cell = " + input_name + "[output_x * " + to_string(layer->stride_size) + " + kernel_x][output_y * " + to_string(layer->stride_size) + " + kernel_y][output_z];", current_indent);
-	AddToCFile_Text(f_stream, "if (current_cell >	max_value) max_value = current_cell;", current_indent);
-	AddToCFile_Text(f_stream, "}", --current_indent);
-	--current_indent;
-	string output_name_full = "l" + to_string(layer_number+1) + "@[output_x][output_y][output_z]";
-	if (data_type_mode_fixed_point_single && data_type_mode_detail == "eight-bit-int") {
-		output_name_full = StringSubstituteAll(output_name_full, "@", "_base");
-	}
-	else {
-		output_name_full = StringSubstituteAll(output_name_full, "@", "");
+	AddToCFile_Text(f_stream, "//Fused with layer " + to_string(pooling + 1) + " (global average pooling): the output is summed per channel", current_indent);
+	AddToCFile_Text(f_stream, "DataType_temp_element" + to_string(pooling + 1) + " " + graph.OutputTensor(pooling).name + "_sum" + BatchDimension() + "[" + to_string(layer->output_size_z) + "];", current_indent);
+	AddToCFile_Text(f_stream, base_for_label + "S: for (int output_z = 0; output_z < " + to_string(layer->output_size_z) + "; output_z++) " + (batch_size > 1 ? BatchLoop(base_for_label + "SB") + " " : "") + GlobalPoolingSumName(layer_number) + " = 0;", current_indent);
+}
+
+//MaxPool2D after a Conv2D (see FusionPass): the output write of the Conv2D keeps the maximum of each window in the output of the pooling layer, so the
+//feature map is not stored and the pooling layer has no loops. Only pools with strides = pool size (windows that do not overlap) are fused, the rows and columns
+//after the last window are dropped.
+bool MaxPoolingFused(int layer_index) {
+	Layer *layer = Layers[layer_index];
+	if (layer->layer_type != CONV2D || layer->fused_pooling < 0) return false;
+	int pooling = layer->fused_pooling;
+	if (Layers[pooling]->pooling_type != MAX_POOLING || MaxPoolingInitialValue(layer) == "") return false;
+	if (Layers[pooling]->stride_size_rows != Layers[pooling]->kernel_size_rows || Layers[pooling]->stride_size_cols != Layers[pooling]->kernel_size_cols) return false; //Each output element belongs to one window
+	if (single_layer || store_alanysis_data || fault_simulation || WeightPrefetchBlock(layer_index) != 0) return false; //weight-prefetch, parallel-units: dataflow stages
+	if (pooling == (int)Layers.size() - 1) return false;
+	return LayerDataLocation(layer_index + 1) == "local" && !AxiStagedOutput(layer_index) && LayerDataLocation(pooling + 1) == "local" && !AxiStagedOutput(pooling);
+}
+
+//Declaration and initialization of the output of a fused max pooling, emitted in place of the output declaration of the Conv2D
+void AddToCFile_MaxPoolingOutput(CodeEmitter &f_stream, int layer_number, int current_indent) {
+	Layer* layer = Layers[layer_number];
+	int pooling = layer->fused_pooling;
+	Tensor &output = graph.OutputTensor(pooling);
+	string base_for_label = "for" + to_string(layer_number + 1);
+	if (layer_number + 1 >= 10) base_for_label += "t";
+
+	AddToCFile_Text(f_stream, "//Fused with layer " + to_string(pooling + 1) + " (MAX Pooling): the output is written as the maximum of its window", current_indent);
+	AddToCFile_LayerOutputDeclaration(f_stream, pooling, current_indent);
+	AddToCFile_Text(f_stream, base_for_label + "P: for (int output_x = 0; output_x < " + to_string(output.size_x) + "; output_x++)", current_indent);
+	AddToCFile_Text(f_stream, base_for_label + "P1: for (int output_y = 0; output_y < " + to_string(output.size_y) + "; output_y++)", current_indent + 1);
+	AddToCFile_Text(f_stream, base_for_label + "P2: for (int output_z = 0; output_z < " + to_string(output.size_z) + "; output_z++) " + (batch_size > 1 ? BatchLoop(base_for_label + "PB") + " " : "")
+		+ output.name + BatchIndex() + "[output_x][output_y][output_z] = " + MaxPoolingInitialValue(layer) + ";", current_indent + 2);
+}
+
+//if (value > <output of the pooling>[output_x / rows][output_y / columns][output_z]) <output of the pooling>[...] = value
+string MaxPoolingFusedAssignment(int layer_index, string value) {
+	Layer *layer = Layers[layer_index];
+	Layer *pooling = Layers[layer->fused_pooling];
+	Tensor &output = graph.OutputTensor(pooling->index);
+	int rows = pooling->kernel_size_rows, columns = pooling->kernel_size_cols;
+	string pooled = output.name + BatchIndex() + "[output_x" + (rows != 1 ? " / " + to_string(rows) : "") + "][output_y" + (columns != 1 ? " / " + to_string(columns) : "") + "][output_z]";
+
+	string guard;
+	if (output.size_x * rows != layer->output_size_x) guard = "output_x < " + to_string(output.size_x * rows);
+	if (output.size_y * columns != layer->output_size_y) guard += (guard != "" ? " && " : "") + (string)"output_y < " + to_string(output.size_y * columns);
+	if (guard != "") guard = "if (" + guard + ") ";
+
+	string type = "DataType_" + output.data_type_suffix + (QuantizedMode() ? "_short" : "");
+	return guard + "{ " + type + " output_value = " + value + "; if (output_value > " + pooled + ") " + pooled + " = output_value; }";
+}
+
+//Add after a Conv2D-like layer (see FusionPass): the output write of the layer adds the other operands, which are computed before it, and applies the
+//activation of the Add. Neither the output of the layer nor a separate Add loop exists. Quantized outputs need a common scale, so they are not fused.
+bool AddFused(int layer_index) {
+	Layer *layer = Layers[layer_index];
+	if (layer->fused_add < 0) return false;
+	if (QuantizedMode() || single_layer || store_alanysis_data || fault_simulation) return false;
+	int add = layer->fused_add;
+	bool add_local = add != (int)Layers.size() - 1 && LayerDataLocation(add + 1) == "local";
+	return LayerDataLocation(layer_index + 1) == "local" && (add_local || !axi_interfaces); //axi-interfaces: a port output is written by the burst of a tile
+}
+
+//<output of the Add>[...] = activation(<other operands>[...] + value)
+string AddFusedAssignment(int layer_index, string value) {
+	Layer *add = Layers[Layers[layer_index]->fused_add];
+	string index = BatchIndex() + "[output_x][output_y][output_z]";
+	string sum;
+	for (int input_tensor : add->input_tensors)
+		if (graph.tensors[input_tensor].producer != layer_index) sum += graph.tensors[input_tensor].name + index + " + ";
+	return graph.OutputTensor(add->index).name + index + " = " + ActivationFunctionsToString(add->activation_function) + "(" + sum + value + ")";
+}
+
+//The output of a ReLU, or a Concatenate of ReLU outputs: no negative values
+bool ReluOutput(Layer *layer) {
+	if (layer->layer_type != CONCATENATE) return layer->activation_function == RELU;
+	for (int input_tensor : layer->input_tensors) {
+		int producer = graph.tensors[input_tensor].producer;
+		if (producer < 0 || !ReluOutput(Layers[producer])) return false;
 	}
+	return true;
+}
 
-	AddToCFile_Text(f_stream, output_name_full + " = max_value;", current_indent);
-	if (store_alanysis_data) AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"LayerOutput\", (float)" + "max_value" + ", output_x, output_y, output_z);", current_indent); 
+//Initial maximum of a max pooling window, "" when the minimum of the input is not known
+string MaxPoolingInitialValue(Layer *producer) {
+	if (ReluOutput(producer)) return "0"; //Min value will be zero
+	if (producer->activation_function == LINEAR && QuantizedDetail()) return "-128";
+	return "";
+}
 
-	AddToCFile_Text(f_stream, "}", --current_indent);
+//The sum of the window divided by its size without a division: a shift (rounded) for power of two windows in the quantized (integer) modes,
+//otherwise a multiplication by the constant reciprocal (a 16 fractional bit integer reciprocal in the quantized modes)
+string AveragePoolingScale(int layer_index, string sum) {
+	Layer* layer = Layers[layer_index];
+	int window = layer->kernel_size_rows * layer->kernel_size_cols;
+	int shift = 0;
+	while ((1 << shift) < window) shift++;
+
+	if (QuantizedMode()) {
+		if ((1 << shift) == window) return shift ? "(" + sum + " + " + to_string(window / 2) + ") >> " + to_string(shift) : sum;
+		return "(" + sum + " * " + to_string((int)lround(65536.0 / window)) + " + 32768) >> 16";
+	}
+
+	char reciprocal[32];
+	snprintf(reciprocal, sizeof(reciprocal), "%.9g", 1.0 / window);
+	return sum + " * (DataType_temp_element" + to_string(layer_index + 1) + ")" + reciprocal;
 }
 
-void AddToCFile_FlattenLayer(ofstream &f_stream, int layer_number) {
+//MaxPool2D, AveragePooling2D and GlobalAveragePooling2D (the window is the whole input, [z] output)
+void AddToCFile_Pooling2dLayer(CodeEmitter &f_stream, int layer_number) {
 	int current_indent = 1;
 	string temp_string, temp_string2;
 
 	Layer* layer = Layers[layer_number];
   int layers_size = Layers.size();
-	bool quantized = data_type_mode_fixed_point_single && (data_type_mode_detail == "eight-bit-int" || data_type_mode_detail == "default_int8_t");
+	bool quantized = QuantizedMode();
 	bool last_layer = layer_number == layers_size - 1;
+	bool average = layer->AveragePooling();
+	bool global = layer->GlobalPooling();
+	string n = to_string(layer_number + 1);
 
-	AddToCFile_Text(f_stream, "//Layer " + to_string(layer_number+1) + ": Flatten", current_indent);
+	AddToCFile_Text(f_stream, "//Layer " + to_string(layer_number+1) + ": " +  PoolingTypesToString(layer->pooling_type) + " Pooling", current_indent);
 	AddToCFile_Text(f_stream, "//Input: X:" + to_string(layer->input_size_x) + ", Y: " + to_string(layer->input_size_y) + ", Z: " + to_string(layer->input_size_z), current_indent);
 	AddToCFile_Text(f_stream, "//Output: X:" + to_string(layer->output_size_x) + ", Y: " + to_string(layer->output_size_y) + ", Z: " + to_string(layer->output_size_z), current_indent);
+	if (layer->fused_into >= 0 && MaxPoolingFused(layer->fused_into)) {
+		AddToCFile_Text(f_stream, "//Computed by layer " + to_string(layer->fused_into + 1) + " (fused with its output write)", current_indent);
+		return;
+	}
 
-	string layer_datatype_suffix = "Layer" + to_string(layer_number + 1);
+	string layer_datatype_suffix = graph.OutputTensor(layer_number).data_type_suffix;
 	if (quantized && !last_layer) layer_datatype_suffix += "_short";
-	if (layer_number == layers_size - 1) layer_datatype_suffix = "output";
 
-	temp_string = "";
-	if (LayerDataLocation(layer_number + 1) != "local") temp_string = "//"; else temp_string = "";
-	string static_text = ""; //add_main_function?"STATIC ":"";
-
-	temp_string += static_text + "DataType_" + layer_datatype_suffix + "@ l#[" + to_string(layer->output_size_x) + "];";
-	if (data_type_mode_fixed_point_single && data_type_mode_detail == "eight-bit-int") {
-		temp_string2 = temp_string;
-		temp_string = StringSubstituteAll(temp_string, "#", to_string(layer_number+1) + "_base");
-		temp_string = StringSubstituteAll(temp_string, "@", "");
-		AddToCFile_Text(f_stream, temp_string, current_indent);
+	if (!last_layer) AddToCFile_LayerOutputDeclaration(f_stream, layer_number, current_indent);
 
-		temp_string = temp_string2;
-		temp_string = StringSubstituteAll(temp_string, "#", to_string(layer_number+1));
-		temp_string = StringSubstituteAll(temp_string, "@", "_short");
-		AddToCFile_Text(f_stream, temp_string, current_indent);
+	ASSERT(layer->input_size_z == layer->filters_count);
+
+	//Note copied from DSE: //Note: Labels in the code MUST not contain "_", as for1_1 is cosidered for1 ...
+
+	string base_for_label = "for" + to_string(layer_number+1);
+	if (layer_number+1 >= 10) base_for_label += "t";
+	string output_index = global ? "[output_z]" : "[output_x][output_y][output_z]";
+	string output_name_full = "l" + to_string(layer_number+1) + BatchIndex() + output_index;
+
+	if (batch_size > 1) AddToCFile_Text(f_stream, BatchLoop(base_for_label + "B"), current_indent++); //No weights: the batch loop is the outermost loop
+
+	if (layer->fused_into >= 0 && GlobalPoolingFused(layer->fused_into)) {
+		//The sums are computed by the output write of the previous layer
+		string sum = GlobalPoolingSumName(layer->fused_into);
+		AddToCFile_Text(f_stream, base_for_label + "2: for (int output_z = 0; output_z < " + to_string(layer->input_size_z) + "; output_z++)", current_indent);
+		AddToCFile_Text(f_stream, output_name_full + " = " + AveragePoolingScale(layer_number, sum) + ";", current_indent + 1);
+		return;
+	}
+
+	if (!global) {
+		AddToCFile_Text(f_stream, base_for_label + ": for (int output_x = 0; output_x < " + to_string(layer->output_size_x) + "; output_x++)", current_indent++);
+		AddToCFile_Text(f_stream, base_for_label + "1: for (int output_y = 0; output_y < " + to_string(layer->output_size_y) + "; output_y++)", current_indent++);
+	}
+	AddToCFile_Text(f_stream, base_for_label + "2: for (int output_z = 0; output_z < " + to_string(layer->input_size_z) + "; output_z++)", current_indent); //I put the output_z after output_x, output_y because z is usually small enough to enable us to use: (#pragma HLS array_partition variable=layer_output complete dim=3)
+																																																																												 //Note that for a pooling layer input_z is equal to output_z
+	AddToCFile_Text(f_stream, "{", current_indent++);
+	
+	string input_name = graph.InputTensor(layer_number).name + (AxiStagedInput(layer_number) ? "_tile" : "") + BatchIndex();
+	Layer* producer = graph.Producer(layer_number);
+	string input_name_full = input_name + "[output_x * " + to_string(layer->stride_size_rows) + " + kernel_x][output_y * " + to_string(layer->stride_size_cols) + " + kernel_y][output_z]";
+	if (global) input_name_full = input_name + "[kernel_x][kernel_y][output_z]";
+
+	string result;
+	if (average) {
+		string temp_element_name = "temp_element" + n;
+		AddToCFile_Text(f_stream, "DataType_temp_element" + n + " " + temp_element_name + " = 0;", current_indent);
+		AddToCFile_Text(f_stream, base_for_label + "3: for (int kernel_x = 0; kernel_x < " + to_string(layer->kernel_size_rows) + "; kernel_x++)", current_indent++);
+		AddToCFile_Text(f_stream, base_for_label + "4: for (int kernel_y = 0; kernel_y < " + to_string(layer->kernel_size_cols) + "; kernel_y++)", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, temp_element_name + " += " + input_name_full + ";", current_indent);
+		if (store_alanysis_data) AddToCFile_Text(f_stream, (string)"STORE_DATA(" + n + ", \"temp_element\", (float)" + temp_element_name + ", -1, -1, -1);", current_indent);
+		result = AveragePoolingScale(layer_number, temp_element_name);
 	}
 	else {
-		temp_string = StringSubstituteAll(temp_string, "#", to_string(layer_number+1));
-		temp_string = StringSubstituteAll(temp_string, "@", "");
-		AddToCFile_Text(f_stream, temp_string, current_indent);
+		ASSERT(layer->pooling_type == MAX_POOLING);
+		AddToCFile_Text(f_stream, "DataType_" + layer_datatype_suffix + " current_cell, max_value;", current_indent);
+		AddToCFile_Text(f_stream, "");
+		if (MaxPoolingInitialValue(producer) != "") {
+			AddToCFile_Text(f_stream, "max_value = " + MaxPoolingInitialValue(producer) + ";", current_indent);
+		}
+		else
+		{
+			ASSERTA;
+			AddToCFile_Text(f_stream, "max_value = " + input_name + "[output_x * 2 + 0][output_y * 2 + 0][output_z];", current_indent);
+		}
+
+		AddToCFile_Text(f_stream, base_for_label + "3: for (int kernel_x = 0; kernel_x < " + to_string(layer->kernel_size_rows) + "; kernel_x++)", current_indent++);
+		AddToCFile_Text(f_stream, base_for_label + "4: for (int kernel_y = 0; kernel_y < " + to_string(layer->kernel_size_cols) + "; kernel_y++)", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+
+
+		AddToCFile_Text(f_stream, "current_cell = " + input_name_full + ";", current_indent);
+		AddToCFile_Text(f_stream, "if (current_cell >	max_value) max_value = current_cell;", current_indent);
+		result = "max_value";
 	}
+	AddToCFile_Text(f_stream, "}", --current_indent);
+	--current_indent;
+
+	AddToCFile_Text(f_stream, output_name_full + " = " + result + ";", current_indent);
+	if (store_alanysis_data) AddToCFile_Text(f_stream, (string)"STORE_DATA(" + n + ", \"LayerOutput\", (float)" + (average ? output_name_full : result) + (global ? ", 0, 0, output_z);" : ", output_x, output_y, output_z);"), current_indent);
+
+	AddToCFile_Text(f_stream, "}", --current_indent);
+}
+
+void AddToCFile_FlattenLayer(CodeEmitter &f_stream, int layer_number) {
+	int current_indent = 1;
+
+	Layer* layer = Layers[layer_number];
+  int layers_size = Layers.size();
+	bool last_layer = layer_number == layers_size - 1;
+
+	AddToCFile_Text(f_stream, "//Layer " + to_string(layer_number+1) + ": Flatten", current_indent);
+	AddToCFile_Text(f_stream, "//Input: X:" + to_string(layer->input_size_x) + ", Y: " + to_string(layer->input_size_y) + ", Z: " + to_string(layer->input_size_z), current_indent);
+	AddToCFile_Text(f_stream, "//Output: X:" + to_string(layer->output_size_x) + ", Y: " + to_string(layer->output_size_y) + ", Z: " + to_string(layer->output_size_z), current_indent);
 
 	ASSERT(layer->output_size_y == 1 && layer->output_size_z == 1);
+	if (FlattenView(layer_number)) {
+		AddToCFile_Text(f_stream, "//View of " + graph.InputTensor(layer_number).name + ": layer " + to_string(graph.Consumer(layer_number)->index + 1) + " reads its elements in the flattened order (no copy)", current_indent);
+		return;
+	}
+	if (!last_layer) AddToCFile_LayerOutputDeclaration(f_stream, layer_number, current_indent);
 
 	//Note copied from DSE: //Note: Labels in the code MUST not contain "_", as for1_1 is cosidered for1 ...
 
-	string input_name = layer_number == 0 ? "inputs" : ("l" + to_string(layer_number-1+1) + "");
+	string input_name = graph.InputTensor(layer_number).name + (AxiStagedInput(layer_number) ? "_tile" : "") + BatchIndex();
 	string base_for_label = "for" + to_string(layer_number+1);
 	if (layer_number+1 >= 10) base_for_label += "t";
 
@@ -1439,6 +2269,7 @@ void AddToCFile_FlattenLayer(ofstream &f_stream, int layer_number) {
 	if (numbered_loop_labels) {label_ix = "";	label_iy = "1";	label_iz = "2";}
 	else											{label_ix = "Ix";	label_iy = "Iy";	label_iz = "Iz";}
 
+	if (batch_size > 1) AddToCFile_Text(f_stream, BatchLoop(base_for_label + "B"), current_indent++);
 	AddToCFile_Text(f_stream, base_for_label + label_ix + ": for (int input_x = 0; input_x < " + to_string(layer->input_size_x) + "; input_x++)", current_indent++);
 	AddToCFile_Text(f_stream, base_for_label + label_iy + ": for (int input_y = 0; input_y < " + to_string(layer->input_size_y) + "; input_y++)", current_indent++);
 	AddToCFile_Text(f_stream, base_for_label + label_iz + ": for (int input_z = 0; input_z < " + to_string(layer->input_size_z) + "; input_z++)", current_indent);
@@ -1450,14 +2281,7 @@ void AddToCFile_FlattenLayer(ofstream &f_stream, int layer_number) {
 	current_indent++;
 
 	string flatten_formula = "input_x * " + to_string(layer->input_size_y) + " * " + to_string(layer->input_size_z) + " + input_y * " + to_string(layer->input_size_z) + " + input_z";
-	string output_name_full = "l" + to_string(layer_number + 1)
-		+ "@[" + flatten_formula + "]";
-	if (data_type_mode_fixed_point_single && data_type_mode_detail == "eight-bit-int") {
-		output_name_full = StringSubstituteAll(output_name_full, "@", "_base");
-	}
-	else {
-		output_name_full = StringSubstituteAll(output_name_full, "@", "");
-	}
+	string output_name_full = "l" + to_string(layer_number + 1) + BatchIndex() + "[" + flatten_formula + "]";
 
 	AddToCFile_Text(f_stream, output_name_full + " = " + input_name + "[input_x][input_y][input_z];", current_indent);
 	
@@ -1469,66 +2293,135 @@ void AddToCFile_FlattenLayer(ofstream &f_stream, int layer_number) {
 	}
 }
 
-void AddToCFile_DenseLayer(ofstream &f_stream, int layer_number) {
+//Flatten as a view of its input (see FusionPass): the Dense layer after it indexes the [x][y][z] input with the flattened index, so there is no copy.
+//Kept as a copy when an option reads the output of the Flatten, when the tensors are not local and in fixed-point-multi, where the copy converts
+//the elements to the type of the Flatten.
+bool FlattenView(int layer_index) {
+	if (Layers[layer_index]->layer_type != FLATTEN || graph.OutputTensor(layer_index).alias_of < 0) return false;
+	if (single_layer || store_alanysis_data || fault_simulation || data_type_mode_fixed_point_multi) return false;
+	return LayerDataLocation(layer_index) == "local" && LayerDataLocation(layer_index + 1) == "local";
+}
+
+//The input of a Dense layer, or the input of the Flatten view before it
+Tensor& DenseInputTensor(int layer_index) {
+	Tensor &input = graph.InputTensor(layer_index);
+	if (input.producer >= 0 && FlattenView(input.producer)) return graph.tensors[input.alias_of];
+	return input;
+}
+
+//[index] of the input vector of a Dense layer, or [x][y][z] of the element index in the input of a Flatten view
+string DenseInputIndex(int layer_index, string index) {
+	Tensor &input = DenseInputTensor(layer_index);
+	if (input.layout == LAYOUT_X) return "[" + index + "]";
+	if (index.find(' ') != string::npos) index = "(" + index + ")";
+	return "[" + index + " / " + to_string(input.size_y * input.size_z) + "][" + index + " / " + to_string(input.size_z) + " % " + to_string(input.size_y) + "][" + index + " % " + to_string(input.size_z) + "]";
+}
+
+//Output of an Add or Concatenate layer, also declared by the Conv2D-like layer that writes a fused Add
+void AddToCFile_MergeOutputDeclaration(CodeEmitter &f_stream, int layer_number, int current_indent) {
+	if (layer_number == (int)Layers.size() - 1) return; //outputs: an argument of forward
+	AddToCFile_LayerOutputDeclaration(f_stream, layer_number, current_indent);
+}
+
+//Add and Concatenate of a functional model. Add: the activation of the element-wise sum, only a comment when a Conv2D-like producer writes the sum
+//(see AddFused). Concatenate: the inputs are copied one after the other along the channels (vectors: along x).
+void AddToCFile_MergeLayer(CodeEmitter &f_stream, int layer_number) {
+	int current_indent = 1;
+
+	Layer* layer = Layers[layer_number];
+	Tensor &output = graph.OutputTensor(layer_number);
+	bool add = layer->layer_type == ADD;
+	bool vector_layout = output.layout == LAYOUT_X;
+	string n = to_string(layer_number + 1);
+	string base_for_label = "for" + n;
+	if (layer_number + 1 >= 10) base_for_label += "t";
+
+	string input_names;
+	for (int input_tensor : layer->input_tensors) input_names += (input_names.empty() ? "" : ", ") + graph.tensors[input_tensor].name;
+	AddToCFile_Text(f_stream, "//Layer " + n + ": " + LayerTypesToString(layer->layer_type) + "(" + input_names + ")", current_indent);
+	AddToCFile_Text(f_stream, "//Output: X:" + to_string(layer->output_size_x) + ", Y: " + to_string(layer->output_size_y) + ", Z: " + to_string(layer->output_size_z), current_indent);
+	if (layer->fused_into >= 0 && AddFused(layer->fused_into)) {
+		AddToCFile_Text(f_stream, "//Computed by layer " + to_string(layer->fused_into + 1) + " (fused with its output write)", current_indent);
+		return;
+	}
+	AddToCFile_MergeOutputDeclaration(f_stream, layer_number, current_indent);
+
+	string label_ox, label_oy, label_oz;
+	if (numbered_loop_labels) {label_ox = "";		label_oy = "1";		label_oz = "2";}
+	else											{label_ox = "Ox";	label_oy = "Oy";	label_oz = "Oz";}
+
+	//Add: one loop nest over the output. Concatenate: one loop nest per input, written at the offset of its channels.
+	string index = vector_layout ? "[output_x]" : "[output_x][output_y][output_z]";
+	int offset = 0;
+	for (size_t k = 0; k < (add ? 1 : layer->input_tensors.size()); k++) {
+		Tensor &source = add ? output : graph.tensors[layer->input_tensors[k]];
+		string label = base_for_label + (add ? "" : "C" + to_string(k));
+		string offset_text = offset ? to_string(offset) + " + " : "";
+		string output_index = vector_layout ? "[" + offset_text + "output_x]" : "[output_x][output_y][" + offset_text + "output_z]";
+
+		string value;
+		if (add) {
+			for (int input_tensor : layer->input_tensors) value += (value.empty() ? "" : " + ") + graph.tensors[input_tensor].name + BatchIndex() + index;
+			value = ActivationFunctionsToString(layer->activation_function) + "(" + value + ")";
+		}
+		else value = source.name + BatchIndex() + index;
+
+		if (batch_size > 1) AddToCFile_Text(f_stream, BatchLoop(label + "B"), current_indent++);
+		vector<string> loop_tokens = vector_layout ? vector<string>{"ox"} : SplitString(loop_orders[layer_number], "-");
+		for (string &token : loop_tokens) {
+			if (token == "ox") AddToCFile_Text(f_stream, label + label_ox + ": for (int output_x = 0; output_x < " + to_string(source.size_x) + "; output_x++)", current_indent++);
+			else if (token == "oy") AddToCFile_Text(f_stream, label + label_oy + ": for (int output_y = 0; output_y < " + to_string(source.size_y) + "; output_y++)", current_indent++);
+			else AddToCFile_Text(f_stream, label + label_oz + ": for (int output_z = 0; output_z < " + to_string(source.size_z) + "; output_z++)", current_indent++);
+		}
+		AddToCFile_Text(f_stream, "{", current_indent - 1);
+		string output_name_full = output.name + BatchIndex() + output_index;
+		AddToCFile_Text(f_stream, output_name_full + " = " + value + ";", current_indent);
+		if (store_alanysis_data) {
+			string coordinates = vector_layout ? offset_text + "output_x, -1, -1" : "output_x, output_y, " + offset_text + "output_z";
+			AddToCFile_Text(f_stream, (string)"STORE_DATA(" + n + ", \"LayerOutput\", (float)" + output_name_full + ", " + coordinates + ");", current_indent);
+		}
+		AddToCFile_Text(f_stream, "}", current_indent - 1);
+		current_indent -= loop_tokens.size() + (batch_size > 1 ? 1 : 0);
+		if (k + 1 < layer->input_tensors.size() && !add) AddToCFile_EmptyLine(f_stream);
+
+		offset += vector_layout ? source.size_x : source.size_z;
+	}
+}
+
+void AddToCFile_DenseLayer(CodeEmitter &f_stream, int layer_number) {
 	int current_indent = 1;
 	string temp_string, temp_string2;
 
 	Layer* layer = Layers[layer_number];
   int layers_size = Layers.size();
-	bool quantized = data_type_mode_fixed_point_single && (data_type_mode_detail == "eight-bit-int" || data_type_mode_detail == "default_int8_t");
+	bool quantized = QuantizedMode();
+	bool packed_weights = quantized && PackedWeightBits() != 0;
 	bool last_layer = layer_number == layers_size - 1;
 
-	int q_index = -1;
-	for (int i = 0; i <= layer_number; ++i) 
-		if (Layers[i]->layer_type == CONV2D || Layers[i]->layer_type == DENSE) q_index++;
-
 	if (quantized) ASSERT(!single_layer); //Not tested yet
 
-	if (layer_number == 0) {
+	Layer* producer = graph.Producer(layer_number);
+	if (producer == nullptr) {
 		ASSERT(layer->input_size_y == 0 && layer->input_size_z == 0); //For MLPs with no conv layer
 	}
 	else 
-		ASSERT(Layers[layer_number - 1]->layer_type == FLATTEN || Layers[layer_number - 1]->layer_type == DENSE);
+		ASSERT(producer->VectorOutput());
 
 	AddToCFile_Text(f_stream, "//Layer " + to_string(layer_number+1) + ": Dense(Fully connected)", current_indent);
 	AddToCFile_Text(f_stream, "//Input: X:" + to_string(layer->input_size_x) + ", Y: " + to_string(layer->input_size_y) + ", Z: " + to_string(layer->input_size_z), current_indent);
 	AddToCFile_Text(f_stream, "//Output: X:" + to_string(layer->output_size_x) + ", Y: " + to_string(layer->output_size_y) + ", Z: " + to_string(layer->output_size_z), current_indent);
 
-	if(!last_layer)	{
-		string layer_datatype_suffix = "Layer" + to_string(layer_number + 1);
-		if (LayerDataLocation(layer_number + 1) != "local") temp_string = "//"; else temp_string = "";
-		string static_text = ""; //add_main_function?"STATIC ":"";
-		
-		temp_string += static_text + "DataType_" + layer_datatype_suffix + "@ l#[" + to_string(layer->output_size_x) + "];";
-		if (quantized) {
-			temp_string2 = temp_string;
-			temp_string = StringSubstituteAll(temp_string, "#", to_string(layer_number+1) + "_base");
-			temp_string = StringSubstituteAll(temp_string, "@", "");
-			AddToCFile_Text(f_stream, temp_string, current_indent);
-
-			temp_string = temp_string2;
-			temp_string = StringSubstituteAll(temp_string, "#", to_string(layer_number+1));
-			temp_string = StringSubstituteAll(temp_string, "@", "_short");
-			AddToCFile_Text(f_stream, temp_string, current_indent);
-		}
-		else {
-			temp_string = StringSubstituteAll(temp_string, "#", to_string(layer_number+1));
-			temp_string = StringSubstituteAll(temp_string, "@", "");
-			AddToCFile_Text(f_stream, temp_string, current_indent);
-		}
-	}
-	else {
-		if (quantized) {
-			temp_string = "DataType_output outputs_base[" + to_string(layer->output_size_x) + "];";
-			AddToCFile_Text(f_stream, temp_string, current_indent);
-		}
+	if (!last_layer) AddToCFile_LayerOutputDeclaration(f_stream, layer_number, current_indent);
+	else if (output_top_k) {
+		AddToCFile_Text(f_stream, "//output-mode: outputs are the indices of the " + to_string(output_top_k) + " largest output nodes, largest first", current_indent);
+		AddToCFile_Text(f_stream, "DataType_output" + string(quantized ? "_short" : "") + " top_values" + BatchDimension() + "[" + to_string(output_top_k) + "];", current_indent);
 	}
 
 	ASSERT(layer->output_size_y == 1 && layer->output_size_z == 1);
 
 	//Note copied from DSE: //Note: Labels in the code MUST not contain "_", as for1_1 is cosidered for1 ...
 
-	string input_name = layer_number == 0 ? "inputs" : ("l" + to_string(layer_number-1+1));
+	string input_name = DenseInputTensor(layer_number).name + (AxiStagedInput(layer_number) ? "_tile" : "") + BatchIndex();
 	string weights_tensor_name = "weights_" +  to_string(layer_number + 1);
 	string biases_tensor_name = "biases_" +  to_string(layer_number + 1);
 	string base_for_label = "for" + to_string(layer_number+1);
@@ -1542,108 +2435,353 @@ void AddToCFile_DenseLayer(ofstream &f_stream, int layer_number) {
 
 
 	string temp_element_name = "temp_element" + to_string(layer_number + 1);
+	string temp_element_pair_name = temp_element_name + "_pair";
 
-	AddToCFile_Text(f_stream, base_for_label + label_ox + ": for (int output_x = 0; output_x < " + to_string(layer->output_size_x) + "; output_x++)", current_indent);
-	AddToCFile_Text(f_stream, "{", current_indent++);
-	AddToCFile_Text(f_stream, "DataType_temp_element" + to_string(layer_number + 1) + " " + temp_element_name + ";", current_indent); 
-	if (biases_enabled) 
-		AddToCFile_Text(f_stream, temp_element_name + " = " + biases_tensor_name + "[output_x];", current_indent);
-	else
-		AddToCFile_Text(f_stream, temp_element_name + " = 0;", current_indent);
-
-	if (biases_enabled && store_alanysis_data) 
-		AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"biases\", (float)" + biases_tensor_name + "[output_x], output_x, -1, -1);", current_indent); 
-
-	AddToCFile_Text(f_stream, base_for_label + label_ix + ": for (int input_x = 0; input_x < " + to_string(layer->input_size_x) + "; input_x++)", current_indent);
-	if (store_alanysis_data) {
-		AddToCFile_Text(f_stream, "#ifndef _HLS_RUN", current_indent);
-		AddToCFile_Text(f_stream, "{", current_indent);
-		AddToCFile_Text(f_stream, "#endif", current_indent);
+	//DSP packing: output_x and output_x + 1 share the input element, so their weights are packed into one multiplication
+	bool dsp_pack_layer = dsp_packing;
+	if (dsp_pack_layer && layer->output_size_x % 2 != 0) {
+		INFOLOG("DSP packing is skipped for layer " + to_string(layer_number + 1) + " (odd number of nodes)");
+		dsp_pack_layer = false;
 	}
-	current_indent++;
-	
-	string weights_tensor_name_full = weights_tensor_name + "[input_x][output_x]";
 
+	string temp_element = temp_element_name + BatchIndex();
+	bool systolic = SystolicRows(layer_number) != 0;
+	bool input_reuse = DenseOxBlock(layer_number) != 0;
+	if (systolic) AddToCFile_DenseSystolicArray(f_stream, layer_number, current_indent); //Opens the loop over the output nodes of the array, as the output_x loop below
+	else if (input_reuse) AddToCFile_DenseInputReuse(f_stream, layer_number, current_indent); //Same as the systolic array
+	else {
+		AddToCFile_Text(f_stream, base_for_label + label_ox + ": for (int output_x = 0; output_x < " + to_string(layer->output_size_x) + "; output_x" + (dsp_pack_layer?" += 2":"++") + ")", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		//batch-size: one temp_element per image, see AddToCFile_Conv2dLayer
+		string batch_initializer = batch_size > 1 ? BatchLoop(base_for_label + "BI") + " " : "";
+		AddToCFile_Text(f_stream, "DataType_temp_element" + to_string(layer_number + 1) + " " + temp_element_name + BatchDimension() + (dsp_pack_layer?", " + temp_element_pair_name:"") + ";", current_indent); 
+		if (biases_enabled) 
+			AddToCFile_Text(f_stream, batch_initializer + temp_element + " = " + biases_tensor_name + "[output_x];", current_indent);
+		else
+			AddToCFile_Text(f_stream, batch_initializer + temp_element + " = 0;", current_indent);
+		if (dsp_pack_layer) AddToCFile_Text(f_stream, temp_element_pair_name + " = " + (biases_enabled?(biases_tensor_name + "[output_x + 1]"):"0") + ";", current_indent);
+
+		if (biases_enabled && store_alanysis_data) 
+			AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"biases\", (float)" + biases_tensor_name + "[output_x], output_x, -1, -1);", current_indent); 
+
+		//sparse-weights: the input_x loop becomes a loop over the stored blocks of output node output_x (CSR row, see AddToCFile_SparsifyWeightsFunction)
+		bool sparse_layer = SparseDensity(layer_number) != 0;
+		int sparse_block = SparseBlock(layer_number);
+		int sparse_indent = current_indent;
+		bool body_braces = !sparse_layer || sparse_block > 1; //Otherwise the sparse loop braces are used
+		if (sparse_layer) {
+			AddToCFile_Text(f_stream, base_for_label + "Nz: for (int nz = " + weights_tensor_name + "_row_ptr[output_x]; nz < " + weights_tensor_name + "_row_ptr[output_x + 1]; nz++)", current_indent);
+			AddToCFile_Text(f_stream, "{", current_indent);
+			AddToCFile_Text(f_stream, "#pragma HLS LOOP_TRIPCOUNT min=0 max=" + to_string(SparseRowBlocks(layer_number)), current_indent + 1);
+			if (sparse_block > 1) {
+				//Blocked CSR: the pipelined iterations all do sparse_block MACs
+				AddToCFile_Text(f_stream, "#pragma HLS PIPELINE", current_indent + 1);
+				AddToCFile_Text(f_stream, base_for_label + "Nb: for (int input_block = 0; input_block < " + to_string(sparse_block) + "; input_block++)", ++current_indent);
+			}
+		}
+		else
+		AddToCFile_Text(f_stream, base_for_label + label_ix + ": for (int input_x = 0; input_x < " + to_string(layer->input_size_x) + "; input_x++)", current_indent);
+		if (store_alanysis_data) {
+			AddToCFile_Text(f_stream, "#ifndef _HLS_RUN", current_indent);
+			AddToCFile_Text(f_stream, "{", current_indent);
+			AddToCFile_Text(f_stream, "#endif", current_indent);
+		}
+		current_indent++;
+		
+		string weights_tensor_name_full = weights_tensor_name + "[input_x][output_x]";
+		if (packed_weights) weights_tensor_name_full = "WEIGHT_UNPACK(" + weights_tensor_name + "[input_x][output_x / WEIGHTS_PER_BYTE], output_x)";
+		if (sparse_layer) weights_tensor_name_full = weights_tensor_name + "_values[nz]" + (sparse_block > 1 ? "[input_block]" : "");
 
-	string right_side = "";
-	string input_name_full = input_name + "[input_x]";
-	if (!approximate_multipliers)
-		right_side = input_name_full + " * " + weights_tensor_name_full;
-	else
-		right_side = "MUL_LAYER_" + to_string(layer_number + 1) + "(" + input_name_full + ", " + weights_tensor_name_full + ")";
 
-	AddToCFile_Text(f_stream, temp_element_name + " += " + right_side + ";", current_indent);
-	
-	--current_indent;
-	if (store_alanysis_data) {
-		AddToCFile_Text(f_stream, "#ifndef _HLS_RUN", current_indent);
-		AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"weights\", (float)" + weights_tensor_name_full + ", -1, -1, -1);", ++current_indent);
-		AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"temp_element\", (float)" + temp_element_name + ", -1, -1, -1);", current_indent);
-		AddToCFile_Text(f_stream, "}", --current_indent);
-		AddToCFile_Text(f_stream, "#endif", current_indent);
+		string right_side = "";
+		string input_name_full = input_name + DenseInputIndex(layer_number, "input_x");
+		if (sparse_layer) input_name_full = input_name + DenseInputIndex(layer_number, weights_tensor_name + "_index[nz]" + (sparse_block > 1 ? " + input_block" : ""));
+		if (packed_weights)
+			right_side = "WEIGHT_MUL(" + input_name_full + ", " + weights_tensor_name_full + ")";
+		else if (!approximate_multipliers)
+			right_side = input_name_full + " * " + weights_tensor_name_full;
+		else
+			right_side = "MUL_LAYER_" + to_string(layer_number + 1) + "(" + input_name_full + ", " + weights_tensor_name_full + ")";
+
+		if (batch_size > 1) {
+			if (body_braces) AddToCFile_Text(f_stream, "{", current_indent - 1);
+			AddToCFile_Text(f_stream, "DataType_weights weight = " + weights_tensor_name_full + ";", current_indent);
+			AddToCFile_Text(f_stream, BatchLoop(base_for_label + "B"), current_indent);
+			AddToCFile_Text(f_stream, temp_element + " += " + StringSubstituteAll(right_side, weights_tensor_name_full, "weight") + ";", current_indent + 1);
+			if (body_braces) AddToCFile_Text(f_stream, "}", current_indent - 1);
+		}
+		else if (!dsp_pack_layer)
+			AddToCFile_Text(f_stream, temp_element_name + " += " + right_side + ";", current_indent);
+		else {
+			AddToCFile_Text(f_stream, "{", current_indent - 1);
+			AddToCFile_Text(f_stream, "DataType_dsp_product packed_product = (DataType_dsp_input)" + input_name_full + " * DSP_PACK(" + weights_tensor_name + "[input_x][output_x + 1], " + weights_tensor_name_full + ");", current_indent);
+			AddToCFile_Text(f_stream, temp_element_name + " += DSP_UNPACK_LOW(packed_product);", current_indent);
+			AddToCFile_Text(f_stream, temp_element_pair_name + " += DSP_UNPACK_HIGH(packed_product);", current_indent);
+			AddToCFile_Text(f_stream, "}", current_indent - 1);
+		}
+		
+		--current_indent;
+		if (store_alanysis_data) {
+			AddToCFile_Text(f_stream, "#ifndef _HLS_RUN", current_indent);
+			AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"weights\", (float)" + weights_tensor_name_full + ", -1, -1, -1);", ++current_indent);
+			AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"temp_element\", (float)" + temp_element_name + ", -1, -1, -1);", current_indent);
+			AddToCFile_Text(f_stream, "}", --current_indent);
+			AddToCFile_Text(f_stream, "#endif", current_indent);
+		}
+		if (sparse_layer) {
+			current_indent = sparse_indent;
+			AddToCFile_Text(f_stream, "}", current_indent);
+		}
 	}
 
 	if(activation_function == "softmax")
 	{
 		ASSERT(layer_number == layers_size - 1);
 		activation_function = "relu"; //changed from "" to "relu" on 2021-06-29, check 
+		if (output_top_k) activation_function = ""; //Softmax keeps the order of the outputs
 	}
 
-	string output_name = last_layer ? "outputs@" : ("l" + to_string(layer_number+1) + "@");
-	string output_name_q = last_layer ? "outputs" : ("l" + to_string(layer_number+1) + "");
-	string output_name_full = output_name + "[output_x]";
-	string output_name_full_q = output_name_q + "[output_x]";
+	string output_name_full = graph.OutputTensor(layer_number).name + BatchIndex() + "[output_x]";
+	bool top_k = last_layer && output_top_k;
+
+	string temp_element_assignment_to_output = output_name_full + " = " + OutputEpilogue(layer_number, activation_function, temp_element, "output_x") + ";";
+	if (top_k) temp_element_assignment_to_output = TopKAssignment(layer_number, OutputEpilogue(layer_number, activation_function, temp_element, "output_x"), "output_x");
+	if (batch_size > 1) temp_element_assignment_to_output = BatchLoop(base_for_label + "BO") + " " + temp_element_assignment_to_output;
+	f_stream.Lines(temp_element_assignment_to_output, current_indent);
+	if (dsp_pack_layer) {
+		//Same assignments for the second output of the pair
+		temp_string = StringSubstituteAll(temp_element_assignment_to_output, "[output_x]", "[output_x + 1]");
+		temp_string = StringSubstituteAll(temp_string, temp_element_name + ")", temp_element_pair_name + ")");
+		if (top_k) temp_string = TopKAssignment(layer_number, OutputEpilogue(layer_number, activation_function, temp_element_pair_name, "output_x + 1"), "output_x + 1", "KP");
+		f_stream.Lines(temp_string, current_indent);
+	}
 
-	if (quantized) {
-		output_name_full = StringSubstituteAll(output_name_full, "@", "_base");
+	if (store_alanysis_data && quantized) AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"LayerOutputBase\", (float)" + activation_function + "(" + temp_element + "), output_x, -1, -1);", current_indent); 
+	if (store_alanysis_data) AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"LayerOutput\", (float)" + output_name_full + ", output_x, -1, -1);", current_indent); 
+	if (store_alanysis_data && dsp_pack_layer) AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"LayerOutput\", (float)" + StringSubstituteAll(output_name_full, "[output_x]", "[output_x + 1]") + ", output_x + 1, -1, -1);", current_indent); 
+	AddToCFile_Text(f_stream, "}", -- current_indent);
+	if (systolic || input_reuse) AddToCFile_Text(f_stream, "}", -- current_indent); //Loop over the column tiles (blocks of output nodes)
+}
+
+//ix-ox loop order: the output nodes are computed in blocks of B (dense-ox-block). Each block keeps B partial sums in completely partitioned registers.
+//One pipelined iteration of the input_x loop reads one input element and updates all the sums of the block (unrolled ox loop), so each input is read
+//once per block instead of once per output node and the B additions are independent. Ends with the loop over the output nodes of the block (output_x),
+//which the caller completes with the activation and the output assignments.
+void AddToCFile_DenseInputReuse(CodeEmitter &f_stream, int layer_number, int &current_indent) {
+	Layer* layer = Layers[layer_number];
+	int block = DenseOxBlock(layer_number);
+	bool batched = batch_size > 1;
+
+	string n = to_string(layer_number + 1);
+	string base_for_label = "for" + n;
+	if (layer_number + 1 >= 10) base_for_label += "t";
+	string label_ix = numbered_loop_labels ? "1" : "Ix";
+	Tensor &input = graph.InputTensor(layer_number);
+	string input_name = DenseInputTensor(layer_number).name + (AxiStagedInput(layer_number) ? "_tile" : "") + BatchIndex();
+	string input_type = AxiStagedInput(layer_number) ? AxiTensorType(input) : "DataType_" + input.data_type_suffix + (QuantizedMode() && input.producer >= 0 ? "_short" : "");
+	string temp_type = "DataType_temp_element" + n;
+	string acc_name = "temp_element" + n + "_acc";
+	string bias = biases_enabled ? "biases_" + n + "[output_base + block]" : "0";
+
+	string weight = "weights_" + n + "[input_x][output_base + block]";
+	if (QuantizedMode() && PackedWeightBits() != 0) weight = "WEIGHT_UNPACK(weights_" + n + "[input_x][(output_base + block) / WEIGHTS_PER_BYTE], output_base + block)";
+	string product = "input * " + weight;
+	if (QuantizedMode() && PackedWeightBits() != 0) product = "WEIGHT_MUL(input, " + weight + ")";
+	else if (approximate_multipliers) product = "MUL_LAYER_" + n + "(input, " + weight + ")";
+
+	AddToCFile_Text(f_stream, base_for_label + "RN: for (int output_base = 0; output_base < " + to_string(layer->output_size_x) + "; output_base += " + to_string(block) + ")", current_indent);
+	AddToCFile_Text(f_stream, "{", current_indent++);
+	AddToCFile_Text(f_stream, temp_type + " " + acc_name + BatchDimension() + "[" + to_string(block) + "];", current_indent);
+	AddToCFile_Text(f_stream, "#pragma HLS ARRAY_PARTITION variable=" + acc_name + " complete dim=" + (batched ? "2" : "1"), current_indent);
+	AddToCFile_Text(f_stream, base_for_label + "RI: for (int block = 0; block < " + to_string(block) + "; block++)", current_indent);
+	AddToCFile_Text(f_stream, (batched ? BatchLoop(base_for_label + "RIB") + " " : "") + acc_name + BatchIndex() + "[block] = " + bias + ";", current_indent + 1);
+
+	AddToCFile_Text(f_stream, base_for_label + label_ix + ": for (int input_x = 0; input_x < " + to_string(layer->input_size_x) + "; input_x++)", current_indent);
+	if (batched) {
+		//The images of a batch update different sums, see AddToCFile_Conv2dLayer
+		AddToCFile_Text(f_stream, BatchLoop(base_for_label + "RB"), current_indent + 1);
+		current_indent++;
+	}
+	AddToCFile_Text(f_stream, "{", current_indent++);
+	AddToCFile_Text(f_stream, "#pragma HLS PIPELINE", current_indent);
+	AddToCFile_Text(f_stream, input_type + " input = " + input_name + DenseInputIndex(layer_number, "input_x") + ";", current_indent);
+	AddToCFile_Text(f_stream, base_for_label + "RO: for (int block = 0; block < " + to_string(block) + "; block++)", current_indent);
+	AddToCFile_Text(f_stream, "{", current_indent);
+	AddToCFile_Text(f_stream, "#pragma HLS UNROLL", current_indent + 1);
+	AddToCFile_Text(f_stream, acc_name + BatchIndex() + "[block] += " + product + ";", current_indent + 1);
+	AddToCFile_Text(f_stream, "}", current_indent);
+	AddToCFile_Text(f_stream, "}", --current_indent);
+	if (batched) current_indent--;
+
+	AddToCFile_Text(f_stream, base_for_label + "RW: for (int block = 0; block < " + to_string(block) + "; block++)", current_indent);
+	AddToCFile_Text(f_stream, "{", current_indent++);
+	AddToCFile_Text(f_stream, "int output_x = output_base + block;", current_indent);
+	AddToCFile_Text(f_stream, temp_type + " temp_element" + n + BatchDimension() + ";", current_indent);
+	AddToCFile_Text(f_stream, (batched ? BatchLoop(base_for_label + "RWB") + " " : "") + "temp_element" + n + BatchIndex() + " = " + acc_name + BatchIndex() + "[block];", current_indent);
+}
+
+//PE loops of the systolic array. Reverse: from the last PE to the first one, so each PE reads the registers of its neighbours before they are updated.
+void AddToCFile_SystolicPeLoops(CodeEmitter &f_stream, int layer_number, string label, bool reverse, int current_indent) {
+	int rows = SystolicRows(layer_number), columns = SystolicColumns(layer_number);
+	string base_for_label = "for" + to_string(layer_number + 1) + (layer_number + 1 >= 10 ? "t" : "") + label;
+	if (reverse) {
+		AddToCFile_Text(f_stream, base_for_label + "R: for (int row = " + to_string(rows - 1) + "; row >= 0; row--)", current_indent);
+		AddToCFile_Text(f_stream, base_for_label + "C: for (int column = " + to_string(columns - 1) + "; column >= 0; column--)", current_indent + 1);
 	}
 	else {
-		output_name_full = StringSubstituteAll(output_name_full, "@", "");
+		AddToCFile_Text(f_stream, base_for_label + "R: for (int row = 0; row < " + to_string(rows) + "; row++)", current_indent);
+		AddToCFile_Text(f_stream, base_for_label + "C: for (int column = 0; column < " + to_string(columns) + "; column++)", current_indent + 1);
 	}
+	AddToCFile_Text(f_stream, "{", current_indent + 1);
+	AddToCFile_Text(f_stream, "#pragma HLS UNROLL", current_indent + 2);
+}
 
-	string temp_element_assignment_to_output;
-	string temp_element_assignment_to_output_quantized;
+//Inter-PE shift registers: one input, weight and partial sum register per PE
+void AddToCFile_SystolicRegisters(CodeEmitter &f_stream, int layer_number, string input_type, int current_indent) {
+	string n = to_string(layer_number + 1);
+	string dimensions = "[" + to_string(SystolicRows(layer_number)) + "][" + to_string(SystolicColumns(layer_number)) + "]";
+	AddToCFile_Text(f_stream, input_type + " inputs_" + n + "_pe" + dimensions + ";", current_indent);
+	AddToCFile_Text(f_stream, "DataType_weights weights_" + n + "_pe" + dimensions + ";", current_indent);
+	AddToCFile_Text(f_stream, "DataType_temp_element" + n + " sums_" + n + "_pe" + dimensions + ";", current_indent);
+	AddToCFile_Text(f_stream, "#pragma HLS ARRAY_PARTITION variable=inputs_" + n + "_pe complete dim=0", current_indent);
+	AddToCFile_Text(f_stream, "#pragma HLS ARRAY_PARTITION variable=weights_" + n + "_pe complete dim=0", current_indent);
+	AddToCFile_Text(f_stream, "#pragma HLS ARRAY_PARTITION variable=sums_" + n + "_pe complete dim=0", current_indent);
+}
 
-	temp_element_assignment_to_output = output_name_full + " = " + activation_function + "(" + temp_element_name + ");";
-	AddToCFile_Text(f_stream, temp_element_assignment_to_output, current_indent);
-	if (quantized) {
-		temp_element_assignment_to_output_quantized = output_name_full_q;
-		temp_element_assignment_to_output_quantized += " = " + (last_layer?"DataType_output":"DataType_Layer" + to_string(layer_number+1)) + "_short(Q_MIN_MAX(" + output_name_full + "*input_scale_factors[" + to_string(q_index) + "]";
-		temp_element_assignment_to_output_quantized += 	"*weight_scales_"+to_string(layer_number+1)+"[output_x]/output_scale_factors["+to_string(q_index)+"] + output_zero_points["+to_string(q_index)+"]));";
-		AddToCFile_Text(f_stream, temp_element_assignment_to_output_quantized, current_indent);
+//systolic-dense: PxQ array of processing elements (PEs) computing the Dense layer as a matrix product (images x input nodes) * (input nodes x output nodes)
+//The PE registers are completely partitioned and shifted once per iteration of the pipelined time loop. The PE loops run from the last PE to the first one,
+//so each PE reads the value its neighbour had in the previous iteration. Row feeders read the layer input at column 0 with a skew of one iteration per row.
+//Weight-stationary: PE(row, column) keeps weights[row_base + row][column_base + column]. Inputs shift to the right, partial sums shift down and leave the last row into the accumulators.
+//Output-stationary: PE(row, column) accumulates the output node column_base + column of image image_base + row. Inputs shift to the right, weights shift down.
+//Both end with the loop over the Q output nodes of the column tile (output_x), which the caller completes with the activation and the output assignments.
+void AddToCFile_DenseSystolicArray(CodeEmitter &f_stream, int layer_number, int &current_indent) {
+	Layer* layer = Layers[layer_number];
+	int rows = SystolicRows(layer_number), columns = SystolicColumns(layer_number);
+	bool output_stationary = SystolicOutputStationary(layer_number);
+	int inputs_count = layer->input_size_x, outputs_count = layer->output_size_x;
+	bool batched = batch_size > 1;
+
+	string n = to_string(layer_number + 1);
+	string base_for_label = "for" + n;
+	if (layer_number + 1 >= 10) base_for_label += "t";
+	Tensor &input = graph.InputTensor(layer_number);
+	string input_name = DenseInputTensor(layer_number).name + (AxiStagedInput(layer_number) ? "_tile" : "");
+	string input_type = AxiStagedInput(layer_number) ? AxiTensorType(input) : "DataType_" + input.data_type_suffix + (QuantizedMode() && input.producer >= 0 ? "_short" : "");
+	string temp_type = "DataType_temp_element" + n;
+	string acc_name = "temp_element" + n + "_acc";
+	string inputs_pe = "inputs_" + n + "_pe", weights_pe = "weights_" + n + "_pe", sums_pe = "sums_" + n + "_pe";
+	string bias = biases_enabled ? "biases_" + n + "[column_base + column]" : "0";
+
+	string mul_layer = approximate_multipliers ? "MUL_LAYER_" + n : "";
+
+	AddToCFile_Text(f_stream, "//Systolic array: " + to_string(rows) + "x" + to_string(columns) + " PEs, " + systolic_dataflow[layer_number], current_indent);
+	AddToCFile_Text(f_stream, base_for_label + "SN: for (int column_base = 0; column_base < " + to_string(outputs_count) + "; column_base += " + to_string(columns) + ")", current_indent);
+	AddToCFile_Text(f_stream, "{", current_indent++);
+	AddToCFile_Text(f_stream, temp_type + " " + acc_name + BatchDimension() + "[" + to_string(columns) + "];", current_indent);
+	AddToCFile_Text(f_stream, "#pragma HLS ARRAY_PARTITION variable=" + acc_name + " complete dim=" + (batched ? "2" : "1"), current_indent);
+
+	if (!output_stationary) {
+		AddToCFile_Text(f_stream, base_for_label + "SI: for (int column = 0; column < " + to_string(columns) + "; column++)", current_indent);
+		AddToCFile_Text(f_stream, (batched ? BatchLoop(base_for_label + "SIB") + " " : "") + acc_name + BatchIndex() + "[column] = " + bias + ";", current_indent + 1);
+
+		AddToCFile_Text(f_stream, base_for_label + "SK: for (int row_base = 0; row_base < " + to_string(inputs_count) + "; row_base += " + to_string(rows) + ")", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_SystolicRegisters(f_stream, layer_number, input_type, current_indent);
+		AddToCFile_Text(f_stream, base_for_label + "SLR: for (int row = 0; row < " + to_string(rows) + "; row++)", current_indent);
+		AddToCFile_Text(f_stream, base_for_label + "SLC: for (int column = 0; column < " + to_string(columns) + "; column++)", current_indent + 1);
+		AddToCFile_Text(f_stream, "{", current_indent + 1);
+		AddToCFile_Text(f_stream, "#pragma HLS PIPELINE", current_indent + 2);
+		AddToCFile_Text(f_stream, weights_pe + "[row][column] = weights_" + n + "[row_base + row][column_base + column];", current_indent + 2);
+		AddToCFile_Text(f_stream, inputs_pe + "[row][column] = 0;", current_indent + 2);
+		AddToCFile_Text(f_stream, sums_pe + "[row][column] = 0;", current_indent + 2);
+		AddToCFile_Text(f_stream, "}", current_indent + 1);
+
+		//Image t - row enters row "row" at column 0. The sum of image t - (P - 1) - column leaves the last row at column "column".
+		AddToCFile_Text(f_stream, base_for_label + "ST: for (int t = 0; t < " + to_string(batch_size + rows + columns - 2) + "; t++)", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, "#pragma HLS PIPELINE II=1", current_indent);
+		AddToCFile_SystolicPeLoops(f_stream, layer_number, "S", true, current_indent);
+		current_indent += 2;
+		AddToCFile_Text(f_stream, "int image = t - row - column;", current_indent);
+		AddToCFile_Text(f_stream, input_type + " input = 0;", current_indent);
+		AddToCFile_Text(f_stream, "if (column > 0) input = " + inputs_pe + "[row][column - 1];", current_indent);
+		AddToCFile_Text(f_stream, "else if (" + string(batched ? "image >= 0 && image < " + to_string(batch_size) : "image == 0") + ") input = " + input_name + (batched ? "[image]" : "") + DenseInputIndex(layer_number, "row_base + row") + ";", current_indent);
+		AddToCFile_Text(f_stream, temp_type + " sum = 0;", current_indent);
+		AddToCFile_Text(f_stream, "if (row > 0) sum = " + sums_pe + "[row - 1][column];", current_indent);
+		AddToCFile_Text(f_stream, inputs_pe + "[row][column] = input;", current_indent);
+		AddToCFile_Text(f_stream, sums_pe + "[row][column] = sum + " + (mul_layer != "" ? mul_layer + "(input, " + weights_pe + "[row][column])" : "input * " + weights_pe + "[row][column]") + ";", current_indent);
+		current_indent -= 2;
+		AddToCFile_Text(f_stream, "}", current_indent + 1);
+		AddToCFile_Text(f_stream, base_for_label + "SD: for (int column = 0; column < " + to_string(columns) + "; column++)", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent);
+		AddToCFile_Text(f_stream, "#pragma HLS UNROLL", current_indent + 1);
+		AddToCFile_Text(f_stream, "int image = t - " + to_string(rows - 1) + " - column;", current_indent + 1);
+		AddToCFile_Text(f_stream, "if (" + string(batched ? "image >= 0 && image < " + to_string(batch_size) : "image == 0") + ") " + acc_name + (batched ? "[image]" : "") + "[column] += " + sums_pe + "[" + to_string(rows - 1) + "][column];", current_indent + 1);
+		AddToCFile_Text(f_stream, "}", current_indent);
+		AddToCFile_Text(f_stream, "}", --current_indent);
+		AddToCFile_Text(f_stream, "}", --current_indent);
+	}
+	else {
+		AddToCFile_Text(f_stream, base_for_label + "SM: for (int image_base = 0; image_base < " + to_string(batch_size) + "; image_base += " + to_string(rows) + ")", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_SystolicRegisters(f_stream, layer_number, input_type, current_indent);
+		AddToCFile_SystolicPeLoops(f_stream, layer_number, "SI", false, current_indent);
+		AddToCFile_Text(f_stream, inputs_pe + "[row][column] = 0;", current_indent + 2);
+		AddToCFile_Text(f_stream, weights_pe + "[row][column] = 0;", current_indent + 2);
+		AddToCFile_Text(f_stream, sums_pe + "[row][column] = " + bias + ";", current_indent + 2);
+		AddToCFile_Text(f_stream, "}", current_indent + 1);
+
+		//Input node input_x reaches PE(row, column) in iteration input_x + row + column, from the row feeder (inputs) and from the column feeder (weights)
+		AddToCFile_Text(f_stream, base_for_label + "ST: for (int t = 0; t < " + to_string(inputs_count + rows + columns - 2) + "; t++)", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, "#pragma HLS PIPELINE II=1", current_indent);
+		AddToCFile_SystolicPeLoops(f_stream, layer_number, "S", true, current_indent);
+		current_indent += 2;
+		string input_x_valid = "input_x >= 0 && input_x < " + to_string(inputs_count);
+		AddToCFile_Text(f_stream, "int input_x = t - row - column;", current_indent);
+		AddToCFile_Text(f_stream, input_type + " input = 0;", current_indent);
+		AddToCFile_Text(f_stream, "if (column > 0) input = " + inputs_pe + "[row][column - 1];", current_indent);
+		AddToCFile_Text(f_stream, "else if (" + input_x_valid + ") input = " + input_name + (batched ? "[image_base + row]" : "") + DenseInputIndex(layer_number, "input_x") + ";", current_indent);
+		AddToCFile_Text(f_stream, "DataType_weights weight = 0;", current_indent);
+		AddToCFile_Text(f_stream, "if (row > 0) weight = " + weights_pe + "[row - 1][column];", current_indent);
+		AddToCFile_Text(f_stream, "else if (" + input_x_valid + ") weight = weights_" + n + "[input_x][column_base + column];", current_indent);
+		AddToCFile_Text(f_stream, inputs_pe + "[row][column] = input;", current_indent);
+		AddToCFile_Text(f_stream, weights_pe + "[row][column] = weight;", current_indent);
+		AddToCFile_Text(f_stream, sums_pe + "[row][column] += " + (mul_layer != "" ? mul_layer + "(input, weight)" : "input * weight") + ";", current_indent);
+		current_indent -= 2;
+		AddToCFile_Text(f_stream, "}", current_indent + 1);
+		AddToCFile_Text(f_stream, "}", --current_indent);
+		AddToCFile_SystolicPeLoops(f_stream, layer_number, "SA", false, current_indent);
+		AddToCFile_Text(f_stream, acc_name + (batched ? "[image_base + row]" : "") + "[column] = " + sums_pe + "[row][column];", current_indent + 2);
+		AddToCFile_Text(f_stream, "}", current_indent + 1);
+		AddToCFile_Text(f_stream, "}", --current_indent);
 	}
 
-	if (store_alanysis_data && quantized) AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"LayerOutputBase\", (float)" + output_name_full + ", output_x, -1, -1);", current_indent); 
-	if (store_alanysis_data) AddToCFile_Text(f_stream, (string)"STORE_DATA(" + to_string(layer_number + 1) + ", \"LayerOutput\", (float)" + (quantized?output_name_full_q:output_name_full) + ", output_x, -1, -1);", current_indent); 
-	AddToCFile_Text(f_stream, "}", -- current_indent);
+	AddToCFile_Text(f_stream, base_for_label + "SW: for (int column = 0; column < " + to_string(columns) + "; column++)", current_indent);
+	AddToCFile_Text(f_stream, "{", current_indent++);
+	AddToCFile_Text(f_stream, "int output_x = column_base + column;", current_indent);
+	AddToCFile_Text(f_stream, temp_type + " temp_element" + n + BatchDimension() + ";", current_indent);
+	AddToCFile_Text(f_stream, (batched ? BatchLoop(base_for_label + "SWB") + " " : "") + "temp_element" + n + BatchIndex() + " = " + acc_name + BatchIndex() + "[column];", current_indent);
 }
 
 string Tabs(int count) {
-	string result;
-	for(int i = 0; i < count; i++) {
-		result += "\t";
-	}
-	return result;
+	return string(count, '\t');
 }
 
-void AddToCFile_MainAndPredict(ofstream &f_stream) {
+void AddToCFile_MainAndPredict(CodeEmitter &f_stream) {
 	string temp_string;
 
 	AddToCFile_Text(f_stream, "#ifndef _HLS_RUN");
 	AddToCFile_EmptyLine(f_stream);
 
   int layers_size = Layers.size();
-	bool quantized = data_type_mode_fixed_point_single && (data_type_mode_detail == "eight-bit-int" || data_type_mode_detail == "default_int8_t");
+	bool quantized = QuantizedMode();
+	bool packed_weights = quantized && PackedWeightBits() != 0;
 
 	string q_factors_string;
 	if (quantized) {
 		temp_string = "";
 		bool conv_or_dense ;
-		int conv_or_dense_count = 0;
-		for(int i = 0; i < layers_size; i++) {
-			conv_or_dense = Layers[i]->layer_type == CONV2D || Layers[i]->layer_type == DENSE;
-			if (conv_or_dense) ++conv_or_dense_count;
-		}
 		temp_string += "input_zero_points_src, ";
 		temp_string += "output_zero_points_src, ";
 		temp_string += "input_scale_factors_src, ";
@@ -1651,20 +2789,30 @@ void AddToCFile_MainAndPredict(ofstream &f_stream) {
 		temp_string += "\n" + Tabs(3);
 		
 		for(int i = 0; i < layers_size; i++) {
-			bool conv = Layers[i]->layer_type == CONV2D;
-			bool dense = Layers[i]->layer_type == DENSE;
-			conv_or_dense = conv || dense;
+			conv_or_dense = Layers[i]->HasWeights();
 			if (!conv_or_dense) continue;
-			string temp_string2 = "";
-
-			temp_string2 += "weight_scales_#_src, ";
-			temp_string2 = StringSubstituteAll(temp_string2, "#", to_string(i + 1));
-
-			temp_string += temp_string2;
+			temp_string += "weight_scales_" + to_string(i + 1) + "_src, ";
 		}
 		q_factors_string = temp_string;
 	}
 
+	if (BatchNormFolding()) {
+		AddToCFile_FoldBatchNormFunction(f_stream);
+		AddToCFile_EmptyLine(f_stream);
+	}
+	if (BiasClamping()) {
+		AddToCFile_ClampBiasesFunction(f_stream);
+		AddToCFile_EmptyLine(f_stream);
+	}
+	if (packed_weights) {
+		AddToCFile_PackWeightsFunction(f_stream);
+		AddToCFile_EmptyLine(f_stream);
+	}
+	if (!sparse_density.empty()) {
+		AddToCFile_SparsifyWeightsFunction(f_stream);
+		AddToCFile_EmptyLine(f_stream);
+	}
+
 	AddToCFile_Text(f_stream, "void Predict(InputType input, int *p" + string(fault_simulation?", int faulty_layer, int faulty_fmap, int faulty_bit":"") + ")"	);
 	AddToCFile_Text(f_stream, "{");
 
@@ -1679,15 +2827,14 @@ void AddToCFile_MainAndPredict(ofstream &f_stream) {
 		string layer_datatype_suffix = "Layer" + to_string(layer_number + 1);
 
 		if (LayerDataLocation(layer_number + 1) == "local") temp_string = "//"; else temp_string = "";
-		if (layer->layer_type == CONV2D || layer->layer_type == POOLING2D)
-			temp_string += /* STATIC */ "DataType_" + layer_datatype_suffix + " l#_src[" + to_string(layer->output_size_x) + "]"
+		if (!layer->VectorOutput())
+			temp_string += /* STATIC */ "DataType_" + layer_datatype_suffix + " l#_src" + BatchDimension() + "[" + to_string(layer->output_size_x) + "]"
 																																			 + "[" + to_string(layer->output_size_y) + "]"
 																																			 + "[" + to_string(layer->output_size_z) + "];";
-		else //FLATTEN, DENSE
-			temp_string += /* STATIC */ "DataType_" + layer_datatype_suffix + " l#_src[" + to_string(layer->output_size_x) + "];";
+		else //FLATTEN, DENSE, global pooling, merge of vectors
+			temp_string += /* STATIC */ "DataType_" + layer_datatype_suffix + " l#_src" + BatchDimension() + "[" + to_string(layer->output_size_x) + "];";
 
-		temp_string = StringSubstituteAll(temp_string, "#", to_string(layer_number+1));
-		AddToCFile_Text(f_stream, temp_string, current_indent);
+		f_stream.LineTemplate(temp_string, {{'#', to_string(layer_number+1)}}, current_indent);
 	}
 	AddToCFile_EmptyLine(f_stream);
 
@@ -1705,7 +2852,8 @@ void AddToCFile_MainAndPredict(ofstream &f_stream) {
 			if (temp_int > 0 && temp_int % 3 == 0) f_stream  << endl;
 			if (temp_int % 3 == 0) f_stream << indent;
 
-			f_stream  << "weights_" << i + 1 << "_src";
+			if (SparseDensity(i)) f_stream  << "weights_" << i + 1 << "_values_src, weights_" << i + 1 << "_index_src, weights_" << i + 1 << "_row_ptr_src";
+			else f_stream  << "weights_" << i + 1 << (packed_weights?"_packed_src":"_src");
 			if (biases_enabled) f_stream  << ", biases_" << i + 1 << "_src";
 			temp_int++;
 		}
@@ -1714,6 +2862,16 @@ void AddToCFile_MainAndPredict(ofstream &f_stream) {
 			if (temp_int > 0 && temp_int % 3 == 0) f_stream  << endl;
 			if (temp_int % 3 == 0) f_stream << indent;
 			
+			if (SparseDensity(i)) f_stream  << "weights_" << i + 1 << "_values_src, weights_" << i + 1 << "_index_src, weights_" << i + 1 << "_row_ptr_src";
+			else f_stream  << "weights_" << i + 1 << (packed_weights?"_packed_src":"_src");
+			if (biases_enabled) f_stream  << ", biases_" << i + 1 << "_src";
+			temp_int++;
+		}
+		else if (Layers[i]->HasWeights()) {
+			if (temp_int > 0) f_stream  << ", ";
+			if (temp_int > 0 && temp_int % 3 == 0) f_stream  << endl;
+			if (temp_int % 3 == 0) f_stream << indent;
+
 			f_stream  << "weights_" << i + 1 << "_src";
 			if (biases_enabled) f_stream  << ", biases_" << i + 1 << "_src";
 			temp_int++;
@@ -1731,28 +2889,41 @@ void AddToCFile_MainAndPredict(ofstream &f_stream) {
 
 		int layer_number = i;
 		//Layer* layer = Layers[i];
-		temp_string = ", l#_src";
-		temp_string = StringSubstituteAll(temp_string, "#", to_string(layer_number+1));
-		f_stream << temp_string;
+		f_stream << ", l" << to_string(layer_number+1) << "_src";
 		temp_int++;
 	}
 
 	AddToCFile_Text(f_stream, ");");
 
 	AddToCFile_Text(f_stream, "");
-	AddToCFile_Text(f_stream, "\t// output decoding");
-	AddToCFile_Text(f_stream, "\tint result = 0;");
-	AddToCFile_Text(f_stream, "\tDataType_relu maxvalue = outputs[0];");
-	AddToCFile_Text(f_stream, "\tfor (int i = 1; i < " + to_string(Layers[Layers.size() - 1]->output_size_x) + "; i++)");
-	AddToCFile_Text(f_stream, "\t{");
-	AddToCFile_Text(f_stream, "\t\tif (outputs[i] > maxvalue)");
-	AddToCFile_Text(f_stream, "\t\t{");
-	AddToCFile_Text(f_stream, "\t\t\tmaxvalue = outputs[i];");
-	AddToCFile_Text(f_stream, "\t\t\tresult = i;");
-	AddToCFile_Text(f_stream, "\t\t}");
-	AddToCFile_Text(f_stream, "\t}");
-	AddToCFile_Text(f_stream, "");
-	AddToCFile_Text(f_stream, "\t*p = result;");
+	//batch-size: p has one entry per image
+	string outputs_name = "outputs" + BatchIndex();
+	current_indent = 1;
+	AddToCFile_Text(f_stream, "// output decoding", current_indent);
+	if (output_top_k) {
+		//output-mode: the class index is written by forward
+		if (batch_size > 1) AddToCFile_Text(f_stream, "for (int batch = 0; batch < " + to_string(batch_size) + "; batch++) p[batch] = outputs[batch][0];", current_indent);
+		else AddToCFile_Text(f_stream, "*p = outputs[0];", current_indent);
+	}
+	else {
+		if (batch_size > 1) {
+			AddToCFile_Text(f_stream, "for (int batch = 0; batch < " + to_string(batch_size) + "; batch++)", current_indent);
+			AddToCFile_Text(f_stream, "{", current_indent++);
+		}
+		AddToCFile_Text(f_stream, "int result = 0;", current_indent);
+		AddToCFile_Text(f_stream, "DataType_relu maxvalue = " + outputs_name + "[0];", current_indent);
+		AddToCFile_Text(f_stream, "for (int i = 1; i < " + to_string(Layers[Layers.size() - 1]->output_size_x) + "; i++)", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, "if (" + outputs_name + "[i] > maxvalue)", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, "maxvalue = " + outputs_name + "[i];", current_indent);
+		AddToCFile_Text(f_stream, "result = i;", current_indent);
+		AddToCFile_Text(f_stream, "}", --current_indent);
+		AddToCFile_Text(f_stream, "}", --current_indent);
+		AddToCFile_Text(f_stream, "");
+		AddToCFile_Text(f_stream, batch_size > 1 ? "p[batch] = result;" : "*p = result;", current_indent);
+		if (batch_size > 1) AddToCFile_Text(f_stream, "}", --current_indent);
+	}
 	AddToCFile_Text(f_stream, "}");
 	AddToCFile_EmptyLine(f_stream);
 	AddToCFile_Text(f_stream, "int main(int argc, char* argv[])");
@@ -1781,12 +2952,8 @@ void AddToCFile_MainAndPredict(ofstream &f_stream) {
 	AddToCFile_Text(f_stream, R"(AddToLog(filename, "DataType_weights: %s", TypeName(DataType_weights));)", current_indent);
 	
 	for(int i = 0; i < layers_size; i++)	{
-		string temp_string = R"(AddToLog(filename, "DataType_Layer#: %s", TypeName(DataType_Layer#));)";
-		string temp_string2 = to_string(i + 1);
-		if (i == layers_size - 1) temp_string2 = "_output";
-		temp_string = StringSubstituteAll(temp_string, "#", temp_string2);
-		temp_string = StringSubstituteAll(temp_string, "_Layer_output", "_output");
-		AddToCFile_Text(f_stream, temp_string, current_indent);
+		string data_type = i == layers_size - 1 ? "DataType_output" : "DataType_Layer" + to_string(i + 1);
+		f_stream.LineTemplate(R"(AddToLog(filename, "#: %s", TypeName(#));)", {{'#', data_type}}, current_indent);
 	}
 	AddToCFile_EmptyLine(f_stream);
 
@@ -1808,6 +2975,16 @@ void AddToCFile_MainAndPredict(ofstream &f_stream) {
 	}
 
 	AddToCFile_Text(f_stream, "\tInitializeParam(" + initialize_param_argument + ");");
+	if (BatchNormFolding()) AddToCFile_Text(f_stream, "FoldBatchNorm(); //Before the weights are packed or compressed", current_indent);
+	if (BiasClamping()) {
+		AddToCFile_Text(f_stream, "int clipped_biases = ClampBiases();", current_indent);
+		AddToCFile_Text(f_stream, R"(if (clipped_biases) AddToLog(filename, "accumulator-width: %s biases do not fit in the accumulator bias bits and are clipped", to_string(clipped_biases));)", current_indent);
+	}
+	if (packed_weights) AddToCFile_Text(f_stream, "PackWeights();", current_indent);
+	if (!sparse_density.empty()) {
+		AddToCFile_Text(f_stream, "int dropped_weight_blocks = SparsifyWeights();", current_indent);
+		AddToCFile_Text(f_stream, R"(if (dropped_weight_blocks) AddToLog(filename, "sparse-weights: %s weight blocks do not fit in the compressed arrays and are dropped", to_string(dropped_weight_blocks));)", current_indent);
+	}
 	AddToCFile_Text(f_stream, R"(AddToLog(filename, "Parameters loaded (%s) ", GetCurrentTimeAsString());)", current_indent);
 	AddToCFile_EmptyLine(f_stream);
 
@@ -1828,7 +3005,10 @@ void AddToCFile_MainAndPredict(ofstream &f_stream) {
 	AddToCFile_Text(f_stream, "\tvector<thread> threads;");
 	AddToCFile_EmptyLine(f_stream);
 	AddToCFile_Text(f_stream, "\tInputType* temp_data = new InputType[thread_count];");
-	AddToCFile_Text(f_stream, "\tint *p = new int[thread_count];");
+	//batch-size: each thread predicts a batch, so a round covers thread_count * batch_size images (slots)
+	string slots = batch_size > 1 ? "thread_count * " + to_string(batch_size) : "thread_count";
+	string slot_data = batch_size > 1 ? "temp_data[t / " + to_string(batch_size) + "][t % " + to_string(batch_size) + "]" : "temp_data[t]";
+	AddToCFile_Text(f_stream, "\tint *p = new int[" + slots + "];");
 	AddToCFile_Text(f_stream, "\tint truePredict = 0;");
 	AddToCFile_EmptyLine(f_stream);
 	AddToCFile_Text(f_stream, "double exec_time_sum = 0;", current_indent);
@@ -1843,16 +3023,16 @@ void AddToCFile_MainAndPredict(ofstream &f_stream) {
 	AddToCFile_Text(f_stream, "int run_range = image_count;", current_indent);
 	AddToCFile_Text(f_stream, "while (i < run_range)", current_indent);
 	AddToCFile_Text(f_stream, "{", current_indent++);
-	AddToCFile_Text(f_stream, "for (int t = 0; t < thread_count && i + t < run_range; t++)", current_indent++);
+	AddToCFile_Text(f_stream, "for (int t = 0; t < " + slots + " && i + t < run_range; t++)", current_indent++);
 	AddToCFile_Text(f_stream, "for(int j = 0; j < " + to_string(Layers[0]->input_size_x) + "; j++)", current_indent++);
 	AddToCFile_Text(f_stream, "for(int k = 0; k < " + to_string(Layers[0]->input_size_y) + "; k++)" + string((Layers[0]->input_size_z != 1)?" {":""), current_indent++);
 	if(Layers[0]->input_size_z == 1) {
-		AddToCFile_Text(f_stream, "temp_data[t][j][k][0] = testdata[i+t][j][k][0];", current_indent);
+		AddToCFile_Text(f_stream, slot_data + "[j][k][0] = testdata[i+t][j][k][0];", current_indent);
 	}
 	else {
-		AddToCFile_Text(f_stream, "temp_data[t][j][k][0] = testdata[i+t][j][k][0];", current_indent);
-		AddToCFile_Text(f_stream, "temp_data[t][j][k][1] = testdata[i+t][j][k][1];", current_indent);
-		AddToCFile_Text(f_stream, "temp_data[t][j][k][2] = testdata[i+t][j][k][2];", current_indent);
+		AddToCFile_Text(f_stream, slot_data + "[j][k][0] = testdata[i+t][j][k][0];", current_indent);
+		AddToCFile_Text(f_stream, slot_data + "[j][k][1] = testdata[i+t][j][k][1];", current_indent);
+		AddToCFile_Text(f_stream, slot_data + "[j][k][2] = testdata[i+t][j][k][2];", current_indent);
 	}
 	--current_indent;
 	if(Layers[0]->input_size_z != 1) AddToCFile_Text(f_stream, "}", current_indent);
@@ -1870,7 +3050,8 @@ void AddToCFile_MainAndPredict(ofstream &f_stream) {
 	AddToCFile_Text(f_stream, "}", --current_indent);
 	AddToCFile_Text(f_stream, "else", current_indent);
 	AddToCFile_Text(f_stream, "{", current_indent++);
-	AddToCFile_Text(f_stream, "for (int t = 0; t < thread_count && i + t < run_range; t++) threads.push_back(thread(Predict, temp_data[t], p+t" + string(fault_simulation?", 0, 0, 0":"") + "));", current_indent);
+	if (batch_size > 1) AddToCFile_Text(f_stream, "for (int t = 0; t < thread_count && i + t * " + to_string(batch_size) + " < run_range; t++) threads.push_back(thread(Predict, temp_data[t], p+t*" + to_string(batch_size) + "));", current_indent);
+	else AddToCFile_Text(f_stream, "for (int t = 0; t < thread_count && i + t < run_range; t++) threads.push_back(thread(Predict, temp_data[t], p+t" + string(fault_simulation?", 0, 0, 0":"") + "));", current_indent);
 	AddToCFile_Text(f_stream, "for (auto &th : threads) th.join();", current_indent);
 	AddToCFile_Text(f_stream, "threads.clear();", current_indent);
 	AddToCFile_Text(f_stream, "}", --current_indent);
@@ -1881,9 +3062,9 @@ void AddToCFile_MainAndPredict(ofstream &f_stream) {
 
 	if(store_alanysis_data) AddToCFile_Text(f_stream, "if (0 == RunCounter++) ExportData(filename_elements_s);", current_indent);
 	AddToCFile_EmptyLine(f_stream);
-	AddToCFile_Text(f_stream, "for (int t = 0; t < thread_count && i + t < run_range; t++) if (testlabels[i + t] == p[t]) truePredict++;", current_indent);
+	AddToCFile_Text(f_stream, "for (int t = 0; t < " + slots + " && i + t < run_range; t++) if (testlabels[i + t] == p[t]) truePredict++;", current_indent);
 	AddToCFile_EmptyLine(f_stream);
-	AddToCFile_Text(f_stream, "i = min(i + thread_count, run_range);", current_indent);
+	AddToCFile_Text(f_stream, "i = min(i + " + slots + ", run_range);", current_indent);
 	AddToCFile_Text(f_stream, "PrintProgress(i, truePredict, run_range, thread_count, filename);", current_indent);
 
 	current_indent--;
@@ -1894,6 +3075,10 @@ void AddToCFile_MainAndPredict(ofstream &f_stream) {
 	AddToCFile_EmptyLine(f_stream);
 
 	AddToCFile_Text(f_stream, "ExportData(filename, true);", current_indent);
+	if (store_alanysis_data) {
+		AddToCFile_Text(f_stream, "ExportRanges(\"" + ANALYSIS_DATA_FILE_NAME + "\");", current_indent);
+		AddToCFile_Text(f_stream, R"(AddToLog(filename, "Analysis data (analysis-data-file): %s\n", ")" + ANALYSIS_DATA_FILE_NAME + R"(");)", current_indent);
+	}
 
 	if (fault_simulation){
 		AddToCFile_Text(f_stream, "} else { //fault_simulation", current_indent);
@@ -1902,7 +3087,7 @@ void AddToCFile_MainAndPredict(ofstream &f_stream) {
 		for(int i = 0; i < layers_size - 1; i++)	{ //No fault injection for the last layer
 			if (i > 0) layer_dimentions += ", ";
 
-			if(Layers[i]->layer_type == CONV2D || Layers[i]->layer_type == POOLING2D)	{
+			if(Layers[i]->layer_type != FLATTEN && Layers[i]->layer_type != DENSE)	{
 				layer_dimentions += to_string(Layers[i]->output_size_x) + "*" + to_string(Layers[i]->output_size_y) + "*" + to_string(Layers[i]->output_size_z);
 			}
 			else{
@@ -1963,41 +3148,208 @@ void AddToCFile_MainAndPredict(ofstream &f_stream) {
 		AddToCFile_Text(f_stream, "PrintProgress(i * fault_count, truePredict, run_range * fault_count, 1, filename);", current_indent);
 
 		AddToCFile_Text(f_stream, "}", --current_indent);
-		AddToCFile_EmptyLine(f_stream);
-		AddToCFile_Text(f_stream, R"(AddToLog(filename, "Accuracy: " + to_string(truePredict) + " / " + to_string(run_range * fault_count) + "(" + FloatToString(truePredict * 1.0 / (run_range * fault_count) * 100) + "%) ");)", current_indent);
-		AddToCFile_Text(f_stream, R"(AddToLog(filename, "Average execution time: %s seconds\n", to_string(exec_time_sum / (run_range * fault_count)));)", current_indent);
-		AddToCFile_Text(f_stream, "} //fault_simulation", current_indent);
+		AddToCFile_EmptyLine(f_stream);
+		AddToCFile_Text(f_stream, R"(AddToLog(filename, "Accuracy: " + to_string(truePredict) + " / " + to_string(run_range * fault_count) + "(" + FloatToString(truePredict * 1.0 / (run_range * fault_count) * 100) + "%) ");)", current_indent);
+		AddToCFile_Text(f_stream, R"(AddToLog(filename, "Average execution time: %s seconds\n", to_string(exec_time_sum / (run_range * fault_count)));)", current_indent);
+		AddToCFile_Text(f_stream, "} //fault_simulation", current_indent);
+	}
+
+	AddToCFile_EmptyLine(f_stream);
+	AddToCFile_Text(f_stream, "exec_time_sum_wall_clock = t1_wall_clock.Stop(Timer::S);", current_indent);
+	AddToCFile_Text(f_stream, R"(AddToLog(filename, "Total execution time (wall clock): %s\n", FormatTime((int)exec_time_sum_wall_clock));)", current_indent);
+	AddToCFile_Text(f_stream, R"(AddToLog(filename, "All Done!");)", current_indent);
+	AddToCFile_EmptyLine(f_stream);
+	AddToCFile_Text(f_stream, "#ifdef _DEBUG", current_indent);
+	AddToCFile_Text(f_stream, "char temp_char = _getche();", current_indent);
+	AddToCFile_Text(f_stream, "#endif", current_indent);
+	AddToCFile_EmptyLine(f_stream);
+	AddToCFile_Text(f_stream, "return 0;", current_indent);
+	AddToCFile_Text(f_stream, "}", --current_indent);
+	AddToCFile_Text(f_stream, "#endif //_HLS_RUN", current_indent);
+}
+
+//BatchNormalization after layer N: batch_norm_N_src holds gamma, beta, moving mean and moving variance (Keras order) per output channel.
+//scale = gamma / sqrt(variance + epsilon), weights *= scale, biases = (biases - mean) * scale + beta. The output channel is the last weight dimension
+//(depthwise: the last two dimensions, input channel * depth_multiplier + multiplier), so weight i belongs to channel i % channels.
+void AddToCFile_FoldBatchNormFunction(CodeEmitter &f_stream, string function_name) {
+	AddToCFile_Text(f_stream, "void " + function_name + "()");
+	AddToCFile_Text(f_stream, "{");
+
+	int current_indent = 1;
+	for (size_t i = 0; i < Layers.size(); i++) {
+		Layer* layer = Layers[i];
+		if (!layer->batch_norm) continue;
+		string n = to_string(i + 1);
+		string channels = to_string(layer->OutputChannels());
+		long long count = 1;
+		for (int size : layer->WeightShape()) count *= size;
+		char epsilon[32];
+		snprintf(epsilon, sizeof(epsilon), "%g", layer->batch_norm_epsilon);
+
+		AddToCFile_Text(f_stream, "//Layer " + n + ": BatchNormalization(epsilon: " + string(epsilon) + ")", current_indent);
+		AddToCFile_Text(f_stream, "for (int channel = 0; channel < " + channels + "; channel++)", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, "float scale = batch_norm_" + n + "_src[0][channel] / sqrt(batch_norm_" + n + "_src[3][channel] + " + string(epsilon) + ");", current_indent);
+		AddToCFile_Text(f_stream, "for (int i = channel; i < " + to_string(count) + "; i += " + channels + ") ((DataType_weights*)weights_" + n + "_src)[i] = (float)((DataType_weights*)weights_" + n + "_src)[i] * scale;", current_indent);
+		AddToCFile_Text(f_stream, "biases_" + n + "_src[channel] = ((float)biases_" + n + "_src[channel] - batch_norm_" + n + "_src[2][channel]) * scale + batch_norm_" + n + "_src[1][channel];", current_indent);
+		AddToCFile_Text(f_stream, "}", --current_indent);
+	}
+
+	AddToCFile_Text(f_stream, "}");
+}
+
+//accumulator-width: the loaded biases are saturated to the bias bits of the accumulator types (AccumulatorBiasBits), so a bias that does not fit
+//is clipped instead of wrapping around in the accumulator. Returns the number of clipped biases.
+void AddToCFile_ClampBiasesFunction(CodeEmitter &f_stream, string function_name) {
+	AddToCFile_Text(f_stream, "int " + function_name + "()");
+	AddToCFile_Text(f_stream, "{");
+
+	int current_indent = 1;
+	AddToCFile_Text(f_stream, "int clipped = 0;", current_indent);
+	for (size_t i = 0; i < Layers.size(); i++) {
+		if (!Layers[i]->HasWeights()) continue;
+		string n = to_string(i + 1);
+		int bias_bits = AccumulatorBiasBits(i);
+		string max_value = to_string((1LL << (bias_bits - 1)) - 1), min_value = to_string(-(1LL << (bias_bits - 1)));
+
+		AddToCFile_Text(f_stream, "//Layer " + n + ": " + to_string(bias_bits) + " bits", current_indent);
+		AddToCFile_Text(f_stream, "for (int channel = 0; channel < " + to_string(Layers[i]->OutputChannels()) + "; channel++)", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, "DataType_biases &bias = biases_" + n + "_src[channel];", current_indent);
+		AddToCFile_Text(f_stream, "if (bias > " + max_value + ") {bias = " + max_value + "; clipped++;}", current_indent);
+		AddToCFile_Text(f_stream, "else if (bias < " + min_value + ") {bias = " + min_value + "; clipped++;}", current_indent);
+		AddToCFile_Text(f_stream, "}", --current_indent);
+	}
+	AddToCFile_Text(f_stream, "return clipped;", current_indent);
+
+	AddToCFile_Text(f_stream, "}");
+}
+
+void AddToCFile_PackWeightsFunction(CodeEmitter &f_stream, string function_name) {
+	//Weights are loaded unpacked (weights_#_src) and packed once into weights_#_packed_src, which is passed to forward
+	AddToCFile_Text(f_stream, "void " + function_name + "()");
+	AddToCFile_Text(f_stream, "{");
+
+	int current_indent = 1;
+	for (size_t i = 0; i < Layers.size(); i++) {
+		Layer* layer = Layers[i];
+		string loops[4], indices, packed_indices, channel;
+		int loops_count;
+
+		if (layer->layer_type == CONV2D) {
+			loops[0] = "for (int kernel_x = 0; kernel_x < " + to_string(layer->kernel_size_rows) + "; kernel_x++)";
+			loops[1] = "for (int kernel_y = 0; kernel_y < " + to_string(layer->kernel_size_cols) + "; kernel_y++)";
+			loops[2] = "for (int input_z = 0; input_z < " + to_string(layer->input_size_z) + "; input_z++)";
+			loops[3] = "for (int output_z = 0; output_z < " + to_string(layer->output_size_z) + "; output_z++)";
+			loops_count = 4;
+			indices = "[kernel_x][kernel_y][input_z][output_z]";
+			packed_indices = "[kernel_x][kernel_y][input_z][output_z / WEIGHTS_PER_BYTE]";
+			channel = "output_z";
+		}
+		else if (layer->layer_type == DENSE) {
+			loops[0] = "for (int input_x = 0; input_x < " + to_string(layer->input_size_x) + "; input_x++)";
+			loops[1] = "for (int output_x = 0; output_x < " + to_string(layer->output_size_x) + "; output_x++)";
+			loops_count = 2;
+			indices = "[input_x][output_x]";
+			packed_indices = "[input_x][output_x / WEIGHTS_PER_BYTE]";
+			channel = "output_x";
+		}
+		else continue;
+
+		string packed_name = "weights_" + to_string(i + 1) + "_packed_src" + packed_indices;
+		AddToCFile_Text(f_stream, "//Layer " + to_string(i + 1), current_indent);
+		for (int j = 0; j < loops_count; j++) AddToCFile_Text(f_stream, loops[j], current_indent + j);
+		current_indent += loops_count - 1;
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, "if (" + channel + " % WEIGHTS_PER_BYTE == 0) " + packed_name + " = 0;", current_indent);
+		AddToCFile_Text(f_stream, packed_name + " |= WEIGHT_ENCODE(weights_" + to_string(i + 1) + "_src" + indices + ") << ((" + channel + " % WEIGHTS_PER_BYTE) * WEIGHT_BITS);", current_indent);
+		AddToCFile_Text(f_stream, "}", --current_indent);
+		current_indent = 1;
+	}
+
+	AddToCFile_Text(f_stream, "}");
+}
+
+//sparse-weights: weights are loaded dense (weights_#_src) and compressed once into weights_#_values_src, weights_#_index_src and weights_#_row_ptr_src, which are passed to forward.
+//A block is stored when one of its weights is above the threshold (the others are stored as zeros). Returns the number of blocks that do not fit in the arrays (dropped).
+void AddToCFile_SparsifyWeightsFunction(CodeEmitter &f_stream, string function_name) {
+	AddToCFile_Text(f_stream, "int " + function_name + "()");
+	AddToCFile_Text(f_stream, "{");
+
+	int current_indent = 1;
+	AddToCFile_Text(f_stream, "int dropped = 0;", current_indent);
+	for (size_t i = 0; i < Layers.size(); i++) {
+		if (!SparseDensity(i)) continue;
+		Layer* layer = Layers[i];
+		bool conv = layer->layer_type == CONV2D;
+		int block = SparseBlock(i), capacity = SparseCapacity(i);
+		string name = "weights_" + to_string(i + 1);
+		string weight, index, channel;
+		vector<string> loops;
+
+		if (conv) {
+			int iz_bits = SparseIndexBits(layer->input_size_z), ky_bits = SparseIndexBits(layer->kernel_size_cols);
+			channel = "output_z";
+			loops.push_back("for (int output_z = 0; output_z < " + to_string(layer->output_size_z) + "; output_z++)");
+			loops.push_back("for (int kernel_x = 0; kernel_x < " + to_string(layer->kernel_size_rows) + "; kernel_x++)");
+			loops.push_back("for (int kernel_y = 0; kernel_y < " + to_string(layer->kernel_size_cols) + "; kernel_y++)");
+			loops.push_back("for (int input_z = 0; input_z < " + to_string(layer->input_size_z) + "; input_z += " + to_string(block) + ")");
+			weight = name + "_src[kernel_x][kernel_y][input_z + j][output_z]";
+			index = "(kernel_x << " + to_string(ky_bits + iz_bits) + ") | (kernel_y << " + to_string(iz_bits) + ") | input_z";
+		}
+		else {
+			channel = "output_x";
+			loops.push_back("for (int output_x = 0; output_x < " + to_string(layer->output_size_x) + "; output_x++)");
+			loops.push_back("for (int input_x = 0; input_x < " + to_string(layer->input_size_x) + "; input_x += " + to_string(block) + ")");
+			weight = name + "_src[input_x + j][output_x]";
+			index = "input_x";
+		}
+		string threshold = to_string(sparse_threshold[i]);
+		string above_threshold = "((double)" + weight + " > " + threshold + " || (double)" + weight + " < -" + threshold + ")";
+		string value = name + "_values_src[count]" + (block > 1 ? "[j]" : "");
+
+		AddToCFile_Text(f_stream, "//Layer " + to_string(i + 1) + ": " + to_string(capacity) + " blocks of " + to_string(block) + (block > 1 ? " weights" : " weight"), current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, "int count = 0;", current_indent);
+		AddToCFile_Text(f_stream, loops[0], current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, name + "_row_ptr_src[" + channel + "] = count;", current_indent);
+		for (size_t j = 1; j < loops.size(); j++) AddToCFile_Text(f_stream, loops[j], current_indent + j - 1);
+		current_indent += loops.size() - 2;
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, "bool stored = false;", current_indent);
+		AddToCFile_Text(f_stream, "for (int j = 0; j < " + to_string(block) + "; j++) if " + above_threshold + " stored = true;", current_indent);
+		AddToCFile_Text(f_stream, "if (!stored) continue;", current_indent);
+		AddToCFile_Text(f_stream, "if (count == " + to_string(capacity) + ") {dropped++; continue;}", current_indent);
+		AddToCFile_Text(f_stream, name + "_index_src[count] = " + index + ";", current_indent);
+		AddToCFile_Text(f_stream, "for (int j = 0; j < " + to_string(block) + "; j++) " + value + " = " + above_threshold + " ? " + weight + " : (DataType_weights)0;", current_indent);
+		AddToCFile_Text(f_stream, "count++;", current_indent);
+		AddToCFile_Text(f_stream, "}", --current_indent);
+		current_indent -= loops.size() - 2;
+		AddToCFile_Text(f_stream, "}", --current_indent);
+		AddToCFile_Text(f_stream, name + "_row_ptr_src[" + to_string(conv ? layer->output_size_z : layer->output_size_x) + "] = count;", current_indent);
+		AddToCFile_Text(f_stream, "}", --current_indent);
 	}
-
-	AddToCFile_EmptyLine(f_stream);
-	AddToCFile_Text(f_stream, "exec_time_sum_wall_clock = t1_wall_clock.Stop(Timer::S);", current_indent);
-	AddToCFile_Text(f_stream, R"(AddToLog(filename, "Total execution time (wall clock): %s\n", FormatTime((int)exec_time_sum_wall_clock));)", current_indent);
-	AddToCFile_Text(f_stream, R"(AddToLog(filename, "All Done!");)", current_indent);
-	AddToCFile_EmptyLine(f_stream);
-	AddToCFile_Text(f_stream, "#ifdef _DEBUG", current_indent);
-	AddToCFile_Text(f_stream, "char temp_char = _getche();", current_indent);
-	AddToCFile_Text(f_stream, "#endif", current_indent);
-	AddToCFile_EmptyLine(f_stream);
-	AddToCFile_Text(f_stream, "return 0;", current_indent);
-	AddToCFile_Text(f_stream, "}", --current_indent);
-	AddToCFile_Text(f_stream, "#endif //_HLS_RUN", current_indent);
+	AddToCFile_Text(f_stream, "return dropped;", current_indent);
+	AddToCFile_Text(f_stream, "}");
 }
 
-void GenerateHFileDataTypes() {
+//directory: where data-types.h is written, per_layer_fractional_bits: FX_SIZE_F_LAYERn of fixed-point-multi (layer-fractional-bits or a bit-width-search candidate)
+void GenerateHFileDataTypes(string directory, const vector<int> &per_layer_fractional_bits) {
 	bool data_type_mode_all = data_type_mode_floating_point && data_type_mode_fixed_point_single && data_type_mode_fixed_point_multi;
 
 	cout << "*********************************************************" << endl;
 	if (data_type_mode_all)
 		cout << "Remember to set DataType. Default: float" << endl;
-	cout << "Output location: " << output_dir << endl;
+	cout << "Output location: " << directory << endl;
 	cout << "*********************************************************" << endl;
 
-	ofstream f_stream;
-	string f_location = output_dir + "data-types.h";
+	CodeEmitter f_stream;
+	string f_location = directory + "data-types.h";
 	f_stream.open(f_location, ios::out);
 	string temp_string;
 
-	bool quantized = data_type_mode_detail == "eight-bit-int" || data_type_mode_detail == "default_int8_t";
+	bool quantized = QuantizedDetail();
 
 	//AddToCFile_Text(f_stream, "#pragma once");
 	AddToCFile_Text(f_stream, "#ifndef _DATA_TYPES_H");
@@ -2017,7 +3369,7 @@ void GenerateHFileDataTypes() {
 		AddToCFile_EmptyLine(f_stream);
 	}
 
-	if (add_main_function && (data_type_mode_fixed_point_single || data_type_mode_fixed_point_multi) && data_type_mode_detail != "eight-bit-int" && data_type_mode_detail != "default_int8_t") {
+	if (add_main_function && (data_type_mode_fixed_point_single || data_type_mode_fixed_point_multi) && !QuantizedDetail()) {
 		AddToCFile_Text(f_stream, "#ifdef _MSC_VER");
 		AddToCFile_Text(f_stream, "#include <algorithm>");
 		AddToCFile_Text(f_stream, "#endif");
@@ -2037,7 +3389,7 @@ void GenerateHFileDataTypes() {
 		AddToCFile_Text(f_stream, "typedef float DataType_weights; ");
 
 		for (size_t i = 0; i < Layers.size(); i++) {
-			if (Layers[i]->layer_type == CONV2D || Layers[i]->layer_type == DENSE) {
+			if (Layers[i]->HasWeights() || Layers[i]->AveragePooling()) {
 				AddToCFile_Text(f_stream, "");
 				AddToCFile_Text(f_stream, "typedef float DataType_temp_element" + to_string(i + 1) + ";");
 				//if (Layers[i]->layer_type == CONV2D && Layers[i]->padding_type == PADDING_SAME) AddToCFile_Text(f_stream, "typedef float DataType_Zero" + to_string(i + 1) + ";");
@@ -2108,10 +3460,25 @@ void GenerateHFileDataTypes() {
 			//AddToCFile_Text(f_stream, "typedef int64_t DataType_Zero;");
 		}
 
+		if (dsp_packing) {
+			AddToCFile_EmptyLine(f_stream);
+			AddToCFile_Text(f_stream, "//DSP packing: 8-bit input x 27-bit packed weights (two 8-bit weights, 18 bits apart)");
+			AddToCFile_Text(f_stream, "#ifdef _HLS_RUN");
+			AddToCFile_Text(f_stream, "#include <ap_int.h>");
+			AddToCFile_Text(f_stream, "typedef ap_int<18> DataType_dsp_input;");
+			AddToCFile_Text(f_stream, "typedef ap_int<27> DataType_dsp_packed;");
+			AddToCFile_Text(f_stream, "typedef ap_int<45> DataType_dsp_product;");
+			AddToCFile_Text(f_stream, "#else");
+			AddToCFile_Text(f_stream, "typedef int64_t DataType_dsp_input;");
+			AddToCFile_Text(f_stream, "typedef int32_t DataType_dsp_packed;");
+			AddToCFile_Text(f_stream, "typedef int64_t DataType_dsp_product;");
+			AddToCFile_Text(f_stream, "#endif");
+		}
+
 		AddToCFile_EmptyLine(f_stream);
 		AddToCFile_Text(f_stream, "typedef DataType DataType_relu;");
 		AddToCFile_EmptyLine(f_stream);
-		if (data_type_mode_detail != "eight-bit-int" && data_type_mode_detail != "default_int8_t")	{
+		if (!QuantizedDetail())	{
 			AddToCFile_Text(f_stream, "typedef DataType DataType_input;");
 			AddToCFile_Text(f_stream, "typedef DataType DataType_weights;");
 		/* if (biases_enabled) */ AddToCFile_Text(f_stream, "typedef DataType DataType_biases;");
@@ -2119,17 +3486,33 @@ void GenerateHFileDataTypes() {
 		else {
 			AddToCFile_Text(f_stream, "typedef DataType_short DataType_input;");
 			AddToCFile_Text(f_stream, "typedef DataType_short DataType_weights;");
+			if (PackedWeightBits()) AddToCFile_Text(f_stream, "typedef uint8_t DataType_weights_packed; //" + to_string(8 / PackedWeightBits()) + " weights (" + data_type_mode_detail + ") per byte");
 		/* if (biases_enabled) */ AddToCFile_Text(f_stream, "typedef DataType DataType_biases;");
 		}
 
+		if (quantized && !accumulator_width.empty()) {
+			AddToCFile_EmptyLine(f_stream);
+			AddToCFile_Text(f_stream, "#ifdef _HLS_RUN");
+			AddToCFile_Text(f_stream, "#include <ap_int.h>");
+			AddToCFile_Text(f_stream, "#endif");
+		}
+
 		for (size_t i = 0; i < Layers.size(); i++) {
-			bool conv_or_dense = Layers[i]->layer_type == CONV2D || Layers[i]->layer_type == DENSE;
+			bool conv_or_dense = Layers[i]->HasWeights();
 			bool last_layer = i == Layers.size() - 1;
 			string layer_output_name = (last_layer ? ((string)"output") : ("Layer" + to_string(i + 1)));
 
 			AddToCFile_EmptyLine(f_stream);
 
-			if (conv_or_dense) {
+			if (conv_or_dense && quantized && !accumulator_width.empty()) {
+				int accumulator_bits = AccumulatorBits(i);
+				AddToCFile_Text(f_stream, "#ifdef _HLS_RUN");
+				AddToCFile_Text(f_stream, "typedef ap_int<" + to_string(accumulator_bits) + "> DataType_temp_element" + to_string(i + 1) + ";");
+				AddToCFile_Text(f_stream, "#else");
+				AddToCFile_Text(f_stream, "typedef " + AccumulatorCType(accumulator_bits) + " DataType_temp_element" + to_string(i + 1) + ";");
+				AddToCFile_Text(f_stream, "#endif");
+			}
+			else if (conv_or_dense || Layers[i]->AveragePooling()) { //Average pooling: the sum of the window
 				AddToCFile_Text(f_stream, "typedef DataType DataType_temp_element" + to_string(i + 1) + ";");
 				//if (Layers[i]->layer_type == CONV2D && Layers[i]->padding_type == PADDING_SAME) AddToCFile_Text(f_stream, "typedef DataType_Zero DataType_Zero" + to_string(i + 1) + ";");
 			}
@@ -2164,7 +3547,10 @@ void GenerateHFileDataTypes() {
 		AddToCFile_EmptyLine(f_stream);
 	}
 
-	if (data_type_mode_fixed_point_multi) {
+	if (data_type_mode_fixed_point_multi && !analysis_data.is_null()) {
+		GenerateHFileDataTypesFromAnalysis(f_stream, data_type_mode_all, per_layer_fractional_bits);
+	}
+	else if (data_type_mode_fixed_point_multi) {
 		if (data_type_mode_all) AddToCFile_Text(f_stream, "#ifdef FIXEDPOINT_DATATYPE_MULTI");
 		if (add_main_function) {
 			AddToCFile_Text(f_stream, "#ifndef __linux__");
@@ -2300,11 +3686,16 @@ void GenerateHFileDataTypes() {
 
 			string data_type_fixed_zero = "ap_fixed<FX_SIZE_W*2, " + to_string(datatype_previous_layer_size) + "+" + to_string(datatype_weights_size) + ">"; //used for temp_element
 
-			if (Layers[i]->layer_type == CONV2D || Layers[i]->layer_type == DENSE) {
+			if (Layers[i]->HasWeights()) {
 				AddToCFile_Text(f_stream, "");
 				AddToCFile_Text(f_stream, "typedef " + data_type_temp_element + " DataType_temp_element" + to_string(i + 1) + ";");
 				//if (Layers[i]->layer_type == CONV2D && Layers[i]->padding_type == PADDING_SAME)  AddToCFile_Text(f_stream, "typedef " + data_type_fixed_zero + " DataType_Zero" + to_string(i + 1) + ";");
 			}
+			else if (Layers[i]->AveragePooling()) { //The sum of the window needs log2(window) more integer bits than its input
+				int window_bits = (int)ceil(log2(Layers[i]->kernel_size_rows * Layers[i]->kernel_size_cols));
+				AddToCFile_Text(f_stream, "");
+				AddToCFile_Text(f_stream, "typedef ap_fixed<FX_SIZE_W+" + to_string(window_bits) + ", " + to_string(integer_part_size) + "+" + to_string(window_bits) + "> DataType_temp_element" + to_string(i + 1) + ";");
+			}
 			AddToCFile_Text(f_stream, "typedef " + data_type_ufixed + " DataType_" + ((i == Layers.size() - 1) ? ((string)"output") : ("Layer" + to_string(i + 1))) + ";");
 			datatype_previous_layer_size = integer_part_size;
 		}
@@ -2317,14 +3708,218 @@ void GenerateHFileDataTypes() {
 	f_stream.close();
 }
 
+//analysis-data-file format: {"<layer number>": {"<element>": {"min": -1.5, "max": 3.2, "log2-histogram": {"<bits>": count, ...}}, ...}, ...}
+//<element> is the STORE_DATA name (inputs, weights, biases, temp_element, LayerOutput) and <bits> is floor(log2(|value|)) + 1 for nonzero values
+//The testbench of store-analysis-data writes this file (ANALYSIS_DATA_FILE_NAME), see AddToCFile_AnalysisRangeFunctions
+
+//store-analysis-data: STORE_DATA also adds each value to the range of its element. The ranges cover all the images of the run and are written by
+//ExportRanges in the analysis-data-file format, so the file can be passed to fixed-point-multi as it is.
+void AddToCFile_AnalysisRangeFunctions(CodeEmitter &f_stream) {
+	AddToCFile_Text(f_stream, "#include <cmath>");
+	AddToCFile_Text(f_stream, "#include <mutex>");
+	AddToCFile_Text(f_stream, "struct AnalysisRange { float min, max; map<int, long long> log2_histogram; };");
+	AddToCFile_Text(f_stream, "map<int, map<string, AnalysisRange>> analysis_ranges; //Layer number -> STORE_DATA element -> range");
+	AddToCFile_Text(f_stream, "mutex analysis_ranges_mutex; //Predict runs in several threads");
+	AddToCFile_Text(f_stream, "void StoreRange(int layer, const char *element, float value)");
+	AddToCFile_Text(f_stream, "{");
+	int current_indent = 1;
+	AddToCFile_Text(f_stream, "lock_guard<mutex> lock(analysis_ranges_mutex);", current_indent);
+	AddToCFile_Text(f_stream, "auto range = analysis_ranges[layer].insert({element, {value, value, {}}}).first;", current_indent);
+	AddToCFile_Text(f_stream, "range->second.min = min(range->second.min, value);", current_indent);
+	AddToCFile_Text(f_stream, "range->second.max = max(range->second.max, value);", current_indent);
+	AddToCFile_Text(f_stream, "if (value != 0) range->second.log2_histogram[(int)floor(log2(fabs(value))) + 1]++;", current_indent);
+	AddToCFile_Text(f_stream, "}");
+	AddToCFile_Text(f_stream, "void ExportRanges(string file_name)");
+	AddToCFile_Text(f_stream, "{");
+	AddToCFile_Text(f_stream, "FILE *file = fopen(file_name.c_str(), \"w\");", current_indent);
+	AddToCFile_Text(f_stream, "if (!file) return;", current_indent);
+	AddToCFile_Text(f_stream, "const char *layer_separator = \"{\\n\";", current_indent);
+	AddToCFile_Text(f_stream, "for (auto &layer : analysis_ranges)", current_indent);
+	AddToCFile_Text(f_stream, "{", current_indent++);
+	AddToCFile_Text(f_stream, R"(fprintf(file, "%s\"%d\": {", layer_separator, layer.first);)", current_indent);
+	AddToCFile_Text(f_stream, "const char *element_separator = \"\";", current_indent);
+	AddToCFile_Text(f_stream, "for (auto &element : layer.second)", current_indent);
+	AddToCFile_Text(f_stream, "{", current_indent++);
+	AddToCFile_Text(f_stream, R"(fprintf(file, "%s\"%s\": {\"min\": %.9g, \"max\": %.9g, \"log2-histogram\": {", element_separator, element.first.c_str(), element.second.min, element.second.max);)", current_indent);
+	AddToCFile_Text(f_stream, "const char *bits_separator = \"\";", current_indent);
+	AddToCFile_Text(f_stream, "for (auto &bits : element.second.log2_histogram)", current_indent);
+	AddToCFile_Text(f_stream, "{", current_indent++);
+	AddToCFile_Text(f_stream, R"(fprintf(file, "%s\"%d\": %lld", bits_separator, bits.first, bits.second);)", current_indent);
+	AddToCFile_Text(f_stream, "bits_separator = \", \";", current_indent);
+	AddToCFile_Text(f_stream, "}", --current_indent);
+	AddToCFile_Text(f_stream, "fprintf(file, \"}}\");", current_indent);
+	AddToCFile_Text(f_stream, "element_separator = \", \";", current_indent);
+	AddToCFile_Text(f_stream, "}", --current_indent);
+	AddToCFile_Text(f_stream, "fprintf(file, \"}\");", current_indent);
+	AddToCFile_Text(f_stream, "layer_separator = \",\\n\";", current_indent);
+	AddToCFile_Text(f_stream, "}", --current_indent);
+	AddToCFile_Text(f_stream, "fprintf(file, \"%s}\\n\", analysis_ranges.empty() ? \"{\" : \"\\n\");", current_indent);
+	AddToCFile_Text(f_stream, "fclose(file);", current_indent);
+	AddToCFile_Text(f_stream, "}");
+}
+
+bool AnalysisDataExists(int layer_number, string element) {
+	string layer_key = to_string(layer_number);
+	return analysis_data.contains(layer_key) && analysis_data[layer_key].contains(element);
+}
+
+//Minimum integer bits (sign included if is_signed) for the element. Elements missing in the analysis data get 16 bits.
+int AnalysisIntegerBits(int layer_number, string element, bool is_signed) {
+	if (!AnalysisDataExists(layer_number, element)) {
+		INFOLOG("No analysis data for " + element + " of layer " + to_string(layer_number) + ", 16 integer bits used");
+		return 16;
+	}
+	json& data = analysis_data[to_string(layer_number)][element];
+
+	double max_abs = max(fabs(data.value("min", 0.0)), fabs(data.value("max", 0.0)));
+	int magnitude_bits = max_abs > 0 ? (int)floor(log2(max_abs)) + 1 : 0;
+
+	if (overflow_probability > 0 && data.contains("log2-histogram")) {
+		map<int, double> histogram;
+		double total = 0;
+		for (auto& it : data["log2-histogram"].items()) {
+			histogram[stoi(it.key())] += it.value().get<double>();
+			total += it.value().get<double>();
+		}
+
+		//The smallest size for which the values that do not fit stay within the overflow probability
+		double overflow = total;
+		for (auto it = histogram.begin(); it != histogram.end() && total > 0; ++it) {
+			overflow -= it->second;
+			if (overflow / total <= overflow_probability) {
+				magnitude_bits = min(magnitude_bits, it->first);
+				break;
+			}
+		}
+	}
+
+	return max(1, magnitude_bits + (is_signed ? 1 : 0));
+}
+
+bool AnalysisIsSigned(int layer_number, string element) {
+	if (!AnalysisDataExists(layer_number, element)) return true;
+	return analysis_data[to_string(layer_number)][element].value("min", 0.0) < 0;
+}
+
+//The sum of N products of Bi and Bw bit signed values of a quantized Conv2D/Dense layer fits in Bi + Bw + ceil(log2(N)) bits
+int AccumulatorProductBits(int layer_index) {
+	int input_bits = 8;
+	int weight_bits = PackedWeightBits() ? max(2, PackedWeightBits()) : 8; //binary weights are -1 or 1
+	return input_bits + weight_bits + (int)ceil(log2(max(1, Layers[layer_index]->ReductionLength())));
+}
+
+//Signed bits of the whole range (min/max) of an element in analysis-data-file. Unlike AnalysisIntegerBits, overflow-probability does not
+//clip it: the accumulators are ap_int/intN_t types, which wrap around instead of saturating.
+int AnalysisRangeBits(int layer_number, string element) {
+	json& data = analysis_data[to_string(layer_number)][element];
+	double max_abs = max(fabs(data.value("min", 0.0)), fabs(data.value("max", 0.0)));
+	return (max_abs > 0 ? (int)floor(log2(max_abs)) + 1 : 0) + 1;
+}
+
+//Bits of the biases of a quantized Conv2D/Dense layer (sign included): the exact range of analysis-data-file, otherwise accumulator-bias-bits,
+//by default the product width. The loaded biases are saturated to these bits (ClampBiases), so the int32 biases cannot widen the accumulator.
+int AccumulatorBiasBits(int layer_index) {
+	int layer_number = layer_index + 1;
+	if (AnalysisDataExists(layer_number, "biases")) return AnalysisRangeBits(layer_number, "biases"); //All biases are stored, so the range is exact
+	return accumulator_bias_bits > 0 ? accumulator_bias_bits : AccumulatorProductBits(layer_index);
+}
+
+//Accumulator of a quantized Conv2D/Dense layer: adding the bias to the sum of products needs one more bit than the wider of the two.
+//accumulator-width observed also limits it to the whole temp_element range of analysis-data-file plus one bit.
+int AccumulatorBits(int layer_index) {
+	int layer_number = layer_index + 1;
+	int bits = max(AccumulatorBiasBits(layer_index), AccumulatorProductBits(layer_index)) + 1;
+	if (accumulator_width == "observed" && AnalysisDataExists(layer_number, "temp_element"))
+		bits = min(bits, AnalysisRangeBits(layer_number, "temp_element") + 1);
+	return bits;
+}
+
+string AccumulatorCType(int bits) {
+	if (bits <= 8) return "int8_t";
+	if (bits <= 16) return "int16_t";
+	if (bits <= 32) return "int32_t";
+	return "int64_t";
+}
+
+//Saturating types: the values left out by overflow-probability (or outside the analysed range) are clipped instead of wrapping around (AP_WRAP)
+string FixedPointType(int integer_bits, bool is_signed, string fractional_bits_macro) {
+	return string(is_signed ? "ap_fixed" : "ap_ufixed") + "<" + to_string(integer_bits) + "+" + fractional_bits_macro + ", " + to_string(integer_bits) + ", AP_TRN, AP_SAT>";
+}
+
+void GenerateHFileDataTypesFromAnalysis(CodeEmitter &f_stream, bool data_type_mode_all, const vector<int> &per_layer_fractional_bits) {
+	if (data_type_mode_all) AddToCFile_Text(f_stream, "#ifdef FIXEDPOINT_DATATYPE_MULTI");
+	if (add_main_function) {
+		AddToCFile_Text(f_stream, "#ifndef __linux__");
+		AddToCFile_Text(f_stream, "#pragma warning(push, 0)");
+		AddToCFile_Text(f_stream, "#endif");
+	}
+	AddToCFile_Text(f_stream, "#include <ap_fixed.h>");
+	if (add_main_function) {
+		AddToCFile_Text(f_stream, "#ifndef __linux__");
+		AddToCFile_Text(f_stream, "#pragma warning(pop)");
+		AddToCFile_Text(f_stream, "#endif");
+	}
+	AddToCFile_EmptyLine(f_stream);
+
+	AddToCFile_Text(f_stream, "//Integer bits from the analysis data, overflow probability: " + (map_options.count("overflow-probability") ? map_options["overflow-probability"] : "0"));
+	AddToCFile_Text(f_stream, "#define FX_SIZE_F 		" + to_string(fractional_bits));
+	bool layer_macros = !per_layer_fractional_bits.empty();
+	if (layer_macros && per_layer_fractional_bits.size() != Layers.size()) {
+		ERRORLOGT("layer-fractional-bits ignored since it does not have one value per layer");
+		layer_macros = false;
+	}
+	if (layer_macros) {
+		for (size_t i = 0; i < Layers.size(); i++) AddToCFile_Text(f_stream, "#define FX_SIZE_F_LAYER" + to_string(i + 1) + " 		" + to_string(per_layer_fractional_bits[i]));
+	}
+	AddToCFile_EmptyLine(f_stream);
+
+	//Weights and biases share one type in the forward function, so the widest layer decides
+	int weights_bits = 1, biases_bits = 1, temp_element_bits = 1;
+	for (size_t i = 0; i < Layers.size(); i++) {
+		if (!Layers[i]->HasWeights()) continue;
+		weights_bits = max(weights_bits, AnalysisIntegerBits(i + 1, "weights", true));
+		if (biases_enabled) biases_bits = max(biases_bits, AnalysisIntegerBits(i + 1, "biases", true));
+		temp_element_bits = max(temp_element_bits, AnalysisIntegerBits(i + 1, "temp_element", true));
+	}
+
+	bool input_signed = AnalysisIsSigned(1, "inputs");
+	AddToCFile_Text(f_stream, "typedef " + FixedPointType(temp_element_bits, true) + " DataType_relu;");
+	AddToCFile_EmptyLine(f_stream);
+	AddToCFile_Text(f_stream, "typedef " + FixedPointType(AnalysisIntegerBits(1, "inputs", input_signed), input_signed) + " DataType_input;");
+	AddToCFile_Text(f_stream, "typedef " + FixedPointType(weights_bits, true) + " DataType_weights;");
+	/*if (biases_enabled)*/ AddToCFile_Text(f_stream, "typedef " + FixedPointType(biases_bits, true) + " DataType_biases;");
+
+	string previous_layer_type = FixedPointType(16, true);
+	for (size_t i = 0; i < Layers.size(); i++) {
+		int layer_number = i + 1;
+		bool conv_or_dense = Layers[i]->HasWeights();
+		string layer_type = previous_layer_type; //Pooling and flatten keep the range of their input when there is no data
+		string fractional_bits_macro = layer_macros ? "FX_SIZE_F_LAYER" + to_string(layer_number) : "FX_SIZE_F";
+
+		if (conv_or_dense || Layers[i]->AveragePooling()) {
+			AddToCFile_Text(f_stream, "");
+			AddToCFile_Text(f_stream, "typedef " + FixedPointType(AnalysisIntegerBits(layer_number, "temp_element", true), true, fractional_bits_macro) + " DataType_temp_element" + to_string(layer_number) + ";");
+		}
+		if (conv_or_dense || AnalysisDataExists(layer_number, "LayerOutput")) {
+			bool is_signed = AnalysisIsSigned(layer_number, "LayerOutput");
+			layer_type = FixedPointType(AnalysisIntegerBits(layer_number, "LayerOutput", is_signed), is_signed, fractional_bits_macro);
+		}
+		AddToCFile_Text(f_stream, "typedef " + layer_type + " DataType_" + ((i == Layers.size() - 1) ? ((string)"output") : ("Layer" + to_string(layer_number))) + ";");
+		previous_layer_type = layer_type;
+	}
+	if (data_type_mode_all) AddToCFile_Text(f_stream, "#endif");
+	AddToCFile_EmptyLine(f_stream, 2);
+}
+
 void GenerateHFileParamList() {
-	ofstream f_stream;
+	CodeEmitter f_stream;
 	string f_location = output_dir + "param-list.h";
 	f_stream.open(f_location, ios::out);
 	string temp_string;
 
   int layers_size = Layers.size();
-	bool quantized = data_type_mode_fixed_point_single && (data_type_mode_detail == "eight-bit-int" || data_type_mode_detail == "default_int8_t");
+	bool quantized = QuantizedMode();
+	bool packed_weights = quantized && PackedWeightBits() != 0;
 
 	//AddToCFile_Text(f_stream, "#pragma once");
 	AddToCFile_Text(f_stream, "#ifndef _PARAM_LIST_H");
@@ -2337,12 +3932,7 @@ void GenerateHFileParamList() {
 	if (add_main_function) {
 		AddToCFile_Text(f_stream, "#ifndef _HLS_RUN");
 		if (quantized) {
-			bool conv_or_dense ;
-			int conv_or_dense_count = 0;
-			for(int i = 0; i < layers_size; i++) {
-				conv_or_dense = Layers[i]->layer_type == CONV2D || Layers[i]->layer_type == DENSE;
-				if (conv_or_dense) ++conv_or_dense_count;
-			}
+			int conv_or_dense_count = graph.quantized_layer_count;
 			AddToCFile_Text(f_stream, "DataType_IZP input_zero_points_src[" + to_string(conv_or_dense_count) + "];");
 			AddToCFile_Text(f_stream, "DataType_OZP output_zero_points_src[" + to_string(conv_or_dense_count) + "];");
 			AddToCFile_Text(f_stream, "DataType_ISF input_scale_factors_src[" + to_string(conv_or_dense_count) + "];");
@@ -2352,19 +3942,27 @@ void GenerateHFileParamList() {
 
 		for(int i = 0; i < layers_size; i++)	{
 			f_stream  << "//" << LayerTypesToString(Layers[i]->layer_type) << endl;
+			if (Layers[i]->batch_norm && BatchNormFolding())
+				f_stream  << "float batch_norm_" << i + 1 << "_src[4][" << Layers[i]->OutputChannels() << "]; //BatchNormalization: gamma, beta, moving mean, moving variance" << endl;
 			if(Layers[i]->layer_type == CONV2D)	{
 				f_stream  << "DataType_weights weights_" << i + 1 << "_src" << "[" + to_string(Layers[i]->kernel_size_rows) + "]"
 																																		<< "[" + to_string(Layers[i]->kernel_size_cols) + "]"
 																																		<< "[" + to_string(Layers[i]->input_size_z) + "]"
 																																		<< "[" + to_string(Layers[i]->output_size_z) + "]"
 																													<< ";" << endl;
+				if (packed_weights)
+					f_stream  << "DataType_weights_packed weights_" << i + 1 << "_packed_src" << "[" + to_string(Layers[i]->kernel_size_rows) + "]"
+																																		<< "[" + to_string(Layers[i]->kernel_size_cols) + "]"
+																																		<< "[" + to_string(Layers[i]->input_size_z) + "]"
+																																		<< "[" + to_string(PackedWeightsSize(Layers[i]->output_size_z)) + "]"
+																													<< ";" << endl;
+				if (SparseDensity(i)) {
+					for (string array : SparseWeightsArrays(i, "_src")) f_stream << array << ";" << endl;
+				}
 				/*if (biases_enabled)*/ f_stream  << "DataType_biases biases_" << i + 1 << "_src" << "[" + to_string(Layers[i]->output_size_z) + "];" << endl;
 
 				if (quantized) {
-					temp_string = "DataType_WSF weight_scales_#_src[@];";
-					temp_string = StringSubstituteAll(temp_string, "#", to_string(i + 1));
-					temp_string = StringSubstituteAll(temp_string, "@", to_string(Layers[i]->output_size_z));
-					AddToCFile_Text(f_stream, temp_string);
+					f_stream.LineTemplate("DataType_WSF weight_scales_#_src[@];", {{'#', to_string(i + 1)}, {'@', to_string(Layers[i]->output_size_z)}});
 				}
 
 				AddToCFile_EmptyLine(f_stream);
@@ -2373,13 +3971,27 @@ void GenerateHFileParamList() {
 				f_stream  << "DataType_weights weights_" << i + 1 << "_src" << "[" + to_string(Layers[i]->input_size_x) + "]"
 																																		<< "[" + to_string(Layers[i]->output_size_x) + "]"
 																													<< ";" << endl;
+				if (packed_weights)
+					f_stream  << "DataType_weights_packed weights_" << i + 1 << "_packed_src" << "[" + to_string(Layers[i]->input_size_x) + "]"
+																																		<< "[" + to_string(PackedWeightsSize(Layers[i]->output_size_x)) + "]"
+																													<< ";" << endl;
+				if (SparseDensity(i)) {
+					for (string array : SparseWeightsArrays(i, "_src")) f_stream << array << ";" << endl;
+				}
 				/*if (biases_enabled)*/ f_stream  << "DataType_biases biases_" << i + 1 << "_src" << "[" + to_string(Layers[i]->output_size_x) + "];" << endl;
 
 				if (quantized) {
-					temp_string = "DataType_WSF weight_scales_#_src[@];";
-					temp_string = StringSubstituteAll(temp_string, "#", to_string(i + 1));
-					temp_string = StringSubstituteAll(temp_string, "@", to_string(Layers[i]->output_size_x));
-					AddToCFile_Text(f_stream, temp_string);
+					f_stream.LineTemplate("DataType_WSF weight_scales_#_src[@];", {{'#', to_string(i + 1)}, {'@', to_string(Layers[i]->output_size_x)}});
+				}
+
+				AddToCFile_EmptyLine(f_stream);
+			}
+			else if (Layers[i]->HasWeights()) { //Depthwise and pointwise Conv2D: plain weights
+				f_stream  << "DataType_weights weights_" << i + 1 << "_src" << WeightDimensions(i) << ";" << endl;
+				/*if (biases_enabled)*/ f_stream  << "DataType_biases biases_" << i + 1 << "_src" << "[" + to_string(Layers[i]->OutputChannels()) + "];" << endl;
+
+				if (quantized) {
+					f_stream.LineTemplate("DataType_WSF weight_scales_#_src[@];", {{'#', to_string(i + 1)}, {'@', to_string(Layers[i]->OutputChannels())}});
 				}
 
 				AddToCFile_EmptyLine(f_stream);
@@ -2411,6 +4023,7 @@ void GenerateHFileParamList() {
 string LayerDataLocation(int pLayerNumber) {
   ASSERT(pLayerNumber >= 0);
 
+	if (pLayerNumber >= 1 && pLayerNumber <= (int)layer_data_locations.size()) return layer_data_locations[pLayerNumber - 1];
 	if (map_options.count("layer-data-location")) return map_options["layer-data-location"];
 
 	if (network_guess == "lenet") return "local";
@@ -2424,6 +4037,134 @@ string LayerDataLocation(int pLayerNumber) {
 	return "local";
 }
 
+//layer-data-location: auto
+//Chooses local or port for each layer output (0/1 knapsack): the local outputs must fit in on-chip-memory-budget, and the DDR traffic of the port outputs
+//(the write by the layer and the reads by the next layer, see CostInputReads) is minimized. Buffers are counted in BRAM18K blocks.
+void PlanLayerDataLocations() {
+	layer_data_locations.clear();
+	if (!map_options.count("layer-data-location") || map_options["layer-data-location"] != "auto") return;
+
+	long long budget = 0;
+	if (map_options.count("on-chip-memory-budget")) budget = stoll(map_options["on-chip-memory-budget"]);
+	else ERRORLOGT("layer-data-location: auto needs on-chip-memory-budget. All layer outputs are placed in ports.");
+
+	const int bram18k_bytes = 2304;
+	int layers_size = Layers.size();
+	int capacity = budget / bram18k_bytes;
+	int data_bits = CostDataBits();
+
+	vector<int> blocks(layers_size, 0);
+	vector<long long> traffic(layers_size, 0);
+	for (int i = 0; i < layers_size - 1; i++) {
+		long long elements = (long long)graph.OutputTensor(i).ElementCount() * batch_size;
+		long long bytes = (elements * data_bits + 7) / 8;
+		blocks[i] = (bytes + bram18k_bytes - 1) / bram18k_bytes;
+		long long reads = 0;
+		for (int consumer : graph.OutputTensor(i).consumers) {
+			if (Layers[consumer]->MergeLayer()) reads += elements; //Add and Concatenate read each input once
+			else reads += AxiStagedInput(consumer) ? (AxiTileReused(consumer) ? 0 : elements) : CostInputReads(consumer); //axi-interfaces: one burst read
+		}
+		traffic[i] = (elements + reads) * data_bits / 8;
+	}
+
+	//saved[i][c]: the most DDR traffic removed by placing some of the outputs 0..i-1 locally in c blocks
+	vector<vector<long long>> saved(layers_size, vector<long long>(capacity + 1, 0));
+	for (int i = 1; i < layers_size; i++)
+		for (int c = 0; c <= capacity; c++) {
+			saved[i][c] = saved[i - 1][c];
+			if (blocks[i - 1] <= c) saved[i][c] = std::max(saved[i][c], saved[i - 1][c - blocks[i - 1]] + traffic[i - 1]);
+		}
+
+	layer_data_locations.assign(layers_size, "port");
+	int c = capacity;
+	for (int i = layers_size - 1; i >= 1; i--) {
+		if (saved[i][c] == saved[i - 1][c]) continue;
+		layer_data_locations[i - 1] = "local";
+		c -= blocks[i - 1];
+	}
+
+	string plan;
+	for (int i = 0; i < layers_size - 1; i++) plan += (i ? ", " : "") + graph.OutputTensor(i).name + ": " + layer_data_locations[i];
+	INFOLOG("Layer data locations (" + to_string(capacity - c) + " of " + to_string(capacity) + " BRAM18K blocks): " + plan);
+}
+
+//Element type of the array of a layer output (quantized: only the requantized output is stored)
+string LayerOutputType(int layer_index) {
+	bool last_layer = layer_index == (int)Layers.size() - 1;
+	return "DataType_" + graph.OutputTensor(layer_index).data_type_suffix + (QuantizedMode() && !last_layer ? "_short" : "");
+}
+
+//The local layer outputs with disjoint lifetimes (see MemoryPlanningPass) share the arrays of forward: one array is declared for each shared buffer,
+//and the outputs are references to it. Outputs share an array only when they have the same dimensions and element type, so in fixed-point-multi
+//(a type per layer) each output keeps its own array. Fused outputs that are not stored and Flatten views need no array. The output of a fused Add
+//is written by its Conv2D-like layer, so it lives from that layer on and cannot share the array of the other operands of the Add.
+void PlanLocalBuffers() {
+	local_buffers.assign(graph.tensors.size(), -1);
+	if (single_layer) return;
+
+	int layers_size = Layers.size();
+	vector<TensorStorage> storage(graph.tensors.size());
+	for (int i = 0; i < layers_size - 1; i++) {
+		Layer *layer = Layers[i];
+		TensorStorage &output = storage[layer->output_tensor];
+		if (LayerDataLocation(i + 1) != "local" || FlattenView(i)) continue;
+		if (MaxPoolingFused(i) || GlobalPoolingFused(i) || AddFused(i)) continue; //Not stored
+
+		string element_type = data_type_mode_fixed_point_multi ? LayerOutputType(i) : "DataType_Layer" + string(QuantizedMode() ? "_short" : ""); //Same typedef for all layers
+		output.storage_class = element_type + BatchDimension() + graph.OutputTensor(i).Dimensions();
+		if (layer->fused_into >= 0 && (MaxPoolingFused(layer->fused_into) || AddFused(layer->fused_into))) output.first_write = layer->fused_into; //Declared and written by the Conv2D-like layer
+	}
+
+	int buffer_count;
+	vector<int> buffers = PlanTensorBuffers(graph, storage, buffer_count);
+
+	//Buffers of one output keep an array of their own, the others are numbered in the order of their first outputs
+	vector<int> tensor_count(buffer_count, 0), numbers(buffer_count, -1);
+	for (int buffer : buffers) if (buffer >= 0) tensor_count[buffer]++;
+	int shared_count = 0;
+	for (size_t t = 0; t < buffers.size(); t++) {
+		if (buffers[t] < 0 || tensor_count[buffers[t]] < 2) continue;
+		if (numbers[buffers[t]] < 0) numbers[buffers[t]] = shared_count++;
+		local_buffers[t] = numbers[buffers[t]];
+	}
+	if (dump_layers && shared_count) {
+		string plan;
+		for (size_t t = 0; t < buffers.size(); t++)
+			if (local_buffers[t] >= 0) plan += (plan.empty() ? "" : ", ") + graph.tensors[t].name + ": buffer" + to_string(local_buffers[t]);
+		INFOLOG("Local arrays shared by the layer outputs: " + plan);
+	}
+}
+
+//The shared array of a layer output (PlanLocalBuffers), -1: an array of its own
+int LocalBuffer(int layer_index) {
+	return local_buffers.empty() ? -1 : local_buffers[Layers[layer_index]->output_tensor];
+}
+
+//The arrays shared by the local layer outputs (PlanLocalBuffers), typed and sized as their first output
+void AddToCFile_LocalBuffers(CodeEmitter &f_stream, int current_indent) {
+	vector<bool> declared;
+	for (size_t t = 0; t < local_buffers.size(); t++) {
+		int buffer = local_buffers[t];
+		if (buffer < 0) continue;
+		if ((int)declared.size() <= buffer) declared.resize(buffer + 1, false);
+		if (declared[buffer]) continue;
+		declared[buffer] = true;
+		Tensor &tensor = graph.tensors[t];
+		AddToCFile_Text(f_stream, LayerOutputType(tensor.producer) + " buffer" + to_string(buffer) + BatchDimension() + tensor.Dimensions() + "; //Shared by the layer outputs with disjoint lifetimes", current_indent);
+	}
+	if (!declared.empty()) AddToCFile_EmptyLine(f_stream);
+}
+
+//Array of a layer output: a reference to its buffer when it shares an array (PlanLocalBuffers), only a comment for the port outputs (arguments of forward)
+void AddToCFile_LayerOutputDeclaration(CodeEmitter &f_stream, int layer_number, int current_indent) {
+	Tensor &output = graph.OutputTensor(layer_number);
+	string dimensions = BatchDimension() + output.Dimensions();
+	int buffer = LocalBuffer(layer_number);
+	if (LayerDataLocation(layer_number + 1) != "local") AddToCFile_Text(f_stream, "//" + LayerOutputType(layer_number) + " " + output.name + dimensions + ";", current_indent);
+	else if (buffer >= 0) AddToCFile_Text(f_stream, LayerOutputType(layer_number) + " (&" + output.name + ")" + dimensions + " = buffer" + to_string(buffer) + ";", current_indent);
+	else AddToCFile_Text(f_stream, LayerOutputType(layer_number) + " " + output.name + dimensions + ";", current_indent);
+}
+
 /*
 "design-source": "keras-file" or "keras-text"
 "layer-config": [{
@@ -2464,7 +4205,7 @@ void ReadOptions(int argc, char* argv[]) {
 	INFOLOG("Current directory: " + CurrentDirectory());
   extern string workspace_dir;
 	INFOLOG("Workspace directory: " + workspace_dir);
-  extern string output_dir;
+  extern thread_local string output_dir;
 	INFOLOG("Output directory: " + output_dir);
 
 	map<string, string> command_line_arguments;
@@ -2516,9 +4257,10 @@ void ReadOptions(int argc, char* argv[]) {
 						|| json_iterator_key == "design-source" 
 						|| json_iterator_key == "output-directory"
 						|| json_iterator_key == "network-name" 
-						|| json_iterator_key == "layer-data-location" //local, ports
+						|| json_iterator_key == "layer-data-location" //local, port, auto (per layer, within on-chip-memory-budget)
+						|| json_iterator_key == "on-chip-memory-budget" //Bytes available for the layer outputs with layer-data-location: auto
 						|| json_iterator_key == "data-type-mode" //floating-point, fixed-point-single, fixed-point-multi, all-modes (default)
-						|| json_iterator_key == "data-type-mode-detail" //eight-bit-int, ...
+						|| json_iterator_key == "data-type-mode-detail" //eight-bit-int, default_int8_t, four-bit-int, ternary, binary
 						|| json_iterator_key == "loop-hierarchy-labels" //numbers, names
 						|| json_iterator_key == "single-layer" //"1", "7", or 1, 7
 						|| json_iterator_key == "approximate-multipliers-configuration" //e.g., "10100111"
@@ -2532,6 +4274,35 @@ void ReadOptions(int argc, char* argv[]) {
 						|| json_iterator_key == "dump-layers" //on screen and file
 						|| json_iterator_key == "fault-simulation"
 						|| json_iterator_key == "approximate-multipliers"
+						|| json_iterator_key == "dsp-packing" //Two int8 MACs per multiplier (eight-bit-int only)
+						|| json_iterator_key == "accumulator-width" //minimal: per layer accumulator types from the bit widths, observed: also limited by analysis-data-file
+						|| json_iterator_key == "accumulator-bias-bits" //Bias bits assumed by accumulator-width when analysis-data-file has no biases range, default: the product width of the layer
+						|| json_iterator_key == "analysis-data-file" //Ranges/histograms for fixed-point-multi types
+						|| json_iterator_key == "overflow-probability" //e.g., "0.0001", used with analysis-data-file histograms
+						|| json_iterator_key == "fractional-bits" //Fractional bits of the types computed from analysis-data-file
+						|| json_iterator_key == "layer-fractional-bits" //e.g., "12,12,10,10,10,8,8,8", one value per layer
+						|| json_iterator_key == "bit-width-search" //Search layer-fractional-bits using search-command
+						|| json_iterator_key == "search-command" //e.g., "cd {dir} && make run IMAGES={images}", prints the Accuracy line of the testbench
+						|| json_iterator_key == "search-images" //Number of test images per evaluation, replaces {images}
+						|| json_iterator_key == "search-accuracy-drop" //Allowed accuracy drop (percent) from the full precision result
+						|| json_iterator_key == "search-threads" //Concurrent evaluations, default: number of cores
+						|| json_iterator_key == "sweep-threads" //Concurrent sweep variants, default: number of cores
+						|| json_iterator_key == "batch-size" //Images per forward call (batch loop inside the weight loops), default: 1
+						|| json_iterator_key == "axi-interfaces" //m_axi bundles for the arguments of forward, burst copies between the ports and local tiles
+						|| json_iterator_key == "axi-port-width" //Bits of the widened m_axi ports with axi-interfaces, default: 512
+						|| json_iterator_key == "weight-prefetch" //Conv2D weights copied to a tile per block of output channels, loaded while the previous block computes
+						|| json_iterator_key == "weight-prefetch-block" //Output channels per weight tile with weight-prefetch, default: 8 (a divisor of the layer channels is used)
+						|| json_iterator_key == "parallel-units" //Conv2D compute units splitting the output channels, e.g., "4" (all Conv2D layers) or "1,1,4,1,1,1,1,1" (one value per layer)
+						|| json_iterator_key == "systolic-dense" //PxQ systolic array for the Dense layers, e.g., "4x8" (all Dense layers) or "*,*,*,*,*,8x8,4x4,1x2" (one value per layer, *: plain loops)
+						|| json_iterator_key == "systolic-dense-dataflow" //weight-stationary (default) or output-stationary, one value or one value per layer
+						|| json_iterator_key == "sparse-weights" //Compressed (CSR) weights for pruned models: fraction of the weights that may be nonzero, e.g., "0.2" (all Conv2D/Dense layers) or "*,*,*,*,*,0.1,0.1,*" (one value per layer, *: dense)
+						|| json_iterator_key == "sparse-weights-threshold" //Weights with |w| <= threshold are pruned, default: 0 (zeros only). One value or one value per layer
+						|| json_iterator_key == "sparse-weights-block" //Weights per stored block (consecutive input channels/nodes), default: 1 (CSR), >1: blocked CSR
+						|| json_iterator_key == "dense-ox-block" //Output nodes accumulated together by the Dense layers with the ix-ox loop order, default: 8 (a divisor of the layer nodes is used)
+						|| json_iterator_key == "output-mode" //logits (default: the output vector), argmax (the class index) or topk:K (the indices of the K largest outputs)
+						|| json_iterator_key == "host-library" //net.h/net.cpp: C API (net_create, net_load_params, net_infer_batch, net_destroy) around forward()
+						|| json_iterator_key == "cost-model" //cost-model.json/csv: estimated cycles, DSPs, on-chip memory and DDR traffic per layer
+						|| json_iterator_key == "clock-mhz" //Clock used for the cost-model latency, default: 100
 					) {
 					ASSERT(json_iterator.value().is_string());
 
@@ -2568,6 +4339,12 @@ void ReadOptions(int argc, char* argv[]) {
 
 					//Save keras source to temp: NO, later, after that all processing is done, if necessary
 				}
+				else if (json_iterator_key == "sweep") {
+					//e.g., {"loop-orders": ["*#*#oz-ox-oy-iz-kx-ky|oz-oy-ox-iz-kx-ky#*#*#*#*#*"], "data-type-mode": ["floating-point", "fixed-point-single"]}
+					ASSERT(json_iterator.value().is_object());
+					map_options[json_iterator_key] = json_iterator.value().dump();
+					INFOLOG("JSON entry: " + json_iterator_key + ", Value: " + map_options[json_iterator_key]);
+				}
 				else if (json_iterator.key() == "layer-config") {
 					ERRORLOGT("layer-config parameter not supported yet. It can be implemented using keras-source-text");
 				}
@@ -2575,6 +4352,9 @@ void ReadOptions(int argc, char* argv[]) {
 		}
 	}
 
+	//Note: CurrentDirectory, which is called by FindFileFullPath, resets the default file locations that are set later
+	if (map_options.count("analysis-data-file")) map_options["analysis-data-file"] = FindFileFullPath(map_options["analysis-data-file"]);
+
 	if (!map_options.count("design-source")) {
 		if (!map_options.count("keras-source-text")) map_options["design-source"] = "keras-file";
 		else {
@@ -2646,6 +4426,13 @@ void ReadOptions(int argc, char* argv[]) {
 	log_location = map_options["log-location"];
 	INFOLOG("Log location: " + map_options["log-location"]);
 
+	ApplyOptionFlags();
+
+	return;
+}
+
+//Sets the option globals from map_options. Called by ReadOptions and for each sweep variant.
+void ApplyOptionFlags() {
 	network_name = "";
 	if (map_options.count("network-name")) {
 		network_name = map_options["network-name"];
@@ -2700,6 +4487,7 @@ void ReadOptions(int argc, char* argv[]) {
 	if (map_options.count("data-type-mode-detail"))
 		data_type_mode_detail = map_options["data-type-mode-detail"];
 
+	loop_orders.clear();
 	if (map_options.count("loop-orders")) {
 		loop_orders = SplitString(map_options["loop-orders"], "\n");
 	}
@@ -2716,7 +4504,138 @@ void ReadOptions(int argc, char* argv[]) {
 
 	if (map_options.count("create-deepcl-config-h")) create_deepcl_config_h = true; else create_deepcl_config_h = false;
 
-	return;
+	if (map_options.count("dsp-packing")) dsp_packing = true; else dsp_packing = false;
+	if (dsp_packing && !(data_type_mode_fixed_point_single && (data_type_mode_detail == "eight-bit-int" || data_type_mode_detail == "default_int8_t"))) {
+		ERRORLOGT("dsp-packing will be ignored since it is only supported with data-type-mode-detail eight-bit-int");
+		dsp_packing = false;
+	}
+	if (dsp_packing && approximate_multipliers) {
+		ERRORLOGT("dsp-packing will be ignored since approximate-multipliers is active");
+		dsp_packing = false;
+	}
+
+	if (approximate_multipliers && QuantizedMode() && PackedWeightBits()) {
+		ERRORLOGT("approximate-multipliers will be ignored since " + data_type_mode_detail + " weights do not use multipliers");
+		approximate_multipliers = false;
+	}
+
+	if (map_options.count("accumulator-width")) accumulator_width = map_options["accumulator-width"]; else accumulator_width = "";
+	if (!accumulator_width.empty() && accumulator_width != "minimal" && accumulator_width != "observed") {
+		ERRORLOGT("accumulator-width will be ignored since it is not minimal or observed: " + accumulator_width);
+		accumulator_width = "";
+	}
+	if (!accumulator_width.empty() && !QuantizedMode()) {
+		ERRORLOGT("accumulator-width will be ignored since it is only supported in the 8-bit integer modes");
+		accumulator_width = "";
+	}
+	if (map_options.count("accumulator-bias-bits")) accumulator_bias_bits = stoi(map_options["accumulator-bias-bits"]); else accumulator_bias_bits = 0;
+
+	analysis_data = json();
+	if (map_options.count("analysis-data-file")) {
+		string analysis_data_file = map_options["analysis-data-file"];
+		if (!FileExists(analysis_data_file))
+			ERRORLOGT("analysis-data-file does not exist: " + map_options["analysis-data-file"]);
+		else {
+			ifstream json_file_stream(analysis_data_file);
+			try
+			{
+				json_file_stream >> analysis_data;
+			}
+			catch (const std::exception& e)
+			{
+				ERRORLOGT(string("Reading analysis-data-file failed.") + e.what());
+				analysis_data = json();
+			}
+		}
+		if (!analysis_data.is_null() && !data_type_mode_fixed_point_multi && accumulator_width.empty()) INFOLOG("analysis-data-file is only used in fixed-point-multi mode and by accumulator-width");
+	}
+	if (map_options.count("overflow-probability")) overflow_probability = stod(map_options["overflow-probability"]); else overflow_probability = 0;
+	if (map_options.count("fractional-bits")) fractional_bits = stoi(map_options["fractional-bits"]); else fractional_bits = 12;
+	layer_fractional_bits.clear();
+	if (map_options.count("layer-fractional-bits")) {
+		for (string value : SplitString(map_options["layer-fractional-bits"], ",")) layer_fractional_bits.push_back(stoi(value));
+	}
+
+	if (map_options.count("host-library")) host_library = true; else host_library = false;
+	if (map_options.count("batch-size")) batch_size = stoi(map_options["batch-size"]); else batch_size = 1;
+	if (map_options.count("axi-interfaces")) axi_interfaces = true; else axi_interfaces = false;
+	if (map_options.count("axi-port-width")) axi_port_width = stoi(map_options["axi-port-width"]); else axi_port_width = 512;
+	if (axi_interfaces && (axi_port_width < 8 || (axi_port_width & (axi_port_width - 1)))) {
+		ERRORLOGT("axi-port-width should be a power of two, at least 8. 512 is used.");
+		axi_port_width = 512;
+	}
+	if (axi_interfaces && single_layer) {
+		ERRORLOGT("axi-interfaces will be ignored since it is not supported with single-layer");
+		axi_interfaces = false;
+	}
+	if (map_options.count("weight-prefetch")) weight_prefetch = true; else weight_prefetch = false;
+	if (map_options.count("weight-prefetch-block")) weight_prefetch_block = max(1, stoi(map_options["weight-prefetch-block"])); else weight_prefetch_block = 8;
+	if (weight_prefetch && (dsp_packing || PackedWeightBits() != 0)) {
+		ERRORLOGT("weight-prefetch will be ignored since it is not supported with dsp-packing and packed weights");
+		weight_prefetch = false;
+	}
+	parallel_units.clear();
+	if (map_options.count("parallel-units")) {
+		for (string value : SplitString(map_options["parallel-units"], ",")) parallel_units.push_back(stoi(value));
+	}
+	systolic_dense.clear();
+	systolic_dataflow.clear();
+	if (map_options.count("systolic-dense")) systolic_dense = SplitString(map_options["systolic-dense"], ",");
+	if (map_options.count("systolic-dense-dataflow")) systolic_dataflow = SplitString(map_options["systolic-dense-dataflow"], ",");
+	sparse_density.clear();
+	sparse_threshold.clear();
+	if (map_options.count("sparse-weights")) {
+		for (string value : SplitString(map_options["sparse-weights"], ",")) sparse_density.push_back(atof(value.c_str())); //*: 0, dense
+	}
+	if (map_options.count("sparse-weights-threshold")) {
+		for (string value : SplitString(map_options["sparse-weights-threshold"], ",")) sparse_threshold.push_back(atof(value.c_str()));
+	}
+	sparse_blocks.assign(1, map_options.count("sparse-weights-block") ? max(1, stoi(map_options["sparse-weights-block"])) : 1);
+	if (map_options.count("dense-ox-block")) dense_ox_block = max(1, stoi(map_options["dense-ox-block"])); else dense_ox_block = 8;
+	output_top_k = 0;
+	if (map_options.count("output-mode")) {
+		string output_mode = map_options["output-mode"];
+		if (output_mode == "argmax") output_top_k = 1;
+		else if (output_mode.substr(0, 5) == "topk:" && atoi(output_mode.c_str() + 5) > 0) output_top_k = atoi(output_mode.c_str() + 5);
+		else if (output_mode != "logits") ERRORLOGT("output-mode will be ignored since it is not logits, argmax or topk:K: " + output_mode);
+	}
+	if (map_options.count("cost-model")) cost_model = true; else cost_model = false;
+	if (map_options.count("clock-mhz")) clock_mhz = stod(map_options["clock-mhz"]); else clock_mhz = 100;
+
+	if (map_options.count("bit-width-search")) bit_width_search = true; else bit_width_search = false;
+	if (bit_width_search && (!data_type_mode_fixed_point_multi || analysis_data.is_null() || !add_main_function || !map_options.count("search-command"))) {
+		ERRORLOGT("bit-width-search will be ignored since it needs fixed-point-multi, analysis-data-file, add-main-function and search-command");
+		bit_width_search = false;
+	}
+}
+
+//Integer flow: int8 activations with int8 or sub-byte (packed) weights
+bool QuantizedDetail() {
+	return data_type_mode_detail == "eight-bit-int" || data_type_mode_detail == "default_int8_t" || PackedWeightBits() != 0;
+}
+
+bool QuantizedMode() {
+	return data_type_mode_fixed_point_single && QuantizedDetail();
+}
+
+//Bits per weight when several weights are packed in one byte, 0 when weights are not packed
+int PackedWeightBits() {
+	if (data_type_mode_detail == "four-bit-int") return 4;
+	if (data_type_mode_detail == "ternary") return 2;
+	if (data_type_mode_detail == "binary") return 1;
+	return 0;
+}
+
+//Number of bytes holding count packed weights
+string WeightDimensions(int layer_index) {
+	string dimensions;
+	for (int size : Layers[layer_index]->WeightShape()) dimensions += "[" + to_string(size) + "]";
+	return dimensions;
+}
+
+int PackedWeightsSize(int count) {
+	int weights_per_byte = 8 / PackedWeightBits();
+	return (count + weights_per_byte - 1) / weights_per_byte;
 }
 
 void SetNetworkGuess() {
@@ -2741,6 +4660,12 @@ void SetArbitraryParameters() {
 	//add_main_function = false;
 }
 
+//oz, oy and ox in any order (e.g., oy-oz-ox)
+bool IsOutputLoopsPermutation(string order) {
+	if (order.size() != 8 || order[2] != '-' || order[5] != '-') return false;
+	return order.find("oz") != string::npos && order.find("oy") != string::npos && order.find("ox") != string::npos;
+}
+
 void CheckAndCorrectLoopOrders() {
 	if (Layers.size() != loop_orders.size()) {
 		if (loop_orders.size() != 0) {
@@ -2753,6 +4678,9 @@ void CheckAndCorrectLoopOrders() {
 			else if (layer->layer_type == POOLING2D) loop_orders.push_back("oz-oy-ox-kx-ky");
 			else if (layer->layer_type == FLATTEN) loop_orders.push_back("oz-oy-ox");
 			else if (layer->layer_type == DENSE) loop_orders.push_back("ox-ix");
+			else if (layer->layer_type == DEPTHWISE_CONV2D) loop_orders.push_back("oz-oy-ox-kx-ky");
+			else if (layer->layer_type == POINTWISE_CONV2D) loop_orders.push_back("oz-oy-ox-iz");
+			else if (layer->MergeLayer()) loop_orders.push_back("ox-oy-oz");
 			else ASSERTA;
 		}
 	}
@@ -2779,6 +4707,23 @@ void CheckAndCorrectLoopOrders() {
 			else if (layer->layer_type == DENSE) {
 				if (loop_orders[i] == "default" || loop_orders[i] == "*") loop_orders[i] = "ox-ix";
 				ASSERTT(OccurancesInString(loop_orders[i], '-') == OccurancesInString("ox-ix", '-'), "Incorrect loop-order argument.");
+				if (loop_orders[i] != "ox-ix" && loop_orders[i] != "ix-ox") {ERRORLOGT("Incorrect loop-order argument will be ignored. Dense layers support ox-ix and ix-ox"); loop_orders[i] = "ox-ix";}
+			}
+			else if (layer->layer_type == DEPTHWISE_CONV2D) {
+				//No input channel loop: the output loops in any order, then the kernel loops
+				if (loop_orders[i] == "default" || loop_orders[i] == "*") loop_orders[i] = "oz-oy-ox-kx-ky";
+				if (!IsOutputLoopsPermutation(loop_orders[i].substr(0, 8)) || loop_orders[i].substr(8) != "-kx-ky") {ERRORLOGT("Incorrect loop-order argument will be ignored. DepthwiseConv2D layers support the orders of oz, oy and ox followed by kx-ky"); loop_orders[i] = "oz-oy-ox-kx-ky";}
+			}
+			else if (layer->layer_type == POINTWISE_CONV2D) {
+				//1x1 kernel: the output loops in any order followed by iz, or the GEMM form oy-ox-iz-oz (one accumulator per output channel of a pixel)
+				if (loop_orders[i] == "default" || loop_orders[i] == "*") loop_orders[i] = "oz-oy-ox-iz";
+				bool gemm_order = loop_orders[i] == "oy-ox-iz-oz" || loop_orders[i] == "ox-oy-iz-oz";
+				if (!gemm_order && (!IsOutputLoopsPermutation(loop_orders[i].substr(0, 8)) || loop_orders[i].substr(8) != "-iz")) {ERRORLOGT("Incorrect loop-order argument will be ignored. PointwiseConv2D layers support the orders of oz, oy and ox followed by iz, oy-ox-iz-oz and ox-oy-iz-oz"); loop_orders[i] = "oz-oy-ox-iz";}
+			}
+			else if (layer->MergeLayer()) {
+				//Element-wise: ox-oy-oz reads and writes the [x][y][z] arrays in order
+				if (loop_orders[i] == "default" || loop_orders[i] == "*") loop_orders[i] = "ox-oy-oz";
+				if (!IsOutputLoopsPermutation(loop_orders[i])) {ERRORLOGT("Incorrect loop-order argument will be ignored. Add and Concatenate layers support the orders of oz, oy and ox"); loop_orders[i] = "ox-oy-oz";}
 			}
 			else ASSERTA;
 			
@@ -2786,11 +4731,358 @@ void CheckAndCorrectLoopOrders() {
 		}
 	}
 
-	return;
+	return;
+}
+
+//batch-size: Conv2D layers need the accumulator outside the kernel loops (oz-oy-ox-iz-kx-ky, oz-ox-oy-iz-kx-ky)
+void CheckBatchSize() {
+	if (batch_size <= 1) {
+		batch_size = 1;
+		return;
+	}
+
+	string unsupported;
+	if (store_alanysis_data) unsupported = "store-analysis-data";
+	if (dsp_packing) unsupported = "dsp-packing";
+	if (fault_simulation) unsupported = "fault-simulation";
+	if (single_layer) unsupported = "single-layer";
+	for (size_t i = 0; i < Layers.size(); i++) {
+		string order = loop_orders[i].substr(3, 8);
+		if (Layers[i]->layer_type == CONV2D && order != "oy-ox-iz" && order != "ox-oy-iz") unsupported = "loop order " + loop_orders[i];
+	}
+
+	if (unsupported != "") {
+		ERRORLOGT("batch-size is not supported with " + unsupported + ". Batch size 1 is used.");
+		batch_size = 1;
+	}
+}
+
+//Add and Concatenate: the quantized modes have one scale and zero point per layer output, so the inputs of a merge layer would need a requantization
+//to a common scale, which is not generated. Returns false (and the reason in error) when no code can be generated.
+bool CheckMergeLayers(string &error) {
+	if (!QuantizedMode()) return true;
+	for (Layer *layer : Layers)
+		if (layer->MergeLayer()) {
+			error = LayerTypesToString(layer->layer_type) + " layers are not supported in the quantized modes (" + data_type_mode_detail + "). Use floating-point or fixed-point data types.";
+			ERRORLOGT(error);
+			return false;
+		}
+	return true;
+}
+
+//BatchNormalization: folded into the weights and biases of the preceding layer when the parameters are loaded (FoldBatchNorm), so forward has no BatchNormalization code.
+//The quantized modes load weights that the preprocessing step has already folded and quantized.
+void CheckBatchNormFolding() {
+	bool batch_norm = false;
+	for (Layer *layer : Layers) batch_norm = batch_norm || layer->batch_norm;
+	if (!batch_norm) return;
+
+	if (QuantizedMode()) {
+		INFOLOG("BatchNormalization: the quantized weights and biases are expected to be folded by the preprocessing step");
+		return;
+	}
+	if (!biases_enabled) {
+		ERRORLOGT("disable-biases will be ignored since the folded BatchNormalization needs the biases");
+		biases_enabled = true;
+	}
+}
+
+//accumulator-width: the accumulator types hold the biases of AccumulatorBiasBits, see AddToCFile_ClampBiasesFunction
+bool BiasClamping() {
+	return QuantizedMode() && !accumulator_width.empty() && biases_enabled;
+}
+
+bool BatchNormFolding() {
+	if (QuantizedMode()) return false;
+	for (Layer *layer : Layers)
+		if (layer->batch_norm) return true;
+	return false;
+}
+
+//parallel-units: one value per layer (a single value applies to all Conv2D layers), a divisor of the output channels
+void CheckParallelUnits() {
+	int layers_size = Layers.size();
+	if (parallel_units.empty()) return;
+	if (dsp_packing || PackedWeightBits() != 0) {
+		ERRORLOGT("parallel-units will be ignored since it is not supported with dsp-packing and packed weights");
+		parallel_units.clear();
+		return;
+	}
+	if (parallel_units.size() == 1) parallel_units.assign(layers_size, parallel_units[0]);
+	if ((int)parallel_units.size() != layers_size) {
+		ERRORLOGT("parallel-units needs one value or one value per layer. Will be ignored.");
+		parallel_units.clear();
+		return;
+	}
+
+	for (int i = 0; i < layers_size; i++) {
+		Layer *layer = Layers[i];
+		if (layer->layer_type != CONV2D || parallel_units[i] < 1) {
+			parallel_units[i] = 1;
+			continue;
+		}
+		int units = min(parallel_units[i], layer->output_size_z);
+		while (layer->output_size_z % units != 0) units--;
+		if (units != parallel_units[i]) INFOLOG("Layer " + to_string(i + 1) + ": " + to_string(units) + " parallel units (a divisor of " + to_string(layer->output_size_z) + " output channels)");
+		parallel_units[i] = units;
+	}
+}
+
+int ParallelUnits(int layer_index) {
+	return layer_index < (int)parallel_units.size() ? parallel_units[layer_index] : 1;
+}
+
+//systolic-dense: "PxQ" per layer (a single value applies to all Dense layers)
+//Weight-stationary arrays hold P input nodes x Q output nodes, output-stationary arrays hold P images x Q output nodes. P and Q are reduced to divisors of these sizes.
+void CheckSystolicDense() {
+	int layers_size = Layers.size();
+	systolic_rows.assign(layers_size, 0);
+	systolic_columns.assign(layers_size, 0);
+	if (systolic_dense.empty()) return;
+	if (dsp_packing || PackedWeightBits() != 0) {
+		ERRORLOGT("systolic-dense will be ignored since it is not supported with dsp-packing and packed weights");
+		return;
+	}
+	if (systolic_dense.size() == 1) systolic_dense.assign(layers_size, systolic_dense[0]);
+	if (systolic_dataflow.size() <= 1) systolic_dataflow.assign(layers_size, systolic_dataflow.empty() ? "weight-stationary" : systolic_dataflow[0]);
+	if ((int)systolic_dense.size() != layers_size || (int)systolic_dataflow.size() != layers_size) {
+		ERRORLOGT("systolic-dense and systolic-dense-dataflow need one value or one value per layer. Will be ignored.");
+		return;
+	}
+
+	for (int i = 0; i < layers_size; i++) {
+		Layer *layer = Layers[i];
+		vector<string> size = SplitString(systolic_dense[i], "x");
+		if (layer->layer_type != DENSE || size.size() != 2) continue;
+		int rows = atoi(size[0].c_str()), columns = atoi(size[1].c_str());
+		if (rows < 1 || columns < 1) continue;
+
+		if (systolic_dataflow[i] != "weight-stationary" && systolic_dataflow[i] != "output-stationary") {
+			ERRORLOGT("Unknown systolic-dense-dataflow " + systolic_dataflow[i] + ". weight-stationary is used.");
+			systolic_dataflow[i] = "weight-stationary";
+		}
+		int row_extent = SystolicOutputStationary(i) ? batch_size : layer->input_size_x;
+		int requested_rows = rows, requested_columns = columns;
+		rows = min(rows, row_extent);
+		while (row_extent % rows != 0) rows--;
+		columns = min(columns, layer->output_size_x);
+		while (layer->output_size_x % columns != 0) columns--;
+		if (rows != requested_rows || columns != requested_columns) INFOLOG("Layer " + to_string(i + 1) + ": " + to_string(rows) + "x" + to_string(columns) + " systolic array (divisors of " + (SystolicOutputStationary(i) ? "batch size " + to_string(row_extent) : to_string(row_extent) + " input nodes") + " and " + to_string(layer->output_size_x) + " output nodes)");
+		systolic_rows[i] = rows;
+		systolic_columns[i] = columns;
+	}
+}
+
+int SystolicRows(int layer_index) {
+	return layer_index < (int)systolic_rows.size() ? systolic_rows[layer_index] : 0;
+}
+
+int SystolicColumns(int layer_index) {
+	return layer_index < (int)systolic_columns.size() ? systolic_columns[layer_index] : 0;
+}
+
+bool SystolicOutputStationary(int layer_index) {
+	return layer_index < (int)systolic_dataflow.size() && systolic_dataflow[layer_index] == "output-stationary";
+}
+
+//sparse-weights: one density (and threshold) or one per layer. The compressed arrays are filled from the dense weights when they are loaded (see AddToCFile_SparsifyWeightsFunction).
+//Conv2D layers need the iz, kx and ky loops inside the output loops (oz-oy-ox-iz-kx-ky, oz-ox-oy-iz-kx-ky). Sparse layers use one compute nest (no weight-prefetch, parallel-units or systolic-dense).
+void CheckSparseWeights() {
+	int layers_size = Layers.size();
+	int block = sparse_blocks.empty() ? 1 : sparse_blocks[0];
+	sparse_blocks.assign(layers_size, block);
+	if (sparse_density.empty()) return;
+
+	string unsupported;
+	if (store_alanysis_data) unsupported = "store-analysis-data";
+	if (dsp_packing) unsupported = "dsp-packing";
+	if (PackedWeightBits() != 0) unsupported = "packed weights";
+	if (single_layer) unsupported = "single-layer";
+	if (sparse_density.size() == 1) sparse_density.assign(layers_size, sparse_density[0]);
+	if (sparse_threshold.size() <= 1) sparse_threshold.assign(layers_size, sparse_threshold.empty() ? 0 : sparse_threshold[0]);
+	if ((int)sparse_density.size() != layers_size || (int)sparse_threshold.size() != layers_size) unsupported = "a number of values other than one or one per layer";
+	if (unsupported != "") {
+		ERRORLOGT("sparse-weights will be ignored since it is not supported with " + unsupported);
+		sparse_density.clear();
+		return;
+	}
+
+	for (int i = 0; i < layers_size; i++) {
+		Layer *layer = Layers[i];
+		bool conv = layer->layer_type == CONV2D;
+		if ((!conv && layer->layer_type != DENSE) || sparse_density[i] <= 0) {
+			sparse_density[i] = 0;
+			continue;
+		}
+		string order = loop_orders[i].substr(3, 8);
+		if (conv && order != "oy-ox-iz" && order != "ox-oy-iz") {
+			INFOLOG("Layer " + to_string(i + 1) + ": dense weights (sparse-weights needs the iz, kx and ky loops inside the output loops, loop order " + loop_orders[i] + ")");
+			sparse_density[i] = 0;
+			continue;
+		}
+		sparse_density[i] = min(sparse_density[i], 1.0);
+
+		int block_extent = conv ? layer->input_size_z : layer->input_size_x;
+		block = min(sparse_blocks[i], block_extent);
+		while (block_extent % block != 0) block--;
+		if (block != sparse_blocks[i]) INFOLOG("Layer " + to_string(i + 1) + ": sparse weight blocks of " + to_string(block) + " (a divisor of " + to_string(block_extent) + (conv ? " input channels)" : " input nodes)"));
+		sparse_blocks[i] = block;
+
+		if (i < (int)parallel_units.size()) parallel_units[i] = 1;
+		if (i < (int)systolic_rows.size()) systolic_rows[i] = systolic_columns[i] = 0;
+	}
+}
+
+//ix-ox Dense layers: blocks of dense_ox_block output nodes (a divisor of the layer nodes). The layers computed by systolic-dense or sparse-weights,
+//and those with dsp-packing or store-analysis-data, keep the ox-ix loops.
+void CheckDenseInputReuse() {
+	int layers_size = Layers.size();
+	dense_ox_blocks.assign(layers_size, 0);
+	for (int i = 0; i < layers_size; i++) {
+		Layer *layer = Layers[i];
+		if (layer->layer_type != DENSE || loop_orders[i] != "ix-ox") continue;
+
+		string unsupported;
+		if (store_alanysis_data) unsupported = "store-analysis-data";
+		if (dsp_packing) unsupported = "dsp-packing";
+		if (SystolicRows(i)) unsupported = "systolic-dense";
+		if (SparseDensity(i) != 0) unsupported = "sparse-weights";
+		if (unsupported != "") {
+			INFOLOG("Layer " + to_string(i + 1) + ": ox-ix loop order (ix-ox is not supported with " + unsupported + ")");
+			loop_orders[i] = "ox-ix";
+			continue;
+		}
+
+		int block = min(dense_ox_block, layer->output_size_x);
+		while (layer->output_size_x % block != 0) block--;
+		if (block != dense_ox_block) INFOLOG("Layer " + to_string(i + 1) + ": blocks of " + to_string(block) + " output nodes (a divisor of " + to_string(layer->output_size_x) + ")");
+		dense_ox_blocks[i] = block;
+	}
+}
+
+int DenseOxBlock(int layer_index) {
+	return layer_index < (int)dense_ox_blocks.size() ? dense_ox_blocks[layer_index] : 0;
+}
+
+//argmax and topk:K are computed by the output write of the last layer, which must be a Dense layer. K is limited to its output nodes.
+void CheckOutputMode() {
+	if (!output_top_k) return;
+	Layer *layer = Layers.back();
+	string unsupported;
+	if (layer->layer_type != DENSE) unsupported = "a last layer other than Dense";
+	if (single_layer) unsupported = "single-layer";
+	if (store_alanysis_data) unsupported = "store-analysis-data";
+	if (unsupported != "") {
+		ERRORLOGT("output-mode will be ignored since it is not supported with " + unsupported);
+		output_top_k = 0;
+		return;
+	}
+	if (output_top_k > layer->output_size_x) {
+		INFOLOG("output-mode: the " + to_string(layer->output_size_x) + " output nodes are sorted (topk:" + to_string(output_top_k) + ")");
+		output_top_k = layer->output_size_x;
+	}
+}
+
+//Elements of the outputs argument of forward per image: the output vector, or the class indices of output-mode
+int OutputPortSize() {
+	return output_top_k ? output_top_k : graph.OutputTensor(Layers.size() - 1).ElementCount();
+}
+
+//output-mode: inserts value, the output node index, into the K largest outputs so far (top_values, largest first) and their indices (outputs).
+//The output nodes are written in increasing order, so the nodes before index fill the first min(index, K) entries. A value moves the smaller
+//entries (from its position on) one position down, ties keep the lower index first (as the argmax of Predict).
+string TopKAssignment(int layer_index, string value, string index, string loop_label) {
+	string n = to_string(layer_index + 1);
+	string base_for_label = "for" + n;
+	if (layer_index + 1 >= 10) base_for_label += "t";
+	string type = "DataType_output" + string(QuantizedMode() ? "_short" : "");
+	string top_values = "top_values" + BatchIndex(), outputs = "outputs" + BatchIndex();
+
+	if (output_top_k == 1)
+		return "{ " + type + " value = " + value + "; if (" + index + " == 0 || value > " + top_values + "[0]) { " + top_values + "[0] = value; " + outputs + "[0] = " + index + "; } }";
+
+	string text = "{\n";
+	text += "\t" + type + " value = " + value + ";\n";
+	text += "\tint index = " + index + ";\n";
+	text += "\tbool carry = true, shifting = false;\n";
+	text += "\t" + base_for_label + loop_label + ": for (int k = 0; k < " + to_string(output_top_k) + "; k++)\n";
+	text += "\t\tif (carry && (shifting || k >= " + index + " || value > " + top_values + "[k])) {\n";
+	text += "\t\t\t" + type + " next_value = " + top_values + "[k];\n";
+	text += "\t\t\tint next_index = " + outputs + "[k];\n";
+	text += "\t\t\t" + top_values + "[k] = value;\n";
+	text += "\t\t\t" + outputs + "[k] = index;\n";
+	text += "\t\t\tvalue = next_value;\n";
+	text += "\t\t\tindex = next_index;\n";
+	text += "\t\t\tshifting = true; //The moved entry is not smaller than the next ones\n";
+	text += "\t\t\tcarry = k < " + index + "; //Moved a valid entry down\n";
+	text += "\t\t}\n";
+	text += "}";
+	return text;
+}
+
+double SparseDensity(int layer_index) {
+	return layer_index < (int)sparse_density.size() ? sparse_density[layer_index] : 0;
+}
+
+int SparseBlock(int layer_index) {
+	return layer_index < (int)sparse_blocks.size() ? sparse_blocks[layer_index] : 1;
+}
+
+//Blocks per output channel (CSR row length when no weight is pruned)
+int SparseRowBlocks(int layer_index) {
+	Layer *layer = Layers[layer_index];
+	int reduction = layer->layer_type == CONV2D ? layer->kernel_size_rows * layer->kernel_size_cols * layer->input_size_z : layer->input_size_x;
+	return reduction / SparseBlock(layer_index);
+}
+
+//Stored blocks of all the output channels
+int SparseCapacity(int layer_index) {
+	Layer *layer = Layers[layer_index];
+	int channels = layer->layer_type == CONV2D ? layer->output_size_z : layer->output_size_x;
+	return max(1, (int)ceil(SparseDensity(layer_index) * SparseRowBlocks(layer_index) * channels));
+}
+
+//Bits of the fields of a Conv2D block index: kernel_x, kernel_y, first input channel of the block
+int SparseIndexBits(int count) {
+	int bits = 0;
+	while ((1 << bits) < count) bits++;
+	return bits;
+}
+
+string SparseIndexType(long long max_value) {
+	return max_value < 65536 ? "unsigned short" : "unsigned int";
+}
+
+//values: the weights of the stored blocks, index: input node or packed (kernel_x, kernel_y, input_z) of the first weight of the block, row_ptr: first block of each output channel
+vector<string> SparseWeightsArrays(int layer_index, string suffix) {
+	Layer *layer = Layers[layer_index];
+	bool conv = layer->layer_type == CONV2D;
+	int channels = conv ? layer->output_size_z : layer->output_size_x;
+	int capacity = SparseCapacity(layer_index), block = SparseBlock(layer_index);
+	long long max_index = conv ? 1LL << (SparseIndexBits(layer->kernel_size_rows) + SparseIndexBits(layer->kernel_size_cols) + SparseIndexBits(layer->input_size_z)) : layer->input_size_x;
+	string name = "weights_" + to_string(layer_index + 1);
+	return {
+		"DataType_weights " + name + "_values" + suffix + "[" + to_string(capacity) + "]" + (block > 1 ? "[" + to_string(block) + "]" : ""),
+		SparseIndexType(max_index) + " " + name + "_index" + suffix + "[" + to_string(capacity) + "]",
+		SparseIndexType(capacity) + " " + name + "_row_ptr" + suffix + "[" + to_string(channels + 1) + "]"
+	};
+}
+
+//Leading dimension of the layer data with batch-size, empty without it
+string BatchDimension() {
+	return batch_size > 1 ? "[" + to_string(batch_size) + "]" : "";
+}
+
+string BatchIndex() {
+	return batch_size > 1 ? "[batch]" : "";
+}
+
+string BatchLoop(string label) {
+	return label + ": for (int batch = 0; batch < " + to_string(batch_size) + "; batch++)";
 }
 
 void GenerateDeepClConfigH() {
-	ofstream f_stream;
+	CodeEmitter f_stream;
 	string f_location = output_dir + "layer_config.h";
 	f_stream.open(f_location, ios::out);
 	string temp_string;
@@ -2825,7 +5117,7 @@ void GenerateDeepClConfigH() {
 		int weights_sizes[4] = {0, 0, 0, 0};
 		int input_sizes[3] = {current_layer->input_size_x, current_layer->input_size_y, current_layer->input_size_z};
 		int bias_size = 0;
-		Layer *previous_layer = (i > 0?Layers[i-1]:nullptr);
+		Layer *previous_layer = graph.Producer(i);
 		if(current_layer->layer_type == CONV2D) {			
 			weights_sizes[0] =  current_layer->kernel_size_rows;
 			weights_sizes[1] =  current_layer->kernel_size_cols;
@@ -2882,19 +5174,22 @@ void GenerateDeepClConfigH() {
 		temp_string += to_string(output_sizes[0]) + ", ";
 		temp_string += to_string(output_sizes[1]) + ", ";
 		temp_string += to_string(output_sizes[2]) + ", ";
-		temp_string += to_string(current_layer->stride_size) + ", ";
-		temp_string += to_string(current_layer->padding_type == PADDING_SAME ? 1 : 0) + ", ";
+		//The configuration has one stride and one (symmetric) padding size per layer
+		if (current_layer->layer_type == CONV2D && (current_layer->stride_size_rows != current_layer->stride_size_cols || current_layer->kernel_size_rows != current_layer->kernel_size_cols || current_layer->kernel_size_rows % 2 == 0))
+			ERRORLOGT("Layer " + to_string(i + 1) + ": layer_config.h supports odd square kernels and equal strides only");
+		temp_string += to_string(current_layer->stride_size_rows) + ", ";
+		temp_string += to_string(current_layer->padding_type == PADDING_SAME ? (current_layer->kernel_size_rows - 1) / 2 : 0) + ", ";
 		temp_string += to_string(0) + ", "; //conv_split
 		temp_string += to_string(is_last_layer? 0 : 1) + ","; //conv_relu
 		AddToCFile_Text(f_stream, temp_string, current_indent);
 
 		temp_string = "";
-		bool next_layer_is_pooling = (!is_last_layer && Layers[i+1]->layer_type == POOLING2D);
+		bool next_layer_is_pooling = current_layer->fused_pooling >= 0;
 
 		Layer *next_layer;
 		Layer *temp_layer;
 		if (next_layer_is_pooling) {
-			next_layer = Layers[i+1];
+			next_layer = Layers[current_layer->fused_pooling];
 			temp_layer = next_layer;
 		} 
 		else {
@@ -2902,6 +5197,10 @@ void GenerateDeepClConfigH() {
 			temp_layer = current_layer;
 		};
 		int pool_sizes[3] = {temp_layer->output_size_x, temp_layer->output_size_y, temp_layer->output_size_z};
+		if (temp_layer->GlobalPooling()) {
+			pool_sizes[0] = pool_sizes[1] = 1;
+			pool_sizes[2] = temp_layer->output_size_x;
+		}
 		if (current_layer->layer_type == DENSE) {
 			pool_sizes[0] = current_layer->output_size_z;
 			pool_sizes[2] = current_layer->output_size_x;
@@ -2912,7 +5211,7 @@ void GenerateDeepClConfigH() {
 		temp_string += to_string(pool_sizes[1]) + ", ";
 		temp_string += to_string(pool_sizes[2]) + ", ";
 		temp_string += to_string(next_layer_is_pooling? next_layer->kernel_size_cols : 0) + ", ";
-		temp_string += to_string(next_layer_is_pooling? next_layer->stride_size : 0) + ",";
+		temp_string += to_string(next_layer_is_pooling? next_layer->stride_size_rows : 0) + ",";
 		AddToCFile_Text(f_stream, temp_string, current_indent);
 
 		AddToCFile_Text(f_stream, "0,", current_indent); //lrn_on
@@ -2963,4 +5262,1024 @@ void GenerateDeepClConfigH() {
 	AddToCFile_Text(f_stream, temp_string, current_indent);
 
 	f_stream.close();
-}
\ No newline at end of file
+}
+
+class BitWidthCandidate {
+public:
+	vector<int> fractional_bits; //Per layer
+	string directory;
+	double accuracy = -1;
+};
+
+//Runs search-command for one candidate and returns the accuracy (percent) printed by the testbench, -1 on failure
+double RunAccuracyCommand(string directory, string command, string images) {
+	command = StringSubstituteAll(command, "{dir}", directory);
+	command = StringSubstituteAll(command, "{images}", images);
+	string output_file = directory + "search-output.txt";
+	int result = system((command + " > \"" + output_file + "\" 2>&1").c_str());
+
+	ifstream f_stream(output_file);
+	stringstream output;
+	output << f_stream.rdbuf();
+	string output_text = output.str();
+
+	//The testbench prints: Accuracy: 9812 / 10000(98.120000%)
+	double accuracy = -1;
+	regex accuracy_regex(R"(Accuracy:[^\n]*\(([0-9.]+)%\))");
+	for (sregex_iterator it(output_text.begin(), output_text.end(), accuracy_regex); it != sregex_iterator(); ++it)
+		accuracy = stod((*it)[1].str());
+	if (result != 0) accuracy = -1;
+	return accuracy;
+}
+
+//Each candidate gets its own directory with the common main.cpp and param-list.h and its own data-types.h. The candidates are evaluated concurrently.
+//history: the candidates evaluated so far, which also numbers the directories
+void EvaluateBitWidthCandidates(vector<BitWidthCandidate> &candidates, vector<BitWidthCandidate> &history) {
+	string search_dir = output_dir + "bit-width-search" + string(1, filesystem::path::preferred_separator);
+
+	for (size_t c = 0; c < candidates.size(); c++) {
+		BitWidthCandidate &candidate = candidates[c];
+		candidate.directory = search_dir + to_string(history.size() + c + 1) + string(1, filesystem::path::preferred_separator);
+		filesystem::create_directories(candidate.directory);
+		filesystem::copy_file(output_dir + "main.cpp", candidate.directory + "main.cpp", filesystem::copy_options::overwrite_existing);
+		filesystem::copy_file(output_dir + "param-list.h", candidate.directory + "param-list.h", filesystem::copy_options::overwrite_existing);
+		GenerateHFileDataTypes(candidate.directory, candidate.fractional_bits);
+	}
+
+	int thread_count = map_options.count("search-threads") ? stoi(map_options["search-threads"]) : (int)thread::hardware_concurrency();
+	thread_count = max(1, min(thread_count, (int)candidates.size()));
+
+	//map_options is thread_local
+	string command = map_options["search-command"];
+	string images = map_options.count("search-images") ? map_options["search-images"] : "10000";
+
+	size_t next_candidate = 0;
+	mutex next_candidate_mutex;
+	vector<thread> threads;
+	for (int t = 0; t < thread_count; t++) {
+		threads.push_back(thread([&]() {
+			while (true) {
+				size_t index;
+				{
+					lock_guard<mutex> lock(next_candidate_mutex);
+					if (next_candidate >= candidates.size()) return;
+					index = next_candidate++;
+				}
+				candidates[index].accuracy = RunAccuracyCommand(candidates[index].directory, command, images);
+			}
+		}));
+	}
+	for (auto &th : threads) th.join();
+
+	for (auto &candidate : candidates) {
+		if (candidate.accuracy < 0) ERRORLOGT("No accuracy from search-command, see " + candidate.directory + "search-output.txt");
+		history.push_back(candidate);
+	}
+}
+
+//Sets the fractional bits of a Conv2D/Dense layer and of the pooling/flatten layers that follow it
+void SetLayerFractionalBits(vector<int> &bits, int layer_index, int value) {
+	bits[layer_index] = value;
+	for (size_t i = layer_index + 1; i < Layers.size() && !Layers[i]->HasWeights(); i++) bits[i] = value;
+}
+
+//Finds the smallest fractional bits per layer for which the accuracy drop stays within search-accuracy-drop
+//1. Reference: all layers with fractional-bits
+//2. Bisection of each Conv2D/Dense layer separately, the other layers keep full precision. The steps of all layers are evaluated together.
+//3. The layer results are combined. While the combination misses the target, all layers get one more bit.
+void RunBitWidthSearch() {
+	double accuracy_drop = map_options.count("search-accuracy-drop") ? stod(map_options["search-accuracy-drop"]) : 1.0;
+	vector<BitWidthCandidate> history, candidates(1);
+	vector<int> searched_layers;
+	for (size_t i = 0; i < Layers.size(); i++) 
+		if (Layers[i]->HasWeights()) searched_layers.push_back(i);
+
+	candidates[0].fractional_bits = vector<int>(Layers.size(), fractional_bits);
+	EvaluateBitWidthCandidates(candidates, history);
+	if (candidates[0].accuracy < 0) {
+		ERRORLOGT("bit-width-search stopped since the reference run failed");
+		return;
+	}
+	double target_accuracy = candidates[0].accuracy - accuracy_drop;
+	INFOLOG("bit-width-search reference accuracy: " + to_string(candidates[0].accuracy) + "%, target: " + to_string(target_accuracy) + "%");
+
+	vector<int> low(searched_layers.size(), 0), high(searched_layers.size(), fractional_bits); //high always meets the target
+	while (true) {
+		candidates.clear();
+		vector<int> candidate_layer;
+		for (size_t k = 0; k < searched_layers.size(); k++) {
+			if (low[k] >= high[k]) continue;
+			BitWidthCandidate candidate;
+			candidate.fractional_bits = vector<int>(Layers.size(), fractional_bits);
+			SetLayerFractionalBits(candidate.fractional_bits, searched_layers[k], (low[k] + high[k]) / 2);
+			candidates.push_back(candidate);
+			candidate_layer.push_back(k);
+		}
+		if (candidates.empty()) break;
+
+		EvaluateBitWidthCandidates(candidates, history);
+		for (size_t c = 0; c < candidates.size(); c++) {
+			int k = candidate_layer[c];
+			int mid = (low[k] + high[k]) / 2;
+			if (candidates[c].accuracy >= target_accuracy) high[k] = mid; else low[k] = mid + 1;
+		}
+	}
+
+	candidates.assign(1, BitWidthCandidate());
+	candidates[0].fractional_bits = vector<int>(Layers.size(), fractional_bits);
+	for (size_t k = 0; k < searched_layers.size(); k++) SetLayerFractionalBits(candidates[0].fractional_bits, searched_layers[k], high[k]);
+	vector<int> best_bits = vector<int>(Layers.size(), fractional_bits);
+	while (true) {
+		EvaluateBitWidthCandidates(candidates, history);
+		if (candidates[0].accuracy >= target_accuracy) {
+			best_bits = candidates[0].fractional_bits;
+			break;
+		}
+
+		bool increased = false;
+		for (size_t k = 0; k < searched_layers.size(); k++) {
+			int value = candidates[0].fractional_bits[searched_layers[k]];
+			if (value < fractional_bits) {
+				SetLayerFractionalBits(candidates[0].fractional_bits, searched_layers[k], value + 1);
+				increased = true;
+			}
+		}
+		if (!increased) break;
+	}
+
+	ofstream f_stream(output_dir + "bit-width-search.csv", ios::out);
+	f_stream << "candidate,accuracy,fractional bits" << endl;
+	for (auto &candidate : history) {
+		string bits_text;
+		for (size_t i = 0; i < candidate.fractional_bits.size(); i++) bits_text += (i ? " " : "") + to_string(candidate.fractional_bits[i]);
+		f_stream << candidate.directory << "," << candidate.accuracy << "," << bits_text << endl;
+	}
+	f_stream.close();
+
+	GenerateHFileDataTypes(output_dir, best_bits);
+
+	string bits_text;
+	for (size_t i = 0; i < best_bits.size(); i++) bits_text += (i ? "," : "") + to_string(best_bits[i]);
+	INFOLOG("bit-width-search result (layer-fractional-bits): " + bits_text + ", " + to_string(history.size()) + " candidates evaluated");
+}
+
+//Values of one sweep option. A value may list alternatives with |. For loop-orders, the layers are separated by # (or given as an array) and
+//each layer may list alternatives, e.g., "*#oz-oy-ox-iz-kx-ky|oz-ox-oy-iz-kx-ky#*" is two variants.
+vector<string> ExpandSweepValues(string key, json value) {
+	vector<string> result;
+	if (value.is_array()) {
+		for (auto &item : value) {
+			if (item.is_array()) {
+				ASSERT(key == "loop-orders");
+				string joined;
+				for (auto &layer : item) joined += (joined.empty() ? "" : "#") + layer.get<string>();
+				vector<string> expanded = ExpandSweepValues(key, joined);
+				result.insert(result.end(), expanded.begin(), expanded.end());
+			}
+			else {
+				vector<string> expanded = ExpandSweepValues(key, item);
+				result.insert(result.end(), expanded.begin(), expanded.end());
+			}
+		}
+		return result;
+	}
+
+	ASSERT(value.is_string());
+	string text = value.get<string>();
+	if (key != "loop-orders") return SplitString(text, "|");
+
+	result.push_back("");
+	for (string layer_order : SplitString(StringSubstituteAll(text, "\n", "#"), "#")) {
+		vector<string> combined;
+		for (string &prefix : result)
+			for (string &alternative : SplitString(layer_order, "|"))
+				combined.push_back(prefix + (prefix.empty() ? "" : "\n") + alternative);
+		result = combined;
+	}
+	return result;
+}
+
+//Generates the cartesian product of the sweep values from one parse. The variants are generated in parallel into <output-directory>/sweep/<n>/,
+//sweep-manifest.json lists the directory and the swept values of each variant.
+void RunSweep() {
+	json sweep = json::parse(map_options["sweep"]);
+	vector<pair<string, vector<string>>> axes;
+	for (auto &item : sweep.items()) {
+		vector<string> values = ExpandSweepValues(item.key(), item.value());
+		if (values.empty()) {
+			ERRORLOGT("sweep values of " + item.key() + " are empty. It will be ignored.");
+			continue;
+		}
+		axes.push_back(make_pair(item.key(), values));
+	}
+
+	map<string, string> base_options = map_options;
+	base_options.erase("sweep");
+	if (base_options.count("bit-width-search")) {
+		ERRORLOGT("bit-width-search will be ignored in the sweep variants");
+		base_options.erase("bit-width-search");
+	}
+
+	vector<map<string, string>> variants(1);
+	for (auto &axis : axes) {
+		vector<map<string, string>> combined;
+		for (auto &variant : variants)
+			for (auto &value : axis.second) {
+				combined.push_back(variant);
+				combined.back()[axis.first] = value;
+			}
+		variants = combined;
+	}
+
+	string sweep_dir = output_dir + "sweep" + string(1, filesystem::path::preferred_separator);
+	json manifest = json::array();
+	vector<json> estimates(variants.size());
+	vector<string> errors(variants.size()); //Variants that cannot be generated
+	for (size_t v = 0; v < variants.size(); v++) {
+		string directory = sweep_dir + to_string(v + 1) + string(1, filesystem::path::preferred_separator);
+		filesystem::create_directories(directory);
+		json entry;
+		entry["index"] = v + 1;
+		entry["directory"] = directory;
+		entry["options"] = variants[v];
+		manifest.push_back(entry);
+
+		map<string, string> options = base_options;
+		for (auto &option : variants[v]) options[option.first] = option.second;
+		options["output-directory"] = directory;
+		variants[v] = options;
+	}
+	INFOLOG("sweep: " + to_string(variants.size()) + " variants");
+
+	int thread_count = map_options.count("sweep-threads") ? stoi(map_options["sweep-threads"]) : (int)thread::hardware_concurrency();
+	thread_count = max(1, min(thread_count, (int)variants.size()));
+
+	//Layers and the graph are only read by the generators, the option globals are thread_local
+	size_t next_variant = 0;
+	mutex next_variant_mutex;
+	vector<thread> threads;
+	for (int t = 0; t < thread_count; t++) {
+		threads.push_back(thread([&]() {
+			while (true) {
+				size_t index;
+				{
+					lock_guard<mutex> lock(next_variant_mutex);
+					if (next_variant >= variants.size()) return;
+					index = next_variant++;
+				}
+				map_options = variants[index];
+				output_dir = map_options["output-directory"];
+				ApplyOptionFlags();
+				SetNetworkGuess();
+				SetArbitraryParameters();
+				CheckAndCorrectLoopOrders();
+				CheckBatchSize();
+				CheckBatchNormFolding();
+				if (!CheckMergeLayers(errors[index])) continue; //No files, the error is listed in the manifest
+				CheckParallelUnits();
+				CheckSystolicDense();
+				CheckSparseWeights();
+				CheckDenseInputReuse();
+				CheckOutputMode();
+				PlanLayerDataLocations();
+				PlanLocalBuffers();
+
+				GenerateHFileDataTypes(output_dir, layer_fractional_bits);
+				GenerateHFileParamList();
+				GenerateCFiles();
+				if (create_deepcl_config_h) GenerateDeepClConfigH();
+				if (host_library) GenerateHostLibrary();
+				if (cost_model) estimates[index] = GenerateCostModel();
+			}
+		}));
+	}
+	for (auto &th : threads) th.join();
+
+	for (size_t v = 0; v < variants.size(); v++) {
+		if (!estimates[v].is_null()) manifest[v]["estimate"] = estimates[v];
+		if (!errors[v].empty()) manifest[v]["error"] = errors[v];
+	}
+
+	ofstream f_stream(output_dir + "sweep-manifest.json", ios::out);
+	f_stream << manifest.dump(1, '\t') << endl;
+	f_stream.close();
+	INFOLOG("sweep manifest: " + output_dir + "sweep-manifest.json");
+}
+
+//axi-interfaces: the arrays of forward are m_axi ports, with max_widen_bitwidth so that the tool merges sequential accesses into axi_port_width words.
+//Layers that read a port out of order (Conv2D windows, pooling windows, Dense reading its input once per node) first copy it into a local tile
+//with a sequential burst loop. Conv2D writes its output to a local tile that is copied to the port after the layer.
+bool AxiStagedInput(int layer_index) {
+	if (!axi_interfaces) return false;
+	LayerTypes layer_type = Layers[layer_index]->layer_type;
+	if (layer_type == FLATTEN || Layers[layer_index]->MergeLayer()) return false; //Flatten, Add and Concatenate read their inputs in order
+	return TensorInPort(graph.InputTensor(layer_index));
+}
+
+bool AxiStagedOutput(int layer_index) {
+	if (!axi_interfaces) return false;
+	LayerTypes layer_type = Layers[layer_index]->layer_type;
+	if (layer_type != CONV2D && layer_type != DEPTHWISE_CONV2D && layer_type != POINTWISE_CONV2D) return false; //Pooling, flatten and Dense write their outputs in order
+	return layer_index == (int)Layers.size() - 1 || LayerDataLocation(layer_index + 1) != "local";
+}
+
+//The input is still in the output tile of the producer: no burst read
+bool AxiTileReused(int layer_index) {
+	int producer = graph.InputTensor(layer_index).producer;
+	return AxiStagedInput(layer_index) && producer >= 0 && AxiStagedOutput(producer);
+}
+
+//The network input, the network output and the layer outputs placed in ports are arguments of forward
+bool TensorInPort(const Tensor &tensor) {
+	return tensor.producer < 0 || tensor.consumers.empty() || LayerDataLocation(tensor.producer + 1) != "local";
+}
+
+//Element type of a tensor passed to forward
+string AxiTensorType(const Tensor &tensor) {
+	return "DataType_" + tensor.data_type_suffix + (tensor.name == "outputs" && QuantizedMode() ? "_short" : "");
+}
+
+//Inputs/outputs, parameters and port layer data are in separate bundles, so the parameter bursts do not wait for the layer data bursts
+void AddToCFile_AxiInterfaces(CodeEmitter &f_stream) {
+	int current_indent = 1;
+	int layers_size = Layers.size();
+	bool quantized = QuantizedMode();
+	bool packed_weights = quantized && PackedWeightBits() != 0;
+
+	class AxiPort {
+	public:
+		string name, bundle;
+		long long depth; //Elements, used by C/RTL co-simulation
+	};
+	vector<AxiPort> ports;
+	ports.push_back({"inputs", "gmem_io", (long long)graph.InputTensor(0).ElementCount() * batch_size});
+	ports.push_back({"outputs", "gmem_io", (long long)OutputPortSize() * batch_size});
+	if (quantized) {
+		int count = graph.quantized_layer_count;
+		ports.push_back({"input_zero_points", "gmem_params", count});
+		ports.push_back({"output_zero_points", "gmem_params", count});
+		ports.push_back({"input_scale_factors", "gmem_params", count});
+		ports.push_back({"output_scale_factors", "gmem_params", count});
+		for (int i = 0; i < layers_size; i++) {
+			if (Layers[i]->q_index < 0) continue;
+			ports.push_back({"weight_scales_" + to_string(i + 1), "gmem_params", Layers[i]->OutputChannels()});
+		}
+	}
+	for (int i = 0; i < layers_size; i++) {
+		Layer *layer = Layers[i];
+		if (!layer->HasWeights()) continue;
+		vector<int> shape = layer->WeightShape();
+		int channels = layer->OutputChannels();
+		long long rows = 1; //All weight dimensions but the last
+		for (size_t d = 0; d + 1 < shape.size(); d++) rows *= shape[d];
+		bool packed_layer = packed_weights && (layer->layer_type == CONV2D || layer->layer_type == DENSE);
+		if (SparseDensity(i)) {
+			ports.push_back({"weights_" + to_string(i + 1) + "_values", "gmem_params", (long long)SparseCapacity(i) * SparseBlock(i)});
+			ports.push_back({"weights_" + to_string(i + 1) + "_index", "gmem_params", SparseCapacity(i)});
+			ports.push_back({"weights_" + to_string(i + 1) + "_row_ptr", "gmem_params", channels + 1});
+		}
+		else ports.push_back({"weights_" + to_string(i + 1), "gmem_params", rows * (packed_layer ? PackedWeightsSize(shape.back()) : shape.back())});
+		if (biases_enabled) ports.push_back({"biases_" + to_string(i + 1), "gmem_params", channels});
+	}
+	for (int i = 0; i < layers_size - 1; i++) {
+		if (LayerDataLocation(i + 1) == "local") continue;
+		ports.push_back({graph.OutputTensor(i).name, "gmem_data", (long long)graph.OutputTensor(i).ElementCount() * batch_size});
+	}
+
+	AddToCFile_Text(f_stream, "//AXI interfaces: bursts of sequential accesses are widened to " + to_string(axi_port_width) + "-bit words when the arrays are aligned", current_indent);
+	for (AxiPort &port : ports)
+		AddToCFile_Text(f_stream, "#pragma HLS INTERFACE m_axi port=" + port.name + " offset=slave bundle=" + port.bundle + " depth=" + to_string(port.depth) + " max_widen_bitwidth=" + to_string(axi_port_width), current_indent);
+	if (fault_simulation) {
+		for (string scalar : {"faulty_layer", "faulty_fmap", "faulty_bit"}) AddToCFile_Text(f_stream, "#pragma HLS INTERFACE s_axilite port=" + scalar + " bundle=control", current_indent);
+	}
+	AddToCFile_Text(f_stream, "#pragma HLS INTERFACE s_axilite port=return bundle=control", current_indent);
+	AddToCFile_EmptyLine(f_stream, 2);
+}
+
+//Tiles of the staged ports: before the layer, the tiles are declared and the input is read; after the layer, the output tile is written
+void AddToCFile_AxiBurst(CodeEmitter &f_stream, int layer_index, bool before_layer) {
+	int current_indent = 1;
+	string base_for_label = "for" + to_string(layer_index + 1);
+	if (layer_index + 1 >= 10) base_for_label += "t";
+
+	class AxiCopy {
+	public:
+		Tensor *tensor;
+		bool read;
+	};
+	vector<AxiCopy> copies;
+	if (before_layer && AxiStagedInput(layer_index) && !AxiTileReused(layer_index)) copies.push_back({&graph.InputTensor(layer_index), true});
+	if (before_layer && AxiStagedOutput(layer_index)) copies.push_back({&graph.OutputTensor(layer_index), false});
+	if (!before_layer && AxiStagedOutput(layer_index)) copies.push_back({&graph.OutputTensor(layer_index), false});
+
+	for (AxiCopy &copy : copies) {
+		string type = AxiTensorType(*copy.tensor);
+		string tile = copy.tensor->name + "_tile";
+		if (before_layer) {
+			AddToCFile_Text(f_stream, "//Layer " + to_string(layer_index + 1) + ": local tile of " + copy.tensor->name + (copy.read ? ", burst read" : ", written after the layer"), current_indent);
+			AddToCFile_Text(f_stream, type + " " + tile + BatchDimension() + copy.tensor->Dimensions() + ";", current_indent);
+			if (!copy.read) continue;
+		}
+		else {
+			AddToCFile_EmptyLine(f_stream);
+			AddToCFile_Text(f_stream, "//Layer " + to_string(layer_index + 1) + ": burst write of the local tile of " + copy.tensor->name, current_indent);
+		}
+
+		string source = copy.read ? copy.tensor->name : tile;
+		string destination = copy.read ? tile : copy.tensor->name;
+		AddToCFile_Text(f_stream, base_for_label + (copy.read ? "AR" : "AW") + ": for (int i = 0; i < " + to_string((long long)copy.tensor->ElementCount() * batch_size) + "; i++)", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, "#pragma HLS PIPELINE II=1", current_indent);
+		AddToCFile_Text(f_stream, "((" + type + "*)" + destination + ")[i] = ((" + type + "*)" + source + ")[i];", current_indent);
+		AddToCFile_Text(f_stream, "}", --current_indent);
+	}
+	if (before_layer && !copies.empty()) AddToCFile_EmptyLine(f_stream);
+}
+
+//host-library: net.h/net.cpp, a C API around forward() for host programs (serving, verification)
+//net.cpp includes main.cpp with _HLS_RUN, so only forward() is compiled. The parameters are owned by the context.
+void GenerateHostLibrary() {
+	if (single_layer) {
+		ERRORLOGT("host-library is not supported with single-layer");
+		return;
+	}
+
+	int layers_size = Layers.size();
+	bool quantized = QuantizedMode();
+	bool packed_weights = quantized && PackedWeightBits() != 0;
+	int current_indent = 0;
+	string temp_string;
+
+	class HostParam {
+	public:
+		string type, name, dimensions;
+		int count;
+	};
+	vector<HostParam> params; //Arguments of forward, in order (also the order in the parameter file)
+	vector<string> packed_params; //Packed and sparse weights: filled by PackWeights/SparsifyWeights, not in the parameter file
+	if (quantized) {
+		int count = graph.quantized_layer_count;
+		params.push_back({"DataType_IZP", "input_zero_points_src", "[" + to_string(count) + "]", count});
+		params.push_back({"DataType_OZP", "output_zero_points_src", "[" + to_string(count) + "]", count});
+		params.push_back({"DataType_ISF", "input_scale_factors_src", "[" + to_string(count) + "]", count});
+		params.push_back({"DataType_OSF", "output_scale_factors_src", "[" + to_string(count) + "]", count});
+		for (int i = 0; i < layers_size; i++) {
+			if (Layers[i]->q_index < 0) continue;
+			int channels = Layers[i]->OutputChannels();
+			params.push_back({"DataType_WSF", "weight_scales_" + to_string(i + 1) + "_src", "[" + to_string(channels) + "]", channels});
+		}
+	}
+
+	vector<string> forward_weights;
+	for (int i = 0; i < layers_size; i++) {
+		Layer *layer = Layers[i];
+		if (!layer->HasWeights()) continue;
+		vector<int> shape = layer->WeightShape();
+		string dimensions, packed_dimensions;
+		int count = 1, channels = layer->OutputChannels();
+		for (size_t d = 0; d + 1 < shape.size(); d++) dimensions += "[" + to_string(shape[d]) + "]";
+		for (int size : shape) count *= size;
+		bool packed_layer = packed_weights && (layer->layer_type == CONV2D || layer->layer_type == DENSE); //Depthwise and pointwise weights are not packed
+
+		string name = "weights_" + to_string(i + 1);
+		if (packed_layer) packed_dimensions = dimensions + "[" + to_string(PackedWeightsSize(shape.back())) + "]";
+		dimensions += "[" + to_string(shape.back()) + "]";
+		params.push_back({"DataType_weights", name + "_src", dimensions, count});
+		if (packed_layer) {
+			packed_params.push_back("DataType_weights_packed " + name + "_packed_src" + packed_dimensions + ";");
+			forward_weights.push_back("p->" + name + "_packed_src");
+		}
+		else if (SparseDensity(i)) {
+			for (string array : SparseWeightsArrays(i, "_src")) packed_params.push_back(array + ";");
+			for (string suffix : {"_values_src", "_index_src", "_row_ptr_src"}) forward_weights.push_back("p->" + name + suffix);
+		}
+		else forward_weights.push_back("p->" + name + "_src");
+
+		//Biases are declared for PackWeights/forward, but only read from the file when they are enabled
+		if (biases_enabled) {
+			params.push_back({"DataType_biases", "biases_" + to_string(i + 1) + "_src", "[" + to_string(channels) + "]", channels});
+			forward_weights.push_back("p->biases_" + to_string(i + 1) + "_src");
+		}
+		//Folded into the weights and biases by FoldBatchNorm, not passed to forward
+		if (layer->batch_norm && BatchNormFolding()) params.push_back({"float", "batch_norm_" + to_string(i + 1) + "_src", "[4][" + to_string(channels) + "]", 4 * channels});
+	}
+
+	long long param_count = 0;
+	for (HostParam &param : params) param_count += param.count;
+
+	Tensor &input = graph.InputTensor(0);
+
+	//net.h
+	CodeEmitter h_stream;
+	h_stream.open(output_dir + "net.h", ios::out);
+	AddToCFile_Text(h_stream, "#ifndef _NET_H");
+	AddToCFile_Text(h_stream, "#define _NET_H");
+	AddToCFile_EmptyLine(h_stream);
+	AddToCFile_Text(h_stream, "#ifdef __cplusplus");
+	AddToCFile_Text(h_stream, "extern \"C\" {");
+	AddToCFile_Text(h_stream, "#endif");
+	AddToCFile_EmptyLine(h_stream);
+	AddToCFile_Text(h_stream, "#define NET_INPUT_SIZE " + to_string(input.ElementCount()) + " //" + input.Dimensions() + ", row major");
+	AddToCFile_Text(h_stream, "#define NET_OUTPUT_SIZE " + to_string(OutputPortSize()) + (output_top_k ? " //output-mode: class indices, largest output first" : ""));
+	AddToCFile_Text(h_stream, "#define NET_PARAM_COUNT " + to_string(param_count) + " //float32 values in the parameter file");
+	AddToCFile_EmptyLine(h_stream);
+	AddToCFile_Text(h_stream, "typedef struct net_context net_context;");
+	AddToCFile_EmptyLine(h_stream);
+	AddToCFile_Text(h_stream, "//The functions return 0 on success and -1 on failure. A context can run several net_infer_batch calls at the same time.");
+	AddToCFile_Text(h_stream, "net_context* net_create(void);");
+	AddToCFile_Text(h_stream, "//Parameter file: NET_PARAM_COUNT float32 values, the parameter arguments of forward() in order, each array row major");
+	if (BatchNormFolding()) AddToCFile_Text(h_stream, "//A BatchNormalization follows the biases of its layer: gamma, beta, moving mean and moving variance per output channel");
+	AddToCFile_Text(h_stream, "int net_load_params(net_context *ctx, const char *path);");
+	AddToCFile_Text(h_stream, "//inputs: n x NET_INPUT_SIZE, outputs: n x NET_OUTPUT_SIZE");
+	AddToCFile_Text(h_stream, "int net_infer_batch(net_context *ctx, const float *inputs, int n, float *outputs);");
+	AddToCFile_Text(h_stream, "void net_destroy(net_context *ctx);");
+	AddToCFile_EmptyLine(h_stream);
+	AddToCFile_Text(h_stream, "#ifdef __cplusplus");
+	AddToCFile_Text(h_stream, "}");
+	AddToCFile_Text(h_stream, "#endif");
+	AddToCFile_EmptyLine(h_stream);
+	AddToCFile_Text(h_stream, "#endif //_NET_H");
+	h_stream.close();
+
+	//net.cpp
+	CodeEmitter f_stream;
+	f_stream.open(output_dir + "net.cpp", ios::out);
+	AddToCFile_Text(f_stream, "//Build: g++ -std=c++17 -O2 -shared -fPIC net.cpp -o libnet.so");
+	AddToCFile_Text(f_stream, "#ifndef _HLS_RUN");
+	AddToCFile_Text(f_stream, "#define _HLS_RUN //forward() only: Predict() and main() are not part of the library");
+	AddToCFile_Text(f_stream, "#endif");
+	AddToCFile_Text(f_stream, "#include \"main.cpp\"");
+	AddToCFile_Text(f_stream, "#include \"net.h\"");
+	AddToCFile_Text(f_stream, "#include <stdio.h>");
+	if (axi_interfaces) AddToCFile_Text(f_stream, "#include <algorithm>");
+	if (BatchNormFolding()) AddToCFile_Text(f_stream, "#include <cmath>");
+	AddToCFile_Text(f_stream, "#include <memory>");
+	AddToCFile_Text(f_stream, "#include <mutex>");
+	AddToCFile_Text(f_stream, "#include <shared_mutex>");
+	AddToCFile_Text(f_stream, "#include <vector>");
+	AddToCFile_EmptyLine(f_stream);
+
+	AddToCFile_Text(f_stream, "struct net_params {");
+	current_indent++;
+	for (HostParam &param : params) AddToCFile_Text(f_stream, param.type + " " + param.name + param.dimensions + ";", current_indent);
+	for (string &packed_param : packed_params) AddToCFile_Text(f_stream, packed_param, current_indent);
+	if (!biases_enabled) {
+		for (int i = 0; i < layers_size; i++) {
+			if (!Layers[i]->HasWeights()) continue;
+			AddToCFile_Text(f_stream, "DataType_biases biases_" + to_string(i + 1) + "_src[" + to_string(Layers[i]->OutputChannels()) + "];", current_indent);
+		}
+	}
+	if (BatchNormFolding()) AddToCFile_Text(f_stream, "void FoldBatchNorm();", current_indent);
+	if (BiasClamping()) AddToCFile_Text(f_stream, "int ClampBiases();", current_indent);
+	if (packed_weights) AddToCFile_Text(f_stream, "void PackWeights();", current_indent);
+	if (!sparse_density.empty()) AddToCFile_Text(f_stream, "int SparsifyWeights();", current_indent);
+	AddToCFile_Text(f_stream, "};", --current_indent);
+	AddToCFile_EmptyLine(f_stream);
+
+	//Inputs, outputs and port layer outputs: per inference call, so that concurrent calls do not share them
+	vector<string> forward_ports;
+	string ports_struct = Tabs(1) + "InputType inputs;\n" + Tabs(1) + "OutputType outputs;\n";
+	string alignment = to_string(axi_port_width / 8);
+	if (axi_interfaces) {
+		//One buffer for the port layer outputs, laid out by the memory plan: tensors with disjoint lifetimes share a region
+		//Regions are aligned to the AXI port width, so the bursts start at a word boundary
+		ports_struct = Tabs(1) + "alignas(" + alignment + ") InputType inputs;\n" + Tabs(1) + "alignas(" + alignment + ") OutputType outputs;\n";
+		vector<vector<int>> regions(graph.buffer_count);
+		for (int i = 0; i < layers_size - 1; i++)
+			if (LayerDataLocation(i + 1) != "local") regions[graph.OutputTensor(i).buffer].push_back(i);
+
+		AddToCFile_Text(f_stream, "//Port layer outputs in one buffer, laid out by the memory plan: tensors with disjoint lifetimes share a region");
+		AddToCFile_Text(f_stream, "constexpr size_t net_align(size_t bytes) { return (bytes + " + alignment + " - 1) / " + alignment + " * " + alignment + "; }");
+		string offset = "0";
+		for (size_t region = 0; region < regions.size(); region++) {
+			if (regions[region].empty()) continue;
+			string size = "";
+			for (int i : regions[region]) {
+				Tensor &tensor = graph.OutputTensor(i);
+				AddToCFile_Text(f_stream, "constexpr size_t net_offset_" + tensor.name + " = " + offset + ";");
+				string bytes = "sizeof(DataType_" + tensor.data_type_suffix + BatchDimension() + tensor.Dimensions() + ")";
+				size = size == "" ? bytes : "std::max(" + size + ", " + bytes + ")";
+			}
+			AddToCFile_Text(f_stream, "constexpr size_t net_region_" + to_string(region) + " = net_align(" + size + ");");
+			offset = offset == "0" ? "net_region_" + to_string(region) : offset + " + net_region_" + to_string(region);
+		}
+		for (int i = 0; i < layers_size - 1; i++) {
+			if (LayerDataLocation(i + 1) == "local") continue;
+			Tensor &tensor = graph.OutputTensor(i);
+			string dimensions = BatchDimension() + tensor.Dimensions();
+			dimensions = dimensions.substr(dimensions.find(']') + 1); //forward takes a pointer to the first dimension
+			string pointer_type = dimensions == "" ? "DataType_" + tensor.data_type_suffix + "*" : "DataType_" + tensor.data_type_suffix + " (*)" + dimensions;
+			forward_ports.push_back("(" + pointer_type + ")(ports->layer_data + net_offset_" + tensor.name + ")");
+		}
+		if (!forward_ports.empty()) {
+			AddToCFile_Text(f_stream, "constexpr size_t net_layer_data_bytes = " + offset + ";");
+			ports_struct += Tabs(1) + "alignas(" + alignment + ") unsigned char layer_data[net_layer_data_bytes];\n";
+		}
+		AddToCFile_EmptyLine(f_stream);
+	}
+	else {
+		for (int i = 0; i < layers_size - 1; i++) {
+			if (LayerDataLocation(i + 1) == "local") continue;
+			Tensor &tensor = graph.OutputTensor(i);
+			ports_struct += Tabs(1) + "DataType_" + tensor.data_type_suffix + " " + tensor.name + BatchDimension() + tensor.Dimensions() + ";\n";
+			forward_ports.push_back("ports->" + tensor.name);
+		}
+	}
+	AddToCFile_Text(f_stream, "struct net_ports {");
+	f_stream << ports_struct;
+	AddToCFile_Text(f_stream, "};");
+	AddToCFile_EmptyLine(f_stream);
+
+	AddToCFile_Text(f_stream, "struct net_context {");
+	AddToCFile_Text(f_stream, "std::shared_mutex lock; //Shared by the inferences, exclusive while the parameters are replaced", 1);
+	AddToCFile_Text(f_stream, "std::unique_ptr<net_params> params;", 1);
+	AddToCFile_Text(f_stream, "};");
+	AddToCFile_EmptyLine(f_stream);
+
+	if (BatchNormFolding()) {
+		AddToCFile_FoldBatchNormFunction(f_stream, "net_params::FoldBatchNorm");
+		AddToCFile_EmptyLine(f_stream);
+	}
+	if (BiasClamping()) {
+		AddToCFile_ClampBiasesFunction(f_stream, "net_params::ClampBiases");
+		AddToCFile_EmptyLine(f_stream);
+	}
+	if (packed_weights) {
+		AddToCFile_PackWeightsFunction(f_stream, "net_params::PackWeights");
+		AddToCFile_EmptyLine(f_stream);
+	}
+	if (!sparse_density.empty()) {
+		AddToCFile_SparsifyWeightsFunction(f_stream, "net_params::SparsifyWeights");
+		AddToCFile_EmptyLine(f_stream);
+	}
+
+	AddToCFile_Text(f_stream, "template <class T> static void net_read(T *data, size_t count, const float *&values)");
+	AddToCFile_Text(f_stream, "{");
+	AddToCFile_Text(f_stream, "for (size_t i = 0; i < count; i++) data[i] = (T)*values++;", 1);
+	AddToCFile_Text(f_stream, "}");
+	AddToCFile_EmptyLine(f_stream);
+
+	AddToCFile_Text(f_stream, "extern \"C\" net_context* net_create(void)");
+	AddToCFile_Text(f_stream, "{");
+	AddToCFile_Text(f_stream, "return new net_context();", 1);
+	AddToCFile_Text(f_stream, "}");
+	AddToCFile_EmptyLine(f_stream);
+
+	AddToCFile_Text(f_stream, "extern \"C\" int net_load_params(net_context *ctx, const char *path)");
+	AddToCFile_Text(f_stream, "{");
+	current_indent = 1;
+	AddToCFile_Text(f_stream, "if (!ctx) return -1;", current_indent);
+	AddToCFile_Text(f_stream, "FILE *file = fopen(path, \"rb\");", current_indent);
+	AddToCFile_Text(f_stream, "if (!file) return -1;", current_indent);
+	AddToCFile_Text(f_stream, "std::vector<float> file_values(NET_PARAM_COUNT + 1);", current_indent);
+	AddToCFile_Text(f_stream, "size_t read_count = fread(file_values.data(), sizeof(float), NET_PARAM_COUNT + 1, file);", current_indent);
+	AddToCFile_Text(f_stream, "fclose(file);", current_indent);
+	AddToCFile_Text(f_stream, "if (read_count != NET_PARAM_COUNT) return -1;", current_indent);
+	AddToCFile_EmptyLine(f_stream);
+	AddToCFile_Text(f_stream, "std::unique_ptr<net_params> p(new net_params());", current_indent);
+	AddToCFile_Text(f_stream, "const float *values = file_values.data();", current_indent);
+	for (HostParam &param : params) {
+		f_stream.LineTemplate("net_read((@*)p->#, sizeof(p->#) / sizeof(@), values);", {{'#', param.name}, {'@', param.type}}, current_indent);
+	}
+	if (BatchNormFolding()) AddToCFile_Text(f_stream, "p->FoldBatchNorm();", current_indent);
+	if (BiasClamping()) AddToCFile_Text(f_stream, "p->ClampBiases(); //Biases out of the accumulator bias bits are saturated", current_indent);
+	if (packed_weights) AddToCFile_Text(f_stream, "p->PackWeights();", current_indent);
+	if (!sparse_density.empty()) AddToCFile_Text(f_stream, "if (p->SparsifyWeights() != 0) return -1; //The compressed arrays are too small for these weights", current_indent);
+	AddToCFile_EmptyLine(f_stream);
+	AddToCFile_Text(f_stream, "std::unique_lock<std::shared_mutex> guard(ctx->lock);", current_indent);
+	AddToCFile_Text(f_stream, "ctx->params = std::move(p);", current_indent);
+	AddToCFile_Text(f_stream, "return 0;", current_indent);
+	AddToCFile_Text(f_stream, "}");
+	AddToCFile_EmptyLine(f_stream);
+
+	AddToCFile_Text(f_stream, "extern \"C\" int net_infer_batch(net_context *ctx, const float *inputs, int n, float *outputs)");
+	AddToCFile_Text(f_stream, "{");
+	AddToCFile_Text(f_stream, "if (!ctx || n < 0) return -1;", current_indent);
+	AddToCFile_Text(f_stream, "std::shared_lock<std::shared_mutex> guard(ctx->lock);", current_indent);
+	AddToCFile_Text(f_stream, "net_params *p = ctx->params.get();", current_indent);
+	AddToCFile_Text(f_stream, "if (!p) return -1;", current_indent);
+	AddToCFile_Text(f_stream, "std::unique_ptr<net_ports> ports(new net_ports());", current_indent);
+	AddToCFile_EmptyLine(f_stream);
+	if (batch_size > 1) {
+		//forward() runs batch_size images: the last call of a batch can be partial
+		AddToCFile_Text(f_stream, "for (int b = 0; b < n; b += " + to_string(batch_size) + ")", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, "int count = n - b < " + to_string(batch_size) + " ? n - b : " + to_string(batch_size) + ";", current_indent);
+		AddToCFile_Text(f_stream, "net_read((DataType_input*)ports->inputs, count * NET_INPUT_SIZE, inputs);", current_indent);
+	}
+	else {
+		AddToCFile_Text(f_stream, "for (int b = 0; b < n; b++)", current_indent);
+		AddToCFile_Text(f_stream, "{", current_indent++);
+		AddToCFile_Text(f_stream, "net_read((DataType_input*)ports->inputs, NET_INPUT_SIZE, inputs);", current_indent);
+	}
+	AddToCFile_Text(f_stream, "forward(ports->inputs, ports->outputs,", current_indent);
+	if (fault_simulation) AddToCFile_Text(f_stream, "0, 0, 0,", current_indent + 2);
+	if (quantized) {
+		temp_string = "p->input_zero_points_src, p->output_zero_points_src, p->input_scale_factors_src, p->output_scale_factors_src";
+		for (int i = 0; i < layers_size; i++)
+			if (Layers[i]->q_index >= 0) temp_string += ", p->weight_scales_" + to_string(i + 1) + "_src";
+		AddToCFile_Text(f_stream, temp_string + ",", current_indent + 2);
+	}
+	vector<string> forward_arguments = forward_weights;
+	forward_arguments.insert(forward_arguments.end(), forward_ports.begin(), forward_ports.end());
+	temp_string = "";
+	for (size_t i = 0; i < forward_arguments.size(); i++) {
+		temp_string += forward_arguments[i] + (i + 1 < forward_arguments.size() ? ", " : ");");
+		if ((i + 1) % 6 == 0 && i + 1 < forward_arguments.size()) {
+			AddToCFile_Text(f_stream, temp_string, current_indent + 2);
+			temp_string = "";
+		}
+	}
+	AddToCFile_Text(f_stream, temp_string, current_indent + 2);
+	if (batch_size > 1) {
+		AddToCFile_Text(f_stream, "for (int batch = 0; batch < count; batch++)", current_indent);
+		AddToCFile_Text(f_stream, "for (int i = 0; i < NET_OUTPUT_SIZE; i++) *outputs++ = (float)ports->outputs[batch][i];", current_indent + 1);
+	}
+	else AddToCFile_Text(f_stream, "for (int i = 0; i < NET_OUTPUT_SIZE; i++) *outputs++ = (float)ports->outputs[i];", current_indent);
+	AddToCFile_Text(f_stream, "}", --current_indent);
+	AddToCFile_Text(f_stream, "return 0;", current_indent);
+	AddToCFile_Text(f_stream, "}");
+	AddToCFile_EmptyLine(f_stream);
+
+	AddToCFile_Text(f_stream, "extern \"C\" void net_destroy(net_context *ctx)");
+	AddToCFile_Text(f_stream, "{");
+	AddToCFile_Text(f_stream, "delete ctx;", 1);
+	AddToCFile_Text(f_stream, "}");
+	f_stream.close();
+}
+
+//Analytic cost model
+//The generated loops are not unrolled: each Conv2D/Dense layer has one MAC unit, and the innermost (kernel) loop is pipelined.
+//The accumulation is always in the innermost loops, so a floating-point adder limits the II to its latency.
+const int COST_FLOAT_ADD_LATENCY = 4;
+const int COST_PIPELINE_DEPTH_FLOAT = 10;
+const int COST_PIPELINE_DEPTH_FIXED = 4;
+const int COST_BRAM18K_BYTES = 2304;
+const int COST_URAM_BYTES = 36864;
+const int COST_URAM_THRESHOLD_BYTES = 65536; //Larger buffers are assumed to be mapped to URAM
+const int COST_REGISTER_THRESHOLD_BITS = 1024; //Smaller buffers are assumed to be mapped to registers
+
+class LayerCost {
+public:
+	long long macs = 0, cycles = 0;
+	int ii = 1, dsp = 0, bram18k = 0, uram = 0;
+	long long on_chip_bytes = 0, ddr_read_bytes = 0, ddr_write_bytes = 0;
+	json buffers = json::array();
+
+	void AddBuffer(string name, long long elements, int bits) {
+		long long bytes = (elements * bits + 7) / 8;
+		json buffer;
+		buffer["name"] = name;
+		buffer["bytes"] = bytes;
+		if (elements * bits <= COST_REGISTER_THRESHOLD_BITS) buffer["memory"] = "registers";
+		else if (bytes >= COST_URAM_THRESHOLD_BYTES) {
+			buffer["memory"] = "uram";
+			buffer["blocks"] = (bytes + COST_URAM_BYTES - 1) / COST_URAM_BYTES;
+			uram += buffer["blocks"].get<int>();
+		}
+		else {
+			buffer["memory"] = "bram";
+			buffer["blocks"] = (bytes + COST_BRAM18K_BYTES - 1) / COST_BRAM18K_BYTES;
+			bram18k += buffer["blocks"].get<int>();
+		}
+		on_chip_bytes += bytes;
+		buffers.push_back(buffer);
+	}
+};
+
+//Bits of the layer data in the selected data type mode (all-modes: FLOAT_DATATYPE, the default in data-types.h)
+int CostDataBits() {
+	if (data_type_mode_floating_point) return 32;
+	if (QuantizedMode()) return 8;
+	if (network_guess == "vgg") return 26;
+	if (network_guess == "vgg-scalehls") return 8;
+	return 16;
+}
+
+int CostWeightBits() {
+	if (!data_type_mode_floating_point && QuantizedMode() && PackedWeightBits()) return PackedWeightBits();
+	return CostDataBits();
+}
+
+//DataType in the quantized modes (the Conv2D/Dense accumulators before the requantization)
+int CostBaseBits() {
+	return (network_guess == "alexnet" && data_type_mode_detail != "default_int8_t") ? 32 : 64;
+}
+
+int CostAccumulatorBits(int layer_index) {
+	if (data_type_mode_floating_point) return 32;
+	if (!QuantizedMode()) return CostDataBits();
+	if (!accumulator_width.empty()) return AccumulatorBits(layer_index);
+	return CostBaseBits();
+}
+
+int CostMacDsps(int layer_index) {
+	if (data_type_mode_floating_point) return 5; //fmul: 3, fadd: 2
+	if (approximate_multipliers && approximate_multipliers_configuration[layer_index] == '1') return 0; //LUT based
+	if (QuantizedMode()) return PackedWeightBits() ? 0 : 1; //Sub-byte weights: sign select/LUT multipliers
+	int bits = CostDataBits();
+	return bits <= 18 ? 1 : (bits <= 27 ? 2 : 4);
+}
+
+//Number of temp_element entries: the output loops inside the input channel loop need one accumulator each (see AddToCFile_Conv2dLayer)
+int CostTempElementCount(Layer *layer, string loop_order) {
+	size_t iz_position = loop_order.find("iz");
+	if (iz_position == string::npos) return 1;
+	int count = 1;
+	if (loop_order.find("ox") > iz_position) count *= layer->output_size_x;
+	if (loop_order.find("oy") > iz_position) count *= layer->output_size_y;
+	if (loop_order.find("oz") > iz_position) count *= layer->output_size_z; //PointwiseConv2D oy-ox-iz-oz
+	return count;
+}
+
+//Elements read from the input of a layer (DSP packing: one read for two output channels)
+long long CostInputReads(int layer_index) {
+	Layer *layer = Layers[layer_index];
+	long long outputs = (long long)layer->output_size_x * layer->output_size_y * layer->output_size_z * batch_size;
+	switch (layer->layer_type) {
+		case CONV2D:
+		case DENSE: {
+			bool conv = layer->layer_type == CONV2D;
+			long long macs = outputs * (conv ? (long long)layer->kernel_size_rows * layer->kernel_size_cols * layer->input_size_z : layer->input_size_x);
+			int output_channels = conv ? layer->output_size_z : layer->output_size_x;
+			if (!conv && SystolicColumns(layer_index)) return macs / SystolicColumns(layer_index); //systolic-dense: the row feeders read each input once per column tile
+			if (SparseDensity(layer_index) != 0) return (long long)(macs * SparseDensity(layer_index)); //sparse-weights: only the inputs of the stored weights are read
+			if (DenseOxBlock(layer_index)) return macs / DenseOxBlock(layer_index); //ix-ox: each input is read once per block of output nodes
+			return (dsp_packing && !data_type_mode_floating_point && output_channels % 2 == 0) ? macs / 2 : macs;
+		}
+		case DEPTHWISE_CONV2D: return outputs * layer->ReductionLength();
+		case POINTWISE_CONV2D: {
+			bool input_reuse = loop_orders[layer_index].substr(6) == "iz-oz"; //Each input element is read once for all the output channels of a pixel
+			return input_reuse ? outputs / layer->output_size_z * layer->input_size_z : outputs * layer->input_size_z;
+		}
+		case POOLING2D: return outputs * layer->kernel_size_rows * layer->kernel_size_cols;
+		case FLATTEN: return outputs;
+		case ADD: return outputs * layer->input_tensors.size();
+		case CONCATENATE: return outputs;
+	}
+	return 0;
+}
+
+json CostToJson(LayerCost &cost) {
+	json result;
+	result["macs"] = cost.macs;
+	result["ii"] = cost.ii;
+	result["cycles"] = cost.cycles;
+	result["dsp"] = cost.dsp;
+	result["bram18k"] = cost.bram18k;
+	result["uram"] = cost.uram;
+	result["on_chip_bytes"] = cost.on_chip_bytes;
+	result["ddr_read_bytes"] = cost.ddr_read_bytes;
+	result["ddr_write_bytes"] = cost.ddr_write_bytes;
+	return result;
+}
+
+//Writes cost-model.json and cost-model.csv next to the generated code and returns the totals
+json GenerateCostModel() {
+	int layers_size = Layers.size();
+	bool floating_point = data_type_mode_floating_point;
+	int data_bits = CostDataBits();
+	int weight_bits = CostWeightBits();
+	int depth = floating_point ? COST_PIPELINE_DEPTH_FLOAT : COST_PIPELINE_DEPTH_FIXED;
+
+	json layers_json = json::array();
+	LayerCost total;
+	string csv = "layer,type,loop order,macs,ii,cycles,dsp,bram18k,uram,on-chip bytes,ddr read bytes,ddr write bytes\n";
+	vector<bool> buffer_counted(graph.tensors.size(), false); //Arrays shared by local outputs (PlanLocalBuffers)
+
+	for (int i = 0; i < layers_size; i++) {
+		Layer *layer = Layers[i];
+		LayerCost cost;
+		bool last_layer = i == layers_size - 1;
+		bool input_port = TensorInPort(graph.InputTensor(i));
+		bool output_port = last_layer || LayerDataLocation(i + 1) != "local";
+		long long outputs = (long long)layer->output_size_x * layer->output_size_y * layer->output_size_z * batch_size; //All the images of a forward call
+		string loop_order = i < (int)loop_orders.size() ? loop_orders[i] : "";
+
+		if (layer->HasWeights()) {
+			bool conv = layer->layer_type != DENSE;
+			bool kernel_loops = layer->layer_type == CONV2D || layer->layer_type == DEPTHWISE_CONV2D; //Innermost loops: kx-ky, otherwise the reduction
+			long long reduction = layer->ReductionLength();
+			int output_channels = layer->OutputChannels();
+			bool dsp_pack_layer = dsp_packing && !floating_point && output_channels % 2 == 0 && (layer->layer_type == CONV2D || layer->layer_type == DENSE);
+
+			cost.macs = outputs * reduction;
+			long long iterations = dsp_pack_layer ? cost.macs / 2 : cost.macs;
+			long long inner_loop_entries = iterations / batch_size / (kernel_loops ? layer->kernel_size_rows * layer->kernel_size_cols : reduction); //The batch loop is inside the MAC loop
+			bool sparse = SparseDensity(i) != 0;
+			if (sparse) {
+				//sparse-weights: one pipelined loop per output element over its stored blocks (the weights of a block are used in one iteration)
+				cost.macs = (long long)(cost.macs * SparseDensity(i));
+				iterations = cost.macs / SparseBlock(i);
+				inner_loop_entries = outputs / batch_size;
+			}
+			int ox_block = DenseOxBlock(i);
+			if (ox_block) {
+				//ix-ox: one pipelined input_x loop per block of output nodes, each iteration does the MACs of the whole block
+				iterations = cost.macs / ox_block;
+				inner_loop_entries = outputs / batch_size / ox_block;
+			}
+			cost.ii = floating_point ? (COST_FLOAT_ADD_LATENCY + batch_size - 1) / batch_size : 1; //Consecutive batch iterations update different accumulators
+			int units = ParallelUnits(i);
+			cost.cycles = (iterations * cost.ii + inner_loop_entries * depth + outputs) / units; //parallel-units: the units share the output channels
+			cost.dsp = CostMacDsps(i) * units * max(1, ox_block);
+
+			int accumulator_bits = CostAccumulatorBits(i);
+			cost.AddBuffer("temp_element" + to_string(i + 1), (conv ? CostTempElementCount(layer, loop_order) : max(1, ox_block)) * batch_size, accumulator_bits);
+
+			int prefetch_block = WeightPrefetchBlock(i);
+			if (prefetch_block) {
+				//Each weight is read once into the ping-pong tiles. Only the first tile load is not hidden behind the compute.
+				cost.AddBuffer("weights_" + to_string(i + 1) + "_tile", 2 * reduction * prefetch_block, weight_bits);
+				cost.ddr_read_bytes += reduction * output_channels * weight_bits / 8;
+				cost.cycles += reduction * prefetch_block;
+			}
+			else cost.ddr_read_bytes += cost.macs / batch_size * weight_bits / 8; //weights are arguments of forward, read once for all the images of a batch
+			if (sparse) cost.ddr_read_bytes += iterations / batch_size * 2 + (output_channels + 1) * 2; //Block indices and row pointers (16 bits)
+
+			if (!conv && SystolicRows(i)) {
+				//systolic-dense: per column tile, the time loops (fill and drain: rows + columns - 2 iterations) and the write back of the tile
+				long long rows = SystolicRows(i), columns = SystolicColumns(i), column_tiles = output_channels / columns;
+				cost.ii = floating_point ? COST_FLOAT_ADD_LATENCY : 1; //Each PE adds to the sum of the previous iteration
+				if (SystolicOutputStationary(i)) {
+					long long image_tiles = batch_size / rows;
+					cost.cycles = column_tiles * (image_tiles * (1 + (reduction + rows + columns - 2) * cost.ii + depth + 1) + columns * batch_size);
+					cost.ddr_read_bytes += (image_tiles - 1) * reduction * output_channels * weight_bits / 8; //The weights are streamed once per image tile
+				}
+				else cost.cycles = column_tiles * ((reduction / rows) * (rows * columns + (batch_size + rows + columns - 2) * cost.ii + depth) + columns * batch_size);
+				cost.dsp = CostMacDsps(i) * rows * columns;
+			}
+		}
+		else if (layer->layer_type == POOLING2D) {
+			long long window = (long long)layer->kernel_size_rows * layer->kernel_size_cols;
+			cost.cycles = outputs * ((window + 1) / 2) + depth; //Two reads per cycle (dual port memory)
+			if (layer->fused_into >= 0 && GlobalPoolingFused(layer->fused_into)) cost.cycles = outputs + depth; //The sums are added by the previous layer
+			if (layer->fused_into >= 0 && MaxPoolingFused(layer->fused_into)) cost.cycles = 0; //The maximums are written by the previous layer
+		}
+		else if (layer->layer_type == FLATTEN) {
+			cost.cycles = FlattenView(i) ? 0 : outputs + depth; //A view: the next layer reads the input
+		}
+		else if (layer->MergeLayer()) {
+			cost.cycles = (layer->layer_type == ADD ? outputs : 0) + outputs + depth; //Add: one read per input and cycle (dual port memory)
+			if (layer->fused_into >= 0 && AddFused(layer->fused_into)) cost.cycles = 0; //The sum is written by the previous layer
+		}
+
+		if (layer->MergeLayer()) {
+			for (int input_tensor : layer->input_tensors)
+				if (TensorInPort(graph.tensors[input_tensor])) cost.ddr_read_bytes += (long long)graph.tensors[input_tensor].ElementCount() * batch_size * data_bits / 8;
+		}
+		else if (input_port && !AxiTileReused(i)) cost.ddr_read_bytes += (AxiStagedInput(i) ? (long long)graph.InputTensor(i).ElementCount() * batch_size : CostInputReads(i)) * data_bits / 8;
+		if (AxiStagedInput(i) && !AxiTileReused(i)) cost.AddBuffer(graph.InputTensor(i).name + "_tile", (long long)graph.InputTensor(i).ElementCount() * batch_size, data_bits);
+		if (AxiStagedOutput(i)) cost.AddBuffer(graph.OutputTensor(i).name + "_tile", outputs, data_bits);
+
+		if (last_layer && output_top_k) cost.AddBuffer("top_values", (long long)output_top_k * batch_size, data_bits);
+		if (output_port && last_layer && output_top_k) cost.ddr_write_bytes += (long long)output_top_k * batch_size * 4; //Class indices (int)
+		else if (output_port) cost.ddr_write_bytes += outputs * data_bits / 8;
+		else if (GlobalPoolingFused(i)) cost.AddBuffer(graph.OutputTensor(layer->fused_pooling).name + "_sum", (long long)layer->output_size_z * batch_size, data_bits); //Instead of the feature map
+		else if (!last_layer && !AddFused(i) && !MaxPoolingFused(i) && !FlattenView(i)) { //A fused Add: the output of the Add instead
+			int buffer = LocalBuffer(i);
+			if (buffer < 0) cost.AddBuffer("l" + to_string(i + 1), outputs, data_bits);
+			else if (!buffer_counted[buffer]) cost.AddBuffer("buffer" + to_string(buffer), outputs, data_bits); //Shared by outputs of the same size: counted once
+			if (buffer >= 0) buffer_counted[buffer] = true;
+		}
+
+		json layer_json = CostToJson(cost);
+		layer_json["layer"] = i + 1;
+		layer_json["type"] = LayerTypesToString(layer->layer_type);
+		layer_json["loop_order"] = loop_order;
+		layer_json["buffers"] = cost.buffers;
+		layers_json.push_back(layer_json);
+
+		csv += to_string(i + 1) + "," + LayerTypesToString(layer->layer_type) + "," + loop_order + "," + to_string(cost.macs) + "," + to_string(cost.ii) + "," + to_string(cost.cycles) + "," 
+			+ to_string(cost.dsp) + "," + to_string(cost.bram18k) + "," + to_string(cost.uram) + "," + to_string(cost.on_chip_bytes) + "," + to_string(cost.ddr_read_bytes) + "," + to_string(cost.ddr_write_bytes) + "\n";
+
+		total.macs += cost.macs;
+		total.cycles += cost.cycles; //Layers run one after the other
+		total.dsp += cost.dsp;
+		total.bram18k += cost.bram18k;
+		total.uram += cost.uram;
+		total.on_chip_bytes += cost.on_chip_bytes;
+		total.ddr_read_bytes += cost.ddr_read_bytes;
+		total.ddr_write_bytes += cost.ddr_write_bytes;
+	}
+	total.ii = 0;
+
+	json total_json = CostToJson(total);
+	total_json.erase("ii");
+	total_json["clock_mhz"] = clock_mhz;
+	total_json["batch_size"] = batch_size;
+	total_json["latency_us"] = total.cycles / clock_mhz;
+
+	json model;
+	model["data_bits"] = data_bits;
+	model["weight_bits"] = weight_bits;
+	model["layers"] = layers_json;
+	model["total"] = total_json;
+	StringToFile(model.dump(1, '\t') + "\n", output_dir + "cost-model.json");
+
+	csv += "total,,," + to_string(total.macs) + ",," + to_string(total.cycles) + "," + to_string(total.dsp) + "," + to_string(total.bram18k) + "," + to_string(total.uram) + "," 
+		+ to_string(total.on_chip_bytes) + "," + to_string(total.ddr_read_bytes) + "," + to_string(total.ddr_write_bytes) + "\n";
+	StringToFile(csv, output_dir + "cost-model.csv");
+
+	return total_json;
+}
@@ -11,6 +11,7 @@ You should have received a copy of the GNU General Public License along with thi
 #include <fstream>
 #include <filesystem> //since c++ 17 //Project Properties - C / C++ - Language - C++ Language Standard - ISO C++17 Standard(/ std:c++17)
 #include <algorithm>
+#include <mutex>
 #ifndef __linux__
 #include <Windows.h> //To add colors to display messages
 #endif
@@ -22,6 +23,8 @@ using std::endl;
 using std::ofstream;
 
 int ErrorLog(string File, int Line, string text, string log_type) {
+	static std::mutex log_mutex; //Sweep variants are generated in parallel threads
+	std::lock_guard<std::mutex> lock(log_mutex);
 	ofstream f_ErrorLog;
 	extern string log_location;
 
@@ -117,7 +120,7 @@ string CurrentDirectory() {
       std::filesystem::create_directories(workspace_dir);
     }
 
-    extern string output_dir;
+    extern thread_local string output_dir;
     output_dir = workspace_dir;
     extern string input_file_name;
     input_file_name = workspace_dir + "output_arch.py";
@@ -172,6 +175,12 @@ vector<string> SplitString(string pString, string pDelimeters) {
 	return result;
 }
 
+string JoinStrings(const vector<string> &pStrings, string pSeparator) {
+	string result;
+	for (size_t i = 0; i < pStrings.size(); i++) result += (i ? pSeparator : "") + pStrings[i];
+	return result;
+}
+
 int OccurancesInString(const string& pString, const char& pChar) {
 	size_t loc = 0;
 	int result = 0;
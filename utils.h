@@ -36,6 +36,7 @@ string CurrentDirectory();
 string GetWorkspaceDir();
 string FindFileFullPath(string pFileName);
 vector<string> SplitString(string pString, string pDelimeters);
+string JoinStrings(const vector<string> &pStrings, string pSeparator);
 string GetCurrentDateTime();
 
 #endif //UTILS_H_
\ No newline at end of file